@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "calculator.h"
 
@@ -74,9 +75,97 @@ TEST_CASE(test_divides) {
     ASSERT_EQ(result, 4, "%d");
 }
 
+FIXTURE(long_sum) {
+    char str[1024];
+};
+
+FIXTURE_SETUP(long_sum) {
+    char* ptr = fixture->str;
+    for (int i = 0; i < 256; ++i) {
+        *ptr++ = '1';
+        *ptr++ = ' ';
+    }
+    for (int i = 1; i < 256; ++i)
+        *ptr++ = '+';
+    *ptr = 0;
+}
+
+TEST_CASE_F(test_long_sum, long_sum) {
+    int result = calculate(fixture->str);
+
+    ASSERT_EQ(result, 256, "%d");
+}
+
 BENCHMARK(benchmark_add, iterations) {
     for (int i = 0; i < iterations; ++i) {
         char* str = "20 5 +";
         int result = calculate(str);
+        LR_DO_NOT_OPTIMIZE(result);
+    }
+}
+
+BENCHMARK_RANGE(benchmark_add_n, iterations, n, 8, 256, 2) {
+    char str[1024];
+    char* ptr = str;
+    for (int i = 0; i < n; ++i) {
+        *ptr++ = '1';
+        *ptr++ = ' ';
+    }
+    for (int i = 1; i < n; ++i)
+        *ptr++ = '+';
+    *ptr = 0;
+    lr_set_bytes_processed(iterations * (ptr - str));
+
+    BEGIN_BENCHMARK();
+    for (int i = 0; i < iterations; ++i) {
+        int result = calculate(str);
+        LR_DO_NOT_OPTIMIZE(result);
     }
-}
\ No newline at end of file
+    END_BENCHMARK();
+}
+
+BENCHMARK_F(benchmark_long_sum, long_sum, iterations) {
+    for (int i = 0; i < iterations; ++i) {
+        int result = calculate(fixture->str);
+        LR_DO_NOT_OPTIMIZE(result);
+    }
+}
+
+// calculate asserts its input is well formed, so the fuzzer only passes it
+// what it accepts: numbers of up to 9 digits, and operators with two operands
+// on the stack. Division is left out, since dividing by 0 is undefined.
+static int is_well_formed(char* str)
+{
+    int stack_size = 0;
+    int pending = 0;
+    int digits = 0;
+
+    for (char* ptr = str; *ptr; ptr++) {
+        if (*ptr == ' ') {
+            stack_size++;
+            pending = 0;
+            digits = 0;
+        } else if (*ptr == '+' || *ptr == '-' || *ptr == '*') {
+            if (stack_size < 2)
+                return 0;
+            stack_size--;
+        } else if (*ptr >= '0' && *ptr <= '9' && ++digits <= 9) {
+            pending = pending || *ptr != '0';
+        } else {
+            return 0;
+        }
+    }
+
+    return (!pending && stack_size == 1) || (stack_size == 0 && pending);
+}
+
+FUZZ_TEST(fuzz_calculate, data, size) {
+    char str[256];
+    if (size >= (int64_t)sizeof(str))
+        return;
+    memcpy(str, data, size);
+    str[size] = 0;
+
+    if (is_well_formed(str))
+        calculate(str);
+}
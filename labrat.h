@@ -55,6 +55,16 @@
 //  # run benchmarks
 //  ./program --lr-run-benchmarks 1000
 //
+//  # run some of them, calibrating the iteration count for each
+//  ./program --lr-run-benchmarks --lr-bench-filter 'parse_*'
+//
+//  # save a baseline, then fail if anything got slower than it
+//  ./program --lr-run-benchmarks 1000 --lr-bench-save base.txt
+//  ./program --lr-run-benchmarks 1000 --lr-bench-compare base.txt
+//
+//  # fuzz a FUZZ_TEST for a minute
+//  ./program --lr-fuzz fuzz_calculate --lr-fuzz-time 60
+//
 //  ```
 //
 //  ### Using MSVC (command line):
@@ -84,27 +94,30 @@
 #ifndef LABRAT_H
 #define LABRAT_H
 
+// the implementation needs CPU affinity, which glibc hides behind this
+#if defined(LR_IMPLEMENTATION) || defined(LR_GEN_EXECUTABLE)
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#endif
+
 #pragma warning(push, 0)
 #define _CRT_SECURE_NO_WARNINGS
 #include <assert.h>
+#include <float.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 
-#pragma warning(pop)
-
-// This will forward declare all of our test and benchmark functions so they
-// may be referenced here.
-#if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST) ///////////////////////
-#define TEST_DEFINITION(id) void id(void);
-#define BENCH_DEFINITION(id) void id(int64_t iterations);
-#include "labrat_data.c"
-#undef TEST_DEFINITION
-#undef BENCH_DEFINITION
+#ifdef _MSC_VER
+#include <intrin.h>
 #endif
-////////////////////////////////////////////////////////////////////////////////
+
+#pragma warning(pop)
 
 void _lr_set_color_grn();
 void _lr_set_color_red();
@@ -114,9 +127,28 @@ void _lr_set_color_wht();
 
 void _lr_begin_benchmark();
 void _lr_end_benchmark();
+void _lr_pause_timing();
+void _lr_resume_timing();
 
 void _lr_fail_current_test();
 
+// May be called from inside a benchmark. Bytes and items are the totals for
+// the whole run and are reported per second. Counters are summed across
+// calls, and reported per iteration or, with lr_counter_rate, per second.
+void lr_set_bytes_processed(int64_t bytes);
+void lr_set_items_processed(int64_t items);
+void lr_counter(char const *name, double value);
+void lr_counter_rate(char const *name, double value);
+
+// Marks the running benchmark as one which must not touch the heap. Only
+// checked when the implementation is built with LR_TRACK_ALLOCATIONS.
+void lr_expect_no_allocations(void);
+
+// Registers memory which --lr-bench-cache=cold should flush out of the
+// caches before each timed repetition, instead of evicting everything.
+// Call it before BEGIN_BENCHMARK; ranges are forgotten after the benchmark.
+void lr_cold_cache_range(void const *pointer, int64_t size);
+
 #define _LR_GETCYCLES() __rdtsc()
 #define _LR_ARRAY_COUNT(array) sizeof(array) / sizeof(array[0])
 #define _LR_DIR(file) (strrchr((file), '\\') ? \
@@ -127,140 +159,341 @@ void _lr_fail_current_test();
 
 
 #define TEST_CASE(__lr_test_id__) void __lr_test_id__(void)
+// Runs the body once for every line of the file at path, which is mapped
+// rather than read, with the lines split between threads. Inside it, `record`
+// points at the line without its line ending, `record_size` is its length and
+// `record_index` is its zero-based line number. An assertion failing is
+// reported with the record it failed on.
+#define TEST_CASE_VECTORS(__lr_test_id__, __lr_vectors_path__) \
+    char const *__lr_vectors_path_##__lr_test_id__ = (__lr_vectors_path__); \
+    void __lr_test_id__(char const *record, int64_t record_size, \
+                        int64_t record_index)
 #define BENCHMARK(__lr_bench_id__, __lr_iterations__) \
     void __lr_bench_id__(int64_t __lr_iterations__)
-#define BEGIN_BENCHMARK() __lr_benchmark_start = _LR_GETCYCLES()
-#define END_BENCHMARK() __lr_benchmark_end = _LR_GETCYCLES()
-
-#define ASSERT_TRUE(exp) do { \
-    if (!(exp)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected (%s) to be true -- %s, line %d\n", \
-               #exp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
-        return; \
+// Runs once for each n in lo, lo * mult, lo * mult^2, ... up to hi. lo has to
+// be at least 1.
+#define BENCHMARK_RANGE(__lr_bench_id__, __lr_iterations__, __lr_n__, \
+                        lo, hi, mult) \
+    int64_t __lr_range_##__lr_bench_id__[3] = { (lo), (hi), (mult) }; \
+    void __lr_bench_id__(int64_t __lr_iterations__, int64_t __lr_n__)
+// Runs on 1, 2, 4, ... threads up to the number of cores. Every thread runs
+// all of the iterations, and the slowest thread is the one which is timed.
+#define BENCHMARK_THREADED(__lr_bench_id__, __lr_iterations__, \
+                           __lr_thread_index__, __lr_thread_count__) \
+    void __lr_bench_id__(int64_t __lr_iterations__, \
+                         int32_t __lr_thread_index__, \
+                         int32_t __lr_thread_count__)
+// The body is a single operation, which the runner calls and times once per
+// iteration to report latency percentiles rather than an average.
+#define BENCHMARK_LATENCY(__lr_bench_id__, __lr_iteration__) \
+    void __lr_bench_id__(int64_t __lr_iteration__)
+
+// A fixture is a struct which is set up the first time a test or benchmark
+// using it runs, shared by all of them, and torn down once they have all
+// finished. Setting it up is never part of a benchmark's time. Inside
+// FIXTURE_SETUP, FIXTURE_TEARDOWN, TEST_CASE_F and BENCHMARK_F, `fixture`
+// points at the struct.
+//
+//     FIXTURE(big_table) { table_t *table; };
+//     FIXTURE_SETUP(big_table) { fixture->table = table_build(); }
+//     FIXTURE_TEARDOWN(big_table) { table_free(fixture->table); }
+//
+//     BENCHMARK_F(benchmark_lookup, big_table, iterations) { ... }
+#define FIXTURE(__lr_fixture_name__) \
+    typedef struct __lr_fixture_name__ __lr_fixture_name__; \
+    struct __lr_fixture_name__
+#define FIXTURE_SETUP(__lr_fixture_name__) \
+    void __lr_fixture_setup_##__lr_fixture_name__( \
+        __lr_fixture_name__ *fixture); \
+    void *__lr_fixture_create_##__lr_fixture_name__(void) \
+    { \
+        __lr_fixture_name__ *fixture = (__lr_fixture_name__ *)calloc( \
+            1, sizeof(__lr_fixture_name__)); \
+        __lr_fixture_setup_##__lr_fixture_name__(fixture); \
+        return fixture; \
     } \
-} while (0)
-
-#define ASSERT_FALSE(exp) do { \
-    if (exp) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected (%s) to be false -- %s, line %d\n", \
-               #exp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
-        return; \
+    void __lr_fixture_setup_##__lr_fixture_name__(__lr_fixture_name__ *fixture)
+#define FIXTURE_TEARDOWN(__lr_fixture_name__) \
+    void __lr_fixture_teardown_##__lr_fixture_name__( \
+        __lr_fixture_name__ *fixture); \
+    void __lr_fixture_destroy_##__lr_fixture_name__(void *fixture) \
+    { \
+        __lr_fixture_teardown_##__lr_fixture_name__( \
+            (__lr_fixture_name__ *)fixture); \
     } \
-} while (0)
-
-#define ASSERT_EQ(actual, expected, format) do { \
-    if ((expected) != (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to equal "format " -- %s, line %d\n", \
-               (actual), (expected), _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
-        return; \
+    void __lr_fixture_teardown_##__lr_fixture_name__( \
+        __lr_fixture_name__ *fixture)
+#define TEST_CASE_F(__lr_test_id__, __lr_fixture_name__) \
+    void __lr_test_f_##__lr_test_id__(__lr_fixture_name__ *fixture); \
+    void __lr_test_id__(void *fixture) \
+    { \
+        __lr_test_f_##__lr_test_id__((__lr_fixture_name__ *)fixture); \
+    } \
+    void __lr_test_f_##__lr_test_id__(__lr_fixture_name__ *fixture)
+#define BENCHMARK_F(__lr_bench_id__, __lr_fixture_name__, __lr_iterations__) \
+    void __lr_bench_f_##__lr_bench_id__(__lr_fixture_name__ *fixture, \
+                                        int64_t __lr_iterations__); \
+    void __lr_bench_id__(void *fixture, int64_t __lr_iterations__) \
+    { \
+        __lr_bench_f_##__lr_bench_id__((__lr_fixture_name__ *)fixture, \
+                                       __lr_iterations__); \
     } \
+    void __lr_bench_f_##__lr_bench_id__(__lr_fixture_name__ *fixture, \
+                                        int64_t __lr_iterations__)
+
+// A fuzz target is called by --lr-fuzz with inputs mutated from its corpus,
+// and finds a bug by crashing or failing an assertion. Build with
+// -fsanitize-coverage=trace-pc-guard (or GCC's trace-pc) so that inputs
+// which reach new code are kept.
+//
+//     FUZZ_TEST(fuzz_calculate, data, size) { calculate(data, size); }
+#define FUZZ_TEST(__lr_fuzz_id__, __lr_data__, __lr_size__) \
+    void __lr_fuzz_id__(uint8_t const *__lr_data__, int64_t __lr_size__)
+
+#define BEGIN_BENCHMARK() _lr_begin_benchmark()
+#define END_BENCHMARK() _lr_end_benchmark()
+// Everything between a pause and the following resume is left out of the
+// benchmark's time, and may be toggled any number of times per benchmark.
+#define LR_PAUSE_TIMING() _lr_pause_timing()
+#define LR_RESUME_TIMING() _lr_resume_timing()
+
+// Keep the compiler from deleting work inside a benchmark. LR_DO_NOT_OPTIMIZE
+// forces value (which must be an lvalue) to be computed and to live in a
+// register or in memory, and LR_CLOBBER_MEMORY forces every pending write to
+// memory to actually happen.
+#if defined(__GNUC__) || defined(__clang__)
+#define LR_DO_NOT_OPTIMIZE(value) \
+    __asm__ __volatile__("" : : "r,m"(value) : "memory")
+#define LR_CLOBBER_MEMORY() __asm__ __volatile__("" : : : "memory")
+#elif defined(_MSC_VER)
+void _lr_use_pointer(void const volatile *pointer);
+#define LR_DO_NOT_OPTIMIZE(value) do { \
+    _lr_use_pointer((void const volatile *)&(value)); \
+    _ReadWriteBarrier(); \
 } while (0)
+#define LR_CLOBBER_MEMORY() _ReadWriteBarrier()
+#else
+#define LR_DO_NOT_OPTIMIZE(value) \
+    ((void)*(char const volatile *)&(value))
+#define LR_CLOBBER_MEMORY()
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define _LR_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define _LR_UNLIKELY(x) (x)
+#endif
+
+// The type of a copy of x, with arrays decayed and references and const
+// dropped, so that the copy below works for any operand which can be compared.
+// Neither way does arithmetic, which -Wpedantic rejects on void pointers. In
+// C++, NULL is an integer, so compare pointers with nullptr.
+#ifdef __cplusplus
+template <typename T> T _lr_operand_type(T value);
+#define _LR_OPERAND_TYPE(x) decltype(_lr_operand_type(x))
+#else
+#define _LR_OPERAND_TYPE(x) __typeof__(0 ? (x) : (x))
+#endif
+
+enum {
+    LR_ASSERT_TRUE,
+    LR_ASSERT_FALSE,
+    LR_ASSERT_EQ,
+    LR_ASSERT_NOT_EQ,
+    LR_ASSERT_GT,
+    LR_ASSERT_LT,
+    LR_ASSERT_GT_OR_EQ,
+    LR_ASSERT_LT_OR_EQ,
+    LR_ASSERT_MEM_EQ,
+    LR_ASSERT_ARRAY_EQ,
+    LR_ASSERT_NEAR,
+    LR_ASSERT_ULP_EQ,
+    LR_ASSERT_ARRAY_NEAR,
+    LR_ASSERT_ARRAY_ULP,
+};
 
-#define ASSERT_NOT_EQ(actual, comp, format) do { \
-    if ((comp) == (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to not equal "format " -- %s, line %d\n", \
-               actual, comp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
+// Everything about an assertion that's known at compile time. It lives in a
+// static so that a failure only has to pass a pointer to it along.
+typedef struct {
+    char const *file;
+    int32_t line;
+    int32_t kind;
+    char const *expression; // the source of the operands
+    char const *format;
+} lr_assert_site_t;
+
+// Records a failure along with the raw bytes of its operands. Nothing is
+// formatted until the test is reported.
+void _lr_assert_failed(lr_assert_site_t const *site,
+                       void const *actual, int32_t actual_size,
+                       void const *comp, int32_t comp_size);
+
+// Each operand is evaluated exactly once, and passing costs one branch which
+// is predicted taken. The failure path is a single out of line call.
+// The source is stringified by the public macros, before any macros in the
+// operands are expanded.
+#define _LR_ASSERT_BOOL(kind, source, failed) do { \
+    if (_LR_UNLIKELY(failed)) { \
+        static const lr_assert_site_t _lr_site = { \
+            __FILE__, __LINE__, kind, source, 0 }; \
+        _lr_assert_failed(&_lr_site, 0, 0, 0, 0); \
         return; \
     } \
 } while (0)
 
-#define ASSERT_GT(actual, comp, format) do { \
-    if ((comp) <= (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to be greater than "format " -- %s, line %d\n", \
-               actual, comp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
+#define _LR_ASSERT_COMPARE(kind, source, actual, comp, format, failed) do { \
+    _LR_OPERAND_TYPE(actual) _lr_actual = (actual); \
+    _LR_OPERAND_TYPE(comp) _lr_comp = (comp); \
+    if (_LR_UNLIKELY(failed)) { \
+        static const lr_assert_site_t _lr_site = { \
+            __FILE__, __LINE__, kind, source, format }; \
+        _lr_assert_failed(&_lr_site, &_lr_actual, sizeof(_lr_actual), \
+                          &_lr_comp, sizeof(_lr_comp)); \
         return; \
     } \
 } while (0)
 
-#define ASSERT_LT(actual, comp, format) do { \
-    if ((comp) >= (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to be less than "format " -- %s, line %d\n", \
-               actual, comp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
+#define ASSERT_TRUE(exp) _LR_ASSERT_BOOL(LR_ASSERT_TRUE, #exp, !(exp))
+#define ASSERT_FALSE(exp) _LR_ASSERT_BOOL(LR_ASSERT_FALSE, #exp, (exp))
+
+#define ASSERT_EQ(actual, expected, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_EQ, #actual ", " #expected, actual, \
+                       expected, format, _lr_comp != _lr_actual)
+#define ASSERT_NOT_EQ(actual, comp, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_NOT_EQ, #actual ", " #comp, actual, \
+                       comp, format, _lr_comp == _lr_actual)
+#define ASSERT_GT(actual, comp, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_GT, #actual ", " #comp, actual, \
+                       comp, format, _lr_comp <= _lr_actual)
+#define ASSERT_LT(actual, comp, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_LT, #actual ", " #comp, actual, \
+                       comp, format, _lr_comp >= _lr_actual)
+#define ASSERT_GT_OR_EQ(actual, comp, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_GT_OR_EQ, #actual ", " #comp, actual, \
+                       comp, format, _lr_comp < _lr_actual)
+#define ASSERT_LT_OR_EQ(actual, comp, format) \
+    _LR_ASSERT_COMPARE(LR_ASSERT_LT_OR_EQ, #actual ", " #comp, actual, \
+                       comp, format, _lr_comp > _lr_actual)
+
+// Byte offset of the first difference between two buffers, or -1.
+int64_t _lr_first_difference(void const *a, void const *b, int64_t length);
+
+// Records a failed ASSERT_MEM_EQ or ASSERT_ARRAY_EQ with the bytes around
+// the first difference, which is at offset.
+void _lr_assert_mem_failed(lr_assert_site_t const *site,
+                           void const *a, void const *b, int64_t length,
+                           int64_t offset, int32_t element_size);
+
+#define _LR_ASSERT_MEM(kind, source, a, b, length, element_size, format) \
+    do { \
+    void const *_lr_a = (a); \
+    void const *_lr_b = (b); \
+    int64_t _lr_length = (int64_t)(length); \
+    int64_t _lr_offset = _lr_first_difference(_lr_a, _lr_b, _lr_length); \
+    if (_LR_UNLIKELY(_lr_offset >= 0)) { \
+        static const lr_assert_site_t _lr_site = { \
+            __FILE__, __LINE__, kind, source, format }; \
+        _lr_assert_mem_failed(&_lr_site, _lr_a, _lr_b, _lr_length, \
+                              _lr_offset, element_size); \
         return; \
     } \
 } while (0)
 
-#define ASSERT_GT_OR_EQ(actual, comp, format) do { \
-    if ((comp) < (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to be greater than or equal to "format " -- %s, " \
-               "line %d\n", \
-               actual, comp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
+// Compare whole buffers at once, and show a window around the first
+// difference when they don't match. ASSERT_ARRAY_EQ compares the bytes of n
+// elements, so 0.0 and -0.0 differ while two identical NaNs don't.
+#define ASSERT_MEM_EQ(a, b, length) \
+    _LR_ASSERT_MEM(LR_ASSERT_MEM_EQ, #a ", " #b, a, b, length, 1, 0)
+#define ASSERT_ARRAY_EQ(a, b, n, format) \
+    _LR_ASSERT_MEM(LR_ASSERT_ARRAY_EQ, #a ", " #b, a, b, \
+                   (n) * sizeof(*(a)), (int32_t)sizeof(*(a)), format)
+
+// How many of n floats or doubles (by element_size) are not near, or not
+// within max_ulps, of each other.
+int64_t _lr_count_not_near(void const *a, void const *b, int64_t n,
+                           int32_t element_size, double abs_tol,
+                           double rel_tol);
+int64_t _lr_count_not_ulp_eq(void const *a, void const *b, int64_t n,
+                             int32_t element_size, uint64_t max_ulps);
+
+// Records a failed tolerance assertion, with the largest error among the
+// count elements outside of it.
+void _lr_assert_tolerance_failed(lr_assert_site_t const *site,
+                                 void const *a, void const *b, int64_t n,
+                                 int32_t element_size, int64_t count,
+                                 double abs_tol, double rel_tol,
+                                 uint64_t max_ulps);
+
+#define _LR_ASSERT_TOLERANCE(kind, source, a, b, n, size, abs_tol, rel_tol, \
+                             max_ulps) do { \
+    void const *_lr_a = (a); \
+    void const *_lr_b = (b); \
+    int64_t _lr_n = (int64_t)(n); \
+    double _lr_abs_tol = (abs_tol); \
+    double _lr_rel_tol = (rel_tol); \
+    uint64_t _lr_max_ulps = (max_ulps); \
+    int64_t _lr_count = kind == LR_ASSERT_ULP_EQ || \
+                        kind == LR_ASSERT_ARRAY_ULP ? \
+        _lr_count_not_ulp_eq(_lr_a, _lr_b, _lr_n, size, _lr_max_ulps) : \
+        _lr_count_not_near(_lr_a, _lr_b, _lr_n, size, _lr_abs_tol, \
+                           _lr_rel_tol); \
+    if (_LR_UNLIKELY(_lr_count)) { \
+        static const lr_assert_site_t _lr_site = { \
+            __FILE__, __LINE__, kind, source, 0 }; \
+        _lr_assert_tolerance_failed(&_lr_site, _lr_a, _lr_b, _lr_n, size, \
+                                    _lr_count, _lr_abs_tol, _lr_rel_tol, \
+                                    _lr_max_ulps); \
         return; \
     } \
 } while (0)
 
-#define ASSERT_LT_OR_EQ(actual, comp, format) do { \
-    if ((comp) > (actual)) { \
-        _lr_set_color_yel(); \
-        printf("Assertion Failed:\n" \
-               "Expected "format " to be less than or equal to " \
-               format " -- %s, line %d\n", \
-               actual, comp, _LR_FILENAME, __LINE__); \
-        _lr_fail_current_test(); \
-        _lr_set_color_def(); \
+// Approximate comparison of floats and doubles. Values are near when they
+// are within abs_tol of each other, or within rel_tol of the larger
+// magnitude. Equal infinities are near, but an infinity is near nothing else,
+// and NaN is never near anything, nor within any number of ULPs.
+// ASSERT_ULP_EQ compares in the type of actual.
+#define ASSERT_NEAR(actual, expected, abs_tol) do { \
+    double _lr_actual = (double)(actual); \
+    double _lr_expected = (double)(expected); \
+    double _lr_diff = _lr_actual - _lr_expected; \
+    double _lr_tol = (abs_tol); \
+    if (_LR_UNLIKELY(!(_lr_diff <= _lr_tol && -_lr_diff <= _lr_tol) && \
+                     _lr_actual != _lr_expected)) { \
+        static const lr_assert_site_t _lr_site = { \
+            __FILE__, __LINE__, LR_ASSERT_NEAR, \
+            #actual ", " #expected, 0 }; \
+        _lr_assert_tolerance_failed(&_lr_site, &_lr_actual, &_lr_expected, \
+                                    1, sizeof(double), 1, _lr_tol, 0, 0); \
         return; \
     } \
 } while (0)
-
-#ifdef _WIN32
-
-#define LR_PRELUDE(argc, argv) do {\
-    if (argc == 2 && strcmp("--lr-run-tests", argv[1]) == 0) {\
-        _lr_console_h = GetStdHandle(STD_OUTPUT_HANDLE);\
-        lr_run_tests();\
-        exit(0);\
-    } else if (argc == 3 && strcmp("--lr-run-benchmarks", argv[1]) == 0) {\
-        _lr_console_h = GetStdHandle(STD_OUTPUT_HANDLE);\
-        uint64_t _lr_iterations = atoi(argv[2]);\
-        lr_run_benchmarks(_lr_iterations);\
-        exit(0);\
-    }\
-} while(0)
-
-#else
+#define ASSERT_ULP_EQ(actual, expected, max_ulps) do { \
+    _LR_OPERAND_TYPE(actual) _lr_actual_value = (actual); \
+    _LR_OPERAND_TYPE(actual) _lr_expected_value = \
+        (_LR_OPERAND_TYPE(actual))(expected); \
+    _LR_ASSERT_TOLERANCE(LR_ASSERT_ULP_EQ, #actual ", " #expected, \
+                         &_lr_actual_value, &_lr_expected_value, 1, \
+                         (int32_t)sizeof(_lr_actual_value), 0, 0, \
+                         max_ulps); \
+} while (0)
+#define ASSERT_ARRAY_NEAR(a, b, n, abs_tol, rel_tol) \
+    _LR_ASSERT_TOLERANCE(LR_ASSERT_ARRAY_NEAR, #a ", " #b, a, b, n, \
+                         (int32_t)sizeof(*(a)), abs_tol, rel_tol, 0)
+#define ASSERT_ARRAY_ULP(a, b, n, max_ulps) \
+    _LR_ASSERT_TOLERANCE(LR_ASSERT_ARRAY_ULP, #a ", " #b, a, b, n, \
+                         (int32_t)sizeof(*(a)), 0, 0, max_ulps)
 
 #define LR_PRELUDE(argc, argv) do {\
-    if (argc == 2 && strcmp("--lr-run-tests", argv[1]) == 0) {\
-        lr_run_tests();\
-        exit(0);\
-    } else if (argc == 3 && strcmp("--lr-run-benchmarks", argv[1]) == 0) {\
-        uint64_t _lr_iterations = atoi(argv[2]);\
-        lr_run_benchmarks(_lr_iterations);\
-        exit(0);\
-    }\
+    int32_t _lr_exit_code = _lr_prelude((argc), (char const **)(argv));\
+    if (_lr_exit_code >= 0)\
+        exit(_lr_exit_code);\
 } while(0)
 
-#endif
+int32_t _lr_prelude(int32_t argc, char const **argv);
 
 void lr_run_tests(void);
+int32_t lr_run_benchmarks(uint64_t iterations);
+int32_t lr_fuzz(char const *name);
 
 #endif //#ifndef LABRAT_H
 
@@ -278,13 +511,77 @@ void lr_run_tests(void);
 
 #ifdef LR_IMPLEMENTATION
 
+// This will forward declare all of our test and benchmark functions so they
+// may be referenced here. Only this translation unit sees the test list, so
+// adding a test doesn't recompile every file which includes labrat.h.
+#if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST) ///////////////////////
+#define TEST_DEFINITION(id) void id(void);
+#define BENCH_DEFINITION(id) void id(int64_t iterations);
+#define BENCH_RANGE_DEFINITION(id) void id(int64_t iterations, int64_t n); \
+    extern int64_t __lr_range_##id[3];
+#define BENCH_THREADED_DEFINITION(id) \
+    void id(int64_t iterations, int32_t thread_index, int32_t thread_count);
+#define BENCH_LATENCY_DEFINITION(id) void id(int64_t iteration);
+#define FIXTURE_DEFINITION(name) void *__lr_fixture_create_##name(void);
+#define FIXTURE_TEARDOWN_DEFINITION(name) \
+    void __lr_fixture_destroy_##name(void *fixture);
+#define TEST_F_DEFINITION(id, fixture) void id(void *fixture);
+#define BENCH_F_DEFINITION(id, fixture) \
+    void id(void *fixture, int64_t iterations);
+#define FUZZ_DEFINITION(id) void id(uint8_t const *data, int64_t size);
+#define TEST_VECTORS_DEFINITION(id) \
+    void id(char const *record, int64_t record_size, int64_t record_index); \
+    extern char const *__lr_vectors_path_##id;
+#include "labrat_data.c"
+#undef TEST_DEFINITION
+#undef BENCH_DEFINITION
+#undef BENCH_RANGE_DEFINITION
+#undef BENCH_THREADED_DEFINITION
+#undef BENCH_LATENCY_DEFINITION
+#undef FIXTURE_DEFINITION
+#undef FIXTURE_TEARDOWN_DEFINITION
+#undef TEST_F_DEFINITION
+#undef BENCH_F_DEFINITION
+#undef FUZZ_DEFINITION
+#undef TEST_VECTORS_DEFINITION
+#endif
+////////////////////////////////////////////////////////////////////////////////
+
+bool _lr_read_first_line(char const *path, char *line, int32_t size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    bool result = fgets(line, size, fp) != 0;
+    fclose(fp);
+
+    if (result)
+        line[strcspn(line, "\r\n")] = 0;
+    return result;
+}
+
+typedef struct {
+    char type[16]; // "Data", "Instruction" or "Unified"
+    int32_t level;
+    int64_t size;
+    int32_t num_sharing; // logical cpus sharing this cache
+} lr_cache_info_t;
+
 #ifdef _WIN32
 
 #include <windows.h>
 #include <intrin.h>
+#include <time.h>
 
 HANDLE _lr_console_h = 0;
 
+// Opaque to the optimizer, for LR_DO_NOT_OPTIMIZE
+__declspec(noinline) void _lr_use_pointer(void const volatile *pointer)
+{
+    (void)pointer;
+}
+
 void _lr_set_color_grn()
 {
     SetConsoleTextAttribute(_lr_console_h, 2);
@@ -310,12 +607,226 @@ void _lr_set_color_wht()
     SetConsoleTextAttribute(_lr_console_h, 15);
 }
 
+#define _LR_THREAD_LOCAL __declspec(thread)
+
+typedef HANDLE lr_thread_t;
+
+typedef struct {
+    void *(*func)(void *);
+    void *arg;
+} lr_thread_start_t;
+
+DWORD WINAPI _lr_thread_trampoline(LPVOID param)
+{
+    lr_thread_start_t start = *(lr_thread_start_t *)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+bool _lr_start_thread(lr_thread_t *thread, void *(*func)(void *), void *arg)
+{
+    lr_thread_start_t *start =
+        (lr_thread_start_t *)malloc(sizeof(lr_thread_start_t));
+    start->func = func;
+    start->arg = arg;
+    *thread = CreateThread(0, 0, _lr_thread_trampoline, start, 0, 0);
+    if (!*thread)
+        free(start);
+    return *thread != 0;
+}
+
+void _lr_join_thread(lr_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+int32_t _lr_cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int32_t)info.dwNumberOfProcessors;
+}
+
+int32_t _lr_msb64(uint64_t value)
+{
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int32_t)index;
+}
+
+int32_t _lr_lsb32(uint32_t value)
+{
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int32_t)index;
+}
+
+// AVX2 needs both the instructions and the OS saving the ymm registers.
+bool _lr_cpu_has_avx2()
+{
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+bool _lr_pin_thread(int32_t cpu)
+{
+    return SetThreadAffinityMask(GetCurrentThread(),
+                                 (DWORD_PTR)1 << cpu) != 0;
+}
+
+bool _lr_raise_priority()
+{
+    return SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS) &&
+           SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+}
+
+void _lr_atomic_increment(volatile int32_t *value)
+{
+    InterlockedIncrement((volatile LONG *)value);
+}
+
+int32_t _lr_atomic_load(volatile int32_t *value)
+{
+    return InterlockedCompareExchange((volatile LONG *)value, 0, 0);
+}
+
+void _lr_atomic_store(volatile int32_t *value, int32_t desired)
+{
+    InterlockedExchange((volatile LONG *)value, desired);
+}
+
+int64_t _lr_atomic_fetch_add64(volatile int64_t *value, int64_t add)
+{
+    return InterlockedExchangeAdd64((volatile LONG64 *)value, add);
+}
+
+// Maps a whole file read-only, or returns 0. An empty file can't be mapped,
+// so it comes back as "".
+char const *_lr_map_file(char const *path, int64_t *size)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    char const *data = 0;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size)) {
+        *size = file_size.QuadPart;
+        HANDLE mapping = *size ?
+            CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0) : 0;
+        if (mapping) {
+            data = (char const *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0,
+                                               0);
+            CloseHandle(mapping);
+        } else if (!*size) {
+            data = "";
+        }
+    }
+    CloseHandle(file);
+    return data;
+}
+
+void _lr_unmap_file(char const *data, int64_t size)
+{
+    if (size)
+        UnmapViewOfFile(data);
+}
+
+// The last time the file was written, in nanoseconds, or -1 if it's missing.
+int64_t _lr_file_mtime(char const *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return -1;
+    return ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32 |
+            data.ftLastWriteTime.dwLowDateTime) * 100;
+}
+
+#define _lr_popen _popen
+#define _lr_pclose _pclose
+
+void _lr_make_directory(char const *path)
+{
+    CreateDirectoryA(path, 0);
+}
+
+bool _lr_executable_path(char *path, int32_t size)
+{
+    DWORD len = GetModuleFileNameA(0, path, size);
+    return len > 0 && len < (DWORD)size;
+}
+
+double _lr_wall_time()
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+// Fills in up to max of cpu 0's caches and returns how many there were.
+int32_t _lr_cache_info(lr_cache_info_t *caches, int32_t max)
+{
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION info[256];
+    DWORD size = sizeof(info);
+    int32_t count = 0;
+
+    if (!GetLogicalProcessorInformation(info, &size))
+        return 0;
+
+    for (DWORD i = 0; i < size / sizeof(info[0]) && count < max; i++) {
+        if (info[i].Relationship != RelationCache ||
+            !(info[i].ProcessorMask & 1))
+            continue;
+
+        lr_cache_info_t *cache = &caches[count++];
+        CACHE_DESCRIPTOR *descriptor = &info[i].Cache;
+        snprintf(cache->type, _LR_ARRAY_COUNT(cache->type), "%s",
+                 descriptor->Type == CacheData ? "Data" :
+                 descriptor->Type == CacheInstruction ? "Instruction" :
+                 "Unified");
+        cache->level = descriptor->Level;
+        cache->size = descriptor->Size;
+        cache->num_sharing = 0;
+        for (ULONG_PTR mask = info[i].ProcessorMask; mask; mask >>= 1)
+            cache->num_sharing += mask & 1;
+    }
+    return count;
+}
+
+void _lr_host_name(char *name, int32_t size)
+{
+    DWORD len = size;
+    if (!GetComputerNameA(name, &len))
+        snprintf(name, size, "unknown");
+}
+
 
 #else
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <x86intrin.h>
 
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
 void _lr_set_color_grn()
 {
     printf("\x1b[32m");
@@ -341,840 +852,6474 @@ void _lr_set_color_wht()
     printf("\x1b[34m");
 }
 
+#define _LR_THREAD_LOCAL __thread
 
-#endif
-
-bool __lr_test_passed;
-int64_t __lr_benchmark_start;
-int64_t __lr_benchmark_end;
+typedef pthread_t lr_thread_t;
 
-void _lr_begin_benchmark()
+bool _lr_start_thread(lr_thread_t *thread, void *(*func)(void *), void *arg)
 {
-    __lr_benchmark_start = _LR_GETCYCLES();
+    return pthread_create(thread, 0, func, arg) == 0;
 }
 
-void _lr_end_benchmark()
+void _lr_join_thread(lr_thread_t thread)
 {
-    __lr_benchmark_end = _LR_GETCYCLES();
+    pthread_join(thread, 0);
 }
 
-void _lr_fail_current_test()
+int32_t _lr_cpu_count()
 {
-    __lr_test_passed = false;
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int32_t)count : 1;
 }
 
-/******************************************************************************/
-////////////////////// Sean Barrett's Stretchy Buffer///////////////////////////
-//////// https://github.com/nothings/stb/blob/master/stretchy_buffer.h /////////
-/******************************************************************************/
-#define lr_sb_free(a)   ((a) ? free(lr__sbraw(a)), 0 : 0)
-#define lr_sb_push(a, v) (lr__sbmaybegrow(a, 1), (a)[lr__sbn(a)++] = (v))
-#define lr_sb_count(a)  ((a) ? lr__sbn(a) : 0)
-#define lr_sb_add(a, n)  (lr__sbmaybegrow(a, n), \
-                          lr__sbn(a) += (n), \
-                          & (a)[lr__sbn(a) - (n)])
-#define lr_sb_last(a)   ((a)[lr__sbn(a) - 1])
-
-#define lr__sbraw(a) ((int64_t *)(a) - 2)
-#define lr__sbm(a)   lr__sbraw(a)[0]
-#define lr__sbn(a)   lr__sbraw(a)[1]
+int32_t _lr_msb64(uint64_t value)
+{
+    return 63 - __builtin_clzll(value);
+}
 
-#define lr__sbneedgrow(a, n)  ((a) == 0 || lr__sbn(a) + (n) >= lr__sbm(a))
-#define lr__sbmaybegrow(a, n) (lr__sbneedgrow(a, (n)) ? lr__sbgrow(a, n) : 0)
-#define lr__sbgrow(a, \
-                   n)      (*((void **)&a) = \
-                                lr__sbgrowf(((void *)a), (n), sizeof(*(a))))
+int32_t _lr_lsb32(uint32_t value)
+{
+    return __builtin_ctz(value);
+}
 
-static void *lr__sbgrowf(void *arr, int64_t increment, int64_t itemsize)
+bool _lr_cpu_has_avx2()
 {
-    int64_t dbl_cur = arr ? 2 * lr__sbm(arr) : 0;
-    int64_t min_needed = lr_sb_count(arr) + increment;
-    int64_t m = dbl_cur > min_needed ? dbl_cur : min_needed;
-    int64_t *p = (int64_t *)realloc(arr ?
-                                    lr__sbraw(arr) :
-                                    0, itemsize * m + sizeof(int64_t) * 2);
+    return __builtin_cpu_supports("avx2");
+}
 
-    if (p) {
-        if (!arr)
-            p[1] = 0;
-        p[0] = m;
-        return p + 2;
-    } else {
-#ifdef STRETCHY_BUFFER_OUT_OF_MEMORY
-        STRETCHY_BUFFER_OUT_OF_MEMORY;
+bool _lr_pin_thread(int32_t cpu)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
 #endif
-        return (void *)(2 * sizeof(int64_t));
-    }
 }
-/******************************************************************************/
-////////////////////////////////////////////////////////////////////////////////
-/******************************************************************************/
 
-#if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST)
-bool __lr_test_definition(void (*func)(void), const char *name)
+bool _lr_raise_priority()
 {
-    __lr_test_passed = true;
-    func();
-    if (__lr_test_passed) {
-        _lr_set_color_grn();
-        printf("    [ PASSED ] -- %s\n", name);
-        _lr_set_color_def();
-        return true;
-    } else {
-        _lr_set_color_red();
-        printf("    [ FAILED ] -- %s\n", name);
-        _lr_set_color_def();
-        return false;
-    }
+    return setpriority(PRIO_PROCESS, 0, -20) == 0;
 }
 
-void lr_run_tests(void)
+void _lr_atomic_increment(volatile int32_t *value)
 {
-#ifndef LR_OFF // just produce an empty function if LR_OFF
-    _lr_set_color_wht();
-    printf("\nRunning tests:\n\n");
-    _lr_set_color_def();
+    __atomic_fetch_add(value, 1, __ATOMIC_SEQ_CST);
+}
 
-    bool tests[] = {
-        0,
-#define TEST_DEFINITION(id) 0,
-#include "labrat_data.c"
-#undef TEST_DEFINITION
-    };
-    int32_t ix = 1;
+int32_t _lr_atomic_load(volatile int32_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
 
-#define TEST_DEFINITION(id) tests[ix++] = __lr_test_definition(id, #id);
-#include "labrat_data.c"
-#undef TEST_DEFINITION
+void _lr_atomic_store(volatile int32_t *value, int32_t desired)
+{
+    __atomic_store_n(value, desired, __ATOMIC_SEQ_CST);
+}
 
-    int32_t passed = 0;
-    int32_t total = _LR_ARRAY_COUNT(tests) - 1;
-    for (int64_t i = 1; i <= total; i++)
-        if (tests[i])
-            passed++;
+int64_t _lr_atomic_fetch_add64(volatile int64_t *value, int64_t add)
+{
+    return __atomic_fetch_add(value, add, __ATOMIC_SEQ_CST);
+}
 
-    bool all_passed = passed == total;
-    puts("\nFinished running tests: ");
-    if (all_passed) {
-        _lr_set_color_grn();
-    } else {
-        _lr_set_color_red();
+// Maps a whole file read-only, or returns 0. An empty file can't be mapped,
+// so it comes back as "".
+char const *_lr_map_file(char const *path, int64_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    char const *data = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        *size = st.st_size;
+        data = *size ? (char const *)mmap(0, *size, PROT_READ, MAP_PRIVATE,
+                                          fd, 0) : "";
+        if (data == (char const *)MAP_FAILED)
+            data = 0;
     }
-    printf("%d ", passed);
-    _lr_set_color_wht();
+    close(fd);
+    return data;
+}
 
-    printf("of %d tests passed (", total);
+void _lr_unmap_file(char const *data, int64_t size)
+{
+    if (size)
+        munmap((void *)data, size);
+}
 
-    if (all_passed) {
-        _lr_set_color_grn();
-    } else {
-        _lr_set_color_red();
-    }
-    printf("%d", total - passed);
-    _lr_set_color_wht();
+// The last time the file was written, in nanoseconds, or -1 if it's missing.
+int64_t _lr_file_mtime(char const *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#endif
+}
 
-    puts(" failed)\n");
-    _lr_set_color_def();
-#endif // #ifndef LR_OFF
+#define _lr_popen popen
+#define _lr_pclose pclose
+
+void _lr_make_directory(char const *path)
+{
+    mkdir(path, 0777);
 }
 
-void lr_run_benchmarks(uint64_t iterations)
+bool _lr_executable_path(char *path, int32_t size)
 {
-#ifndef LR_OFF // just produce an empty function if LR_OFF
-    int32_t tests_passed = 0;
-    int32_t total_tests = 0;
-    _lr_set_color_wht();
-    printf("\nRunning benchmarks:\n\n");
-    _lr_set_color_def();
+#if defined(__APPLE__)
+    uint32_t len = size;
+    return _NSGetExecutablePath(path, &len) == 0;
+#elif defined(__linux__)
+    snprintf(path, size, "/proc/self/exe");
+    return true;
+#else
+    return false;
+#endif
+}
 
-    uint64_t start_time;
-    uint64_t end_time;
+double _lr_wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    int32_t max_bench_name_size = -1;
-    int32_t bench_name_sizes[] = {
-        -1,
-#define BENCH_DEFINITION(id) (sizeof(#id) - 1),
-#include "labrat_data.c"
-#undef BENCH_DEFINITION
-    };
+// Fills in up to max of cpu 0's caches and returns how many there were. Only
+// Linux describes its caches in /sys, so elsewhere there are none.
+int32_t _lr_cache_info(lr_cache_info_t *caches, int32_t max)
+{
+    int32_t count = 0;
 
-    for (int64_t i = 0; i < _LR_ARRAY_COUNT(bench_name_sizes); i++)
-        if (bench_name_sizes[i] > max_bench_name_size)
-            max_bench_name_size = bench_name_sizes[i];
-
-#define BENCH_DEFINITION(id) \
-    __lr_benchmark_start = -1; \
-    __lr_benchmark_end = -1; \
-    start_time = _LR_GETCYCLES(); \
-    id(iterations); \
-    end_time = _LR_GETCYCLES(); \
-    if (__lr_benchmark_start != -1) { \
-        start_time = __lr_benchmark_start; \
-    } \
-    if (__lr_benchmark_end != -1) { \
-        end_time = __lr_benchmark_end; \
-    } \
-    _lr_set_color_wht();\
-    printf("    [ FINISHED ] -- " \
-           "%-*s: %12I64u cycles / iteration\n", \
-           max_bench_name_size + 2, \
-           #id, \
-           (end_time - start_time) / iterations);\
-    _lr_set_color_def();
-#include "labrat_data.c"
-#undef BENCH_DEFINITION
+    for (int32_t index = 0; count < max; index++) {
+        char dir[96];
+        char path[128];
+        char line[256];
+        snprintf(dir, _LR_ARRAY_COUNT(dir),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d", index);
 
-    bool all_passed = tests_passed == total_tests;
-    _lr_set_color_wht();
-    printf("\nFinished running benchmarks.");
-    _lr_set_color_def();
-#endif // #ifndef LR_OFF
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/size", dir);
+        if (!_lr_read_first_line(path, line, _LR_ARRAY_COUNT(line)))
+            break;
+
+        lr_cache_info_t *cache = &caches[count++];
+        char *unit;
+        cache->size = strtoll(line, &unit, 10);
+        if (*unit == 'K')
+            cache->size *= 1024;
+        else if (*unit == 'M')
+            cache->size *= 1024 * 1024;
+
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/type", dir);
+        if (!_lr_read_first_line(path, cache->type,
+                                 _LR_ARRAY_COUNT(cache->type)))
+            snprintf(cache->type, _LR_ARRAY_COUNT(cache->type), "Unified");
+
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/level", dir);
+        cache->level = _lr_read_first_line(path, line, _LR_ARRAY_COUNT(line))
+                       ? atoi(line) : 0;
+
+        // a list of cpus and ranges of them, like "0-3,8-11"
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/shared_cpu_list", dir);
+        cache->num_sharing = 0;
+        if (_lr_read_first_line(path, line, _LR_ARRAY_COUNT(line))) {
+            for (char *c = line; *c;) {
+                int32_t lo = (int32_t)strtol(c, &c, 10);
+                int32_t hi = *c == '-' ? (int32_t)strtol(c + 1, &c, 10) : lo;
+                cache->num_sharing += hi - lo + 1;
+                if (*c != ',')
+                    break;
+                c++;
+            }
+        }
+    }
+    return count;
 }
-#endif // #if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST)
 
-enum {
-    LR_TOKEN_L_PAREN,
-    LR_TOKEN_R_PAREN,
-    LR_TOKEN_L_BRACE,
-    LR_TOKEN_R_BRACE,
-    LR_TOKEN_L_BRACKET,
-    LR_TOKEN_R_BRACKET,
-    LR_TOKEN_COMMA,
-    LR_TOKEN_PERIOD,
-    LR_TOKEN_ASTERISK,
-    LR_TOKEN_MINUS,
-    LR_TOKEN_PLUS,
-    LR_TOKEN_EXCLAMATION,
-    LR_TOKEN_TILDE,
-    LR_TOKEN_BACKSLASH,
-    LR_TOKEN_SLASH,
-    LR_TOKEN_EQ,
-    LR_TOKEN_AMPERSAND,
-    LR_TOKEN_POUND,
-    LR_TOKEN_SEMICOLON,
-    LR_TOKEN_COLON,
-    LR_TOKEN_QUESTION_MARK,
-    LR_TOKEN_IDENTIFIER,
-    LR_TOKEN_NUMBER,
-    LR_TOKEN_CHARACTER,
-    LR_TOKEN_STRING,
-    LR_TOKEN_UNKNOWN,
-    LR_TOKEN_EOF,
-};
+void _lr_host_name(char *name, int32_t size)
+{
+    if (gethostname(name, size) != 0)
+        snprintf(name, size, "unknown");
+    name[size - 1] = 0;
+}
 
-typedef struct {
-    int64_t len;
-    char *data;
-} lr_slice_t;
 
-typedef struct {
-    uint32_t type;
-    lr_slice_t slice;
-} c_token_t;
+#endif
 
-char *get_token_type_name(uint32_t type)
+// thread local so that TEST_CASE_VECTORS can run its records on threads
+_LR_THREAD_LOCAL bool __lr_test_passed;
+_LR_THREAD_LOCAL int64_t __lr_record_index = -1;
+// thread local so that BENCHMARK_THREADED bodies can use them too
+_LR_THREAD_LOCAL int64_t __lr_benchmark_start;
+_LR_THREAD_LOCAL int64_t __lr_benchmark_end;
+
+#define _LR_HASH_SEED 0xcbf29ce484222325ull
+
+// FNV-1a, carrying on from hash, which starts out as _LR_HASH_SEED.
+uint64_t _lr_hash(void const *data, int64_t size, uint64_t hash)
 {
-    switch (type) {
-    case LR_TOKEN_L_PAREN: { return "LR_TOKEN_L_PAREN"; }
-    case LR_TOKEN_R_PAREN: { return "LR_TOKEN_R_PAREN"; }
-    case LR_TOKEN_L_BRACE: { return "LR_TOKEN_L_BRACE"; }
-    case LR_TOKEN_R_BRACE: { return "LR_TOKEN_R_BRACE"; }
-    case LR_TOKEN_L_BRACKET: { return "LR_TOKEN_L_BRACKET"; }
-    case LR_TOKEN_R_BRACKET: { return "LR_TOKEN_R_BRACKET"; }
-    case LR_TOKEN_ASTERISK: { return "LR_TOKEN_ASTERISK"; }
-    case LR_TOKEN_COMMA: { return "LR_TOKEN_COMMA"; }
-    case LR_TOKEN_PERIOD: { return "LR_TOKEN_PERIOD"; }
-    case LR_TOKEN_MINUS: { return "LR_TOKEN_MINUS"; }
-    case LR_TOKEN_PLUS: { return "LR_TOKEN_PLUS"; }
-    case LR_TOKEN_EXCLAMATION: { return "LR_TOKEN_EXCLAMATION"; }
-    case LR_TOKEN_TILDE: { return "LR_TOKEN_TILDE"; }
-    case LR_TOKEN_BACKSLASH: { return "LR_TOKEN_BACKSLASH"; }
-    case LR_TOKEN_SLASH: { return "LR_TOKEN_SLASH"; }
-    case LR_TOKEN_EQ: { return "LR_TOKEN_EQ"; }
-    case LR_TOKEN_AMPERSAND: { return "LR_TOKEN_AMPERSAND"; }
-    case LR_TOKEN_POUND: { return "LR_TOKEN_POUND"; }
-    case LR_TOKEN_SEMICOLON: { return "LR_TOKEN_SEMICOLON"; }
-    case LR_TOKEN_COLON: { return "LR_TOKEN_COLON"; }
-    case LR_TOKEN_QUESTION_MARK: { return "LR_TOKEN_QUESTION_MARK"; }
-    case LR_TOKEN_IDENTIFIER: { return "LR_TOKEN_IDENTIFIER"; }
-    case LR_TOKEN_NUMBER: { return "LR_TOKEN_NUMBER"; }
-    case LR_TOKEN_CHARACTER: { return "LR_TOKEN_CHARACTER"; }
-    case LR_TOKEN_STRING: { return "LR_TOKEN_STRING"; }
-    case LR_TOKEN_UNKNOWN: { return "LR_TOKEN_UNKNOWN"; }
-    case LR_TOKEN_EOF: { return "LR_TOKEN_EOF"; }
-    default: { return "---"; }
+    for (int64_t i = 0; i < size; i++)
+        hash = (hash ^ ((uint8_t const *)data)[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+/******************************************************************************/
+///////////////////////////////// Cold caches //////////////////////////////////
+/******************************************************************************/
+#define _LR_MAX_COLD_RANGES 64
+#define _LR_CACHE_LINE 64
+
+typedef struct {
+    char const *pointer;
+    int64_t size;
+} lr_cold_range_t;
+
+// thread local so that only the runner evicts, never BENCHMARK_THREADED bodies
+_LR_THREAD_LOCAL bool __lr_cold_cache;
+lr_cold_range_t __lr_cold_ranges[_LR_MAX_COLD_RANGES];
+int32_t __lr_cold_range_count;
+char *__lr_eviction_buffer;
+int64_t __lr_eviction_buffer_size;
+
+void lr_cold_cache_range(void const *pointer, int64_t size)
+{
+    for (int32_t i = 0; i < __lr_cold_range_count; i++) {
+        if (__lr_cold_ranges[i].pointer == (char const *)pointer) {
+            __lr_cold_ranges[i].size = size;
+            return;
+        }
+    }
+
+    if (__lr_cold_range_count < _LR_MAX_COLD_RANGES) {
+        __lr_cold_ranges[__lr_cold_range_count].pointer =
+            (char const *)pointer;
+        __lr_cold_ranges[__lr_cold_range_count].size = size;
+        __lr_cold_range_count++;
     }
 }
 
-lr_slice_t lr_as_slice(char *s, int64_t len)
+// Size in bytes of the largest cache on the machine, or 0 if unknown.
+int64_t _lr_llc_size()
 {
-    lr_slice_t result;
+    lr_cache_info_t caches[16];
+    int32_t count = _lr_cache_info(caches, _LR_ARRAY_COUNT(caches));
+    int64_t result = 0;
 
-    result.len = len;
-    result.data = s;
+    for (int32_t i = 0; i < count; i++)
+        if (caches[i].size > result)
+            result = caches[i].size;
     return result;
 }
 
-lr_slice_t lr_slice(lr_slice_t s, int64_t start, int64_t end)
+// Allocated up front so that evicting never shows up as an allocation. Twice
+// the last level cache, because it's rarely exactly LRU.
+void _lr_allocate_eviction_buffer()
 {
-    lr_slice_t result;
+    if (__lr_eviction_buffer)
+        return;
 
-    result.len = end - start;
-    result.data = s.data + start;
-    return result;
+    int64_t llc = _lr_llc_size();
+    __lr_eviction_buffer_size = 2 * (llc > 0 ? llc : 32 * 1024 * 1024);
+    __lr_eviction_buffer = (char *)malloc(__lr_eviction_buffer_size);
+    memset(__lr_eviction_buffer, 0, __lr_eviction_buffer_size);
 }
 
-lr_slice_t lr_slice_r(lr_slice_t s, int64_t start)
+// With registered ranges only those are flushed; otherwise writing a buffer
+// bigger than the last level cache pushes everything else out.
+void _lr_evict_caches()
 {
-    lr_slice_t result;
+    if (!__lr_cold_cache)
+        return;
+
+    if (__lr_cold_range_count) {
+        for (int32_t i = 0; i < __lr_cold_range_count; i++) {
+            char const *start = __lr_cold_ranges[i].pointer;
+            for (int64_t offset = 0;
+                 offset < __lr_cold_ranges[i].size;
+                 offset += _LR_CACHE_LINE)
+                _mm_clflush(start + offset);
+        }
+        _mm_mfence();
+    } else if (__lr_eviction_buffer) {
+        volatile char *buffer = __lr_eviction_buffer;
+        for (int64_t i = 0; i < __lr_eviction_buffer_size; i += _LR_CACHE_LINE)
+            buffer[i]++;
+    }
+}
 
-    result.len = s.len - start;
-    result.data = s.data + start;
-    return result;
+void _lr_begin_benchmark()
+{
+    _lr_evict_caches();
+    __lr_benchmark_start = _LR_GETCYCLES();
 }
 
-lr_slice_t lr_slice_l(lr_slice_t s, int64_t end)
+void _lr_end_benchmark()
 {
-    lr_slice_t result;
+    __lr_benchmark_end = _LR_GETCYCLES();
+}
 
-    result.len = end;
-    result.data = s.data;
-    return result;
+_LR_THREAD_LOCAL int64_t __lr_pause_start;
+_LR_THREAD_LOCAL int64_t __lr_paused_cycles;
+_LR_THREAD_LOCAL int64_t __lr_pause_count;
+
+void _lr_pause_timing()
+{
+    __lr_pause_start = _LR_GETCYCLES();
 }
 
-lr_slice_t lr_copy_slice(lr_slice_t s)
+void _lr_resume_timing()
 {
-    lr_slice_t result;
+    __lr_paused_cycles += _LR_GETCYCLES() - __lr_pause_start;
+    __lr_pause_count++;
+}
 
-    result.data = (char *)malloc(s.len);
-    result.len = s.len;
-    memcpy(result.data, s.data, s.len);
+void _lr_reset_benchmark_window()
+{
+    __lr_benchmark_start = -1;
+    __lr_benchmark_end = -1;
+    __lr_paused_cycles = 0;
+    __lr_pause_count = 0;
+}
+
+// Cycles which a pause/resume pair costs outside of the interval it leaves
+// out, i.e. the call overhead which would otherwise still be timed.
+int64_t _lr_pause_overhead()
+{
+    static int64_t result = -1;
+
+    if (result < 0) {
+        const int32_t pairs = 256;
+        for (int32_t round = 0; round < 16; round++) {
+            _lr_reset_benchmark_window();
+            int64_t start = _LR_GETCYCLES();
+            for (int32_t i = 0; i < pairs; i++) {
+                _lr_pause_timing();
+                _lr_resume_timing();
+            }
+            int64_t end = _LR_GETCYCLES();
+
+            int64_t overhead = (end - start - __lr_paused_cycles) / pairs;
+            if (result < 0 || overhead < result)
+                result = overhead > 0 ? overhead : 0;
+        }
+        _lr_reset_benchmark_window();
+    }
     return result;
 }
 
-bool lr_slices_equal(lr_slice_t lhs, lr_slice_t rhs)
+// Applies BEGIN_BENCHMARK/END_BENCHMARK and subtracts any paused time.
+uint64_t _lr_benchmark_window_cycles(int64_t start_time, int64_t end_time)
 {
-    if (lhs.len != rhs.len)
-        return false;
-    else
-        return memcmp(lhs.data, rhs.data, lhs.len) != 0;
+    if (__lr_benchmark_start != -1)
+        start_time = __lr_benchmark_start;
+    if (__lr_benchmark_end != -1)
+        end_time = __lr_benchmark_end;
+
+    int64_t result = end_time - start_time - __lr_paused_cycles -
+                     __lr_pause_count * _lr_pause_overhead();
+    return result > 0 ? (uint64_t)result : 0;
 }
 
-#undef LR_IMPLEMENTATION
-#endif // #ifdef LR_IMPLEMENTATION
+void _lr_fail_current_test()
+{
+    __lr_test_passed = false;
+}
 
 /******************************************************************************/
-////////////////////////////// END IMPLEMENTATION //////////////////////////////
+///////////////////////////////// Assertions ///////////////////////////////////
 /******************************************************************************/
+#define _LR_MAX_ASSERT_OPERAND 64
+#define _LR_ASSERT_RING_SIZE 256
 
+typedef struct {
+    lr_assert_site_t const *site;
+    int32_t sizes[2]; // -1 for a string which was copied in
+    unsigned char operands[2][_LR_MAX_ASSERT_OPERAND];
+
+    // for ASSERT_MEM_EQ and ASSERT_ARRAY_EQ the operands are the bytes from
+    // window_start on, in both buffers
+    int64_t length;
+    int64_t offset;
+    int64_t window_start;
+    int32_t element_size;
+
+    // for the tolerance assertions, which also keep the elements with the
+    // largest error, at offset, as the operands
+    int64_t count;
+    double error;
+    double abs_tol;
+    double rel_tol;
+    uint64_t max_ulps;
+
+    int64_t record_index; // -1 unless it failed inside a TEST_CASE_VECTORS
+} lr_assert_record_t;
+
+lr_assert_record_t __lr_assert_ring[_LR_ASSERT_RING_SIZE];
+volatile int64_t __lr_assert_head; // every record ever written
+int64_t __lr_assert_tail; // every record already reported
+
+// Threads may fail at once, so each takes its slot atomically. With far more
+// failures in flight than fit in the ring, two can race for a slot, which at
+// worst garbles a message in place of one that would be dropped anyway.
+lr_assert_record_t *_lr_next_assert_record()
+{
+    int64_t slot = _lr_atomic_fetch_add64(&__lr_assert_head, 1);
+    lr_assert_record_t *record =
+        &__lr_assert_ring[slot % _LR_ASSERT_RING_SIZE];
+    record->record_index = __lr_record_index;
+    return record;
+}
 
-/******************************************************************************/
-/////////////////////////////// BEGIN EXECUTABLE ///////////////////////////////
-/******************************************************************************/
+// Finds the conversion in a single-value format like "%5.2f" or "%" PRIu64,
+// returning its character and pointing length at the modifier before it.
+char _lr_format_conversion(char const *format, char const **length,
+                           int32_t *length_len)
+{
+    char const *c = format;
+    while ((c = strchr(c, '%')) != 0 && c[1] == '%')
+        c += 2;
+    if (!c)
+        return 0;
+
+    c++;
+    c += strspn(c, "-+ #0123456789.");
+    *length = c;
+    *length_len = (int32_t)strspn(c, "hlLqjzt");
+    return c[*length_len];
+}
 
+void _lr_assert_failed(lr_assert_site_t const *site,
+                       void const *actual, int32_t actual_size,
+                       void const *comp, int32_t comp_size)
+{
+    lr_assert_record_t *record = _lr_next_assert_record();
+    void const *operands[2] = { actual, comp };
+    int32_t sizes[2] = { actual_size, comp_size };
+
+    char const *length;
+    int32_t length_len;
+    char conversion = site->format ?
+        _lr_format_conversion(site->format, &length, &length_len) : 0;
+
+    record->site = site;
+    for (int32_t i = 0; i < 2; i++) {
+        unsigned char *bytes = record->operands[i];
+        memset(bytes, 0, _LR_MAX_ASSERT_OPERAND);
+
+        // the string may well be gone by the time the test is reported
+        if (conversion == 's' && operands[i]) {
+            char const *string;
+            memcpy(&string, operands[i], sizeof(string));
+            snprintf((char *)bytes, _LR_MAX_ASSERT_OPERAND, "%s",
+                     string ? string : "(null)");
+            record->sizes[i] = -1;
+            continue;
+        }
 
-#ifdef LR_GEN_EXECUTABLE
+        record->sizes[i] = sizes[i] < _LR_MAX_ASSERT_OPERAND ?
+                           sizes[i] : _LR_MAX_ASSERT_OPERAND;
+        if (operands[i])
+            memcpy(bytes, operands[i], record->sizes[i]);
+    }
 
-int32_t lr_min(int32_t a, int32_t b)
-{
-    return a > b ? b : a;
+    __lr_test_passed = false;
 }
 
-char **lr_get_directory(char *start_dir, int64_t *file_count)
+bool _lr_length_is(char const *length, int32_t length_len, char const *is)
 {
-    char **result = 0;
+    return length_len == (int32_t)strlen(is) &&
+           strncmp(length, is, length_len) == 0;
+}
 
-    char *stack[1024] = { 0 };
-    int32_t stack_size = 0;
+// Rebuilds the operand from its bytes as the type its format expects.
+void _lr_format_operand(char *out, int32_t out_size, char const *format,
+                        unsigned char const *bytes, int32_t size)
+{
+    char const *length;
+    int32_t length_len;
+    char conversion = _lr_format_conversion(format, &length, &length_len);
+
+    if (size < 0) {
+        snprintf(out, out_size, format, (char const *)bytes);
+    } else if (strchr("fFeEgGaA", conversion) && conversion) {
+        if (_lr_length_is(length, length_len, "L")) {
+            long double value = 0;
+            memcpy(&value, bytes, size < (int32_t)sizeof(value) ?
+                                  size : sizeof(value));
+            snprintf(out, out_size, format, value);
+        } else if (size == sizeof(float)) {
+            float value;
+            memcpy(&value, bytes, sizeof(value));
+            snprintf(out, out_size, format, (double)value);
+        } else {
+            double value;
+            memcpy(&value, bytes, sizeof(value));
+            snprintf(out, out_size, format, value);
+        }
+    } else if (conversion == 'p') {
+        void *value;
+        memcpy(&value, bytes, sizeof(value));
+        snprintf(out, out_size, format, value);
+    } else if (conversion && strchr("diouxXc", conversion)) {
+        bool is_signed = conversion == 'd' || conversion == 'i';
+        int64_t value = 0;
+        if (size == 1)
+            value = is_signed ? *(int8_t *)bytes : *(uint8_t *)bytes;
+        else if (size == 2)
+            value = is_signed ? *(int16_t *)bytes : *(uint16_t *)bytes;
+        else if (size == 4)
+            value = is_signed ? *(int32_t *)bytes : *(uint32_t *)bytes;
+        else
+            memcpy(&value, bytes, sizeof(value));
+
+        if (_lr_length_is(length, length_len, "l"))
+            snprintf(out, out_size, format, (long)value);
+        else if (_lr_length_is(length, length_len, "ll") ||
+                 _lr_length_is(length, length_len, "q"))
+            snprintf(out, out_size, format, (long long)value);
+        else if (_lr_length_is(length, length_len, "j"))
+            snprintf(out, out_size, format, (intmax_t)value);
+        else if (_lr_length_is(length, length_len, "z"))
+            snprintf(out, out_size, format, (size_t)value);
+        else if (_lr_length_is(length, length_len, "t"))
+            snprintf(out, out_size, format, (ptrdiff_t)value);
+        else
+            snprintf(out, out_size, format, (int)value);
+    } else {
+        snprintf(out, out_size, "%s", format);
+    }
+}
 
-    stack[stack_size++] = start_dir;
+// Compilers which can target AVX2 per function get a kernel for it, which is
+// only used if the CPU has it too.
+#if defined(__SSE2__) || defined(_M_X64)
+#define _LR_HAS_SSE2_KERNELS 1
+#else
+#define _LR_HAS_SSE2_KERNELS 0
+#endif
 
-    while (stack_size) {
-        char *dir_path = stack[--stack_size];
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define _LR_HAS_AVX2_KERNELS 1
+#else
+#define _LR_HAS_AVX2_KERNELS 0
+#endif
 
-#ifdef _WIN32
+#if defined(__GNUC__) || defined(__clang__)
+#define _LR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define _LR_TARGET_AVX2
+#endif
 
-        char path[2048];
-        snprintf(path, _LR_ARRAY_COUNT(path), "%s/*.*", dir_path);
+#if _LR_HAS_AVX2_KERNELS
+bool _lr_use_avx2_kernels()
+{
+    static int32_t has_avx2 = -1;
+    if (has_avx2 < 0)
+        has_avx2 = _lr_cpu_has_avx2();
+    return has_avx2 != 0;
+}
+#endif
 
-        WIN32_FIND_DATA fd;
-        HANDLE handle = NULL;
-        if ((handle = FindFirstFile(path, &fd)) == INVALID_HANDLE_VALUE)
-            continue;
+int32_t _lr_popcount32(uint32_t value)
+{
+    int32_t count = 0;
+    for (; value; value &= value - 1)
+        count++;
+    return count;
+}
 
-        do {
-            if (strcmp(fd.cFileName, ".") != 0 &&
-                strcmp(fd.cFileName, "..") != 0) {
-                snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir_path,
-                         fd.cFileName);
+int64_t _lr_first_difference_scalar(unsigned char const *a,
+                                    unsigned char const *b,
+                                    int64_t start, int64_t length)
+{
+    int64_t i = start;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            break;
+    }
+    for (; i < length; i++)
+        if (a[i] != b[i])
+            return i;
+    return -1;
+}
 
-                if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                    int64_t path_length = strlen(path) + 1;
-                    stack[stack_size] = (char *)malloc(path_length);
-                    memcpy(stack[stack_size], path, path_length);
-                    stack_size++;
-                } else {
-                    int64_t path_length = strlen(path) + 1;
-                    char *filename = (char *)malloc(path_length);
-                    memcpy(filename, path, path_length);
+#if _LR_HAS_SSE2_KERNELS
+int64_t _lr_first_difference_sse2(unsigned char const *a,
+                                  unsigned char const *b, int64_t length)
+{
+    int64_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i const *)(a + i));
+        __m128i y = _mm_loadu_si128((__m128i const *)(b + i));
+        uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (equal != 0xffff)
+            return i + _lr_lsb32(~equal);
+    }
+    return _lr_first_difference_scalar(a, b, i, length);
+}
+#endif
 
-                    lr_sb_push(result, filename);
-                }
-            }
-        } while (FindNextFile(handle, &fd));
+#if _LR_HAS_AVX2_KERNELS
+_LR_TARGET_AVX2
+int64_t _lr_first_difference_avx2(unsigned char const *a,
+                                  unsigned char const *b, int64_t length)
+{
+    int64_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i const *)(a + i));
+        __m256i y = _mm256_loadu_si256((__m256i const *)(b + i));
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(x, y));
+        if (equal != 0xffffffff)
+            return i + _lr_lsb32(~equal);
+    }
+    return _lr_first_difference_scalar(a, b, i, length);
+}
+#endif
 
-        FindClose(handle);
+int64_t _lr_first_difference(void const *a, void const *b, int64_t length)
+{
+    unsigned char const *x = (unsigned char const *)a;
+    unsigned char const *y = (unsigned char const *)b;
+
+    if (length <= 0 || a == b)
+        return -1;
+#if _LR_HAS_AVX2_KERNELS
+    if (_lr_use_avx2_kernels())
+        return _lr_first_difference_avx2(x, y, length);
+#endif
+#if _LR_HAS_SSE2_KERNELS
+    return _lr_first_difference_sse2(x, y, length);
+#else
+    return _lr_first_difference_scalar(x, y, 0, length);
+#endif
+}
 
-#else // !_WIN32
-        char path[2048];
-        snprintf(path, _LR_ARRAY_COUNT(path), "%s", dir_path);
+/******************************************************************************/
+/////////////////////////// Floating point tolerance ///////////////////////////
+/******************************************************************************/
+// The kernels only count the elements outside of tolerance, which is all that
+// passing needs. Finding the largest error is left to the failure path. An
+// infinite difference is never near, or rel_tol would make infinity near
+// everything; equal infinities are still near because they're equal.
 
-        DIR *dir = 0;
-        struct dirent *fd = {0};
+bool _lr_near_f32(float a, float b, float abs_tol, float rel_tol)
+{
+    float diff = a - b < 0 ? b - a : a - b;
+    float abs_a = a < 0 ? -a : a;
+    float abs_b = b < 0 ? -b : b;
+    float tol = rel_tol * (abs_a > abs_b ? abs_a : abs_b);
+    return a == b ||
+           (diff <= FLT_MAX && diff <= (tol > abs_tol ? tol : abs_tol));
+}
 
-        dir = opendir(path);
-        if (!dir) {
-            printf("Could not open directory %s.", path);
-            continue;
-        }
+bool _lr_near_f64(double a, double b, double abs_tol, double rel_tol)
+{
+    double diff = a - b < 0 ? b - a : a - b;
+    double abs_a = a < 0 ? -a : a;
+    double abs_b = b < 0 ? -b : b;
+    double tol = rel_tol * (abs_a > abs_b ? abs_a : abs_b);
+    return a == b ||
+           (diff <= DBL_MAX && diff <= (tol > abs_tol ? tol : abs_tol));
+}
 
-        fd = readdir(dir);
-        if (!fd) {
-            printf("Could not read directory %s.", path);
-            continue;
-        }
+// Sign and magnitude bits to two's complement, so that adjacent floats are
+// adjacent integers and -0 and 0 are the same. The distance between two of
+// them never overflows as an unsigned number.
+uint64_t _lr_ulp_distance_f32(float a, float b)
+{
+    int32_t x;
+    int32_t y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    x = x < 0 ? -(x & INT32_MAX) : x;
+    y = y < 0 ? -(y & INT32_MAX) : y;
+    return x > y ? (uint32_t)x - (uint32_t)y : (uint32_t)y - (uint32_t)x;
+}
 
-        do {
-            if (strcmp(fd->d_name, ".") != 0 &&
-                strcmp(fd->d_name, "..") != 0) {
-                snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir_path,
-                    fd->d_name);
+uint64_t _lr_ulp_distance_f64(double a, double b)
+{
+    int64_t x;
+    int64_t y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    x = x < 0 ? -(x & INT64_MAX) : x;
+    y = y < 0 ? -(y & INT64_MAX) : y;
+    return x > y ? (uint64_t)x - (uint64_t)y : (uint64_t)y - (uint64_t)x;
+}
 
-                if (fd->d_type == DT_DIR) {
-                    int64_t path_length = strlen(path) + 1;
-                    stack[stack_size] = (char *)malloc(path_length);
-                    memcpy(stack[stack_size], path, path_length);
-                    stack_size++;
-                } else {
-                    int64_t path_length = strlen(path) + 1;
-                    char *filename = (char *)malloc(path_length);
-                    memcpy(filename, path, path_length);
+int64_t _lr_count_not_near_f32_scalar(float const *a, float const *b,
+                                      int64_t start, int64_t n,
+                                      float abs_tol, float rel_tol)
+{
+    int64_t count = 0;
+    for (int64_t i = start; i < n; i++)
+        count += !_lr_near_f32(a[i], b[i], abs_tol, rel_tol);
+    return count;
+}
 
-                    lr_sb_push(result, filename);
-                }
-            }
-        } while ((fd = readdir(dir)));
+int64_t _lr_count_not_near_f64_scalar(double const *a, double const *b,
+                                      int64_t start, int64_t n,
+                                      double abs_tol, double rel_tol)
+{
+    int64_t count = 0;
+    for (int64_t i = start; i < n; i++)
+        count += !_lr_near_f64(a[i], b[i], abs_tol, rel_tol);
+    return count;
+}
 
-        closedir(dir);
+int64_t _lr_count_not_ulp_eq_f32_scalar(float const *a, float const *b,
+                                        int64_t start, int64_t n,
+                                        uint64_t max_ulps)
+{
+    int64_t count = 0;
+    for (int64_t i = start; i < n; i++)
+        count += a[i] != a[i] || b[i] != b[i] ||
+                 _lr_ulp_distance_f32(a[i], b[i]) > max_ulps;
+    return count;
+}
 
-#endif // /_WIN32
-        if (dir_path != start_dir)
-            free(dir_path);
-    }
+int64_t _lr_count_not_ulp_eq_f64_scalar(double const *a, double const *b,
+                                        int64_t start, int64_t n,
+                                        uint64_t max_ulps)
+{
+    int64_t count = 0;
+    for (int64_t i = start; i < n; i++)
+        count += a[i] != a[i] || b[i] != b[i] ||
+                 _lr_ulp_distance_f64(a[i], b[i]) > max_ulps;
+    return count;
+}
 
-    *file_count = lr_sb_count(result);
-    return result;
+#if _LR_HAS_SSE2_KERNELS
+int64_t _lr_count_not_near_f32_sse2(float const *a, float const *b,
+                                    int64_t n, float abs_tol, float rel_tol)
+{
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 abs_v = _mm_set1_ps(abs_tol);
+    __m128 rel_v = _mm_set1_ps(rel_tol);
+    __m128 max_v = _mm_set1_ps(FLT_MAX);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(a + i);
+        __m128 y = _mm_loadu_ps(b + i);
+        __m128 diff = _mm_andnot_ps(sign, _mm_sub_ps(x, y));
+        __m128 big = _mm_max_ps(_mm_andnot_ps(sign, x),
+                                _mm_andnot_ps(sign, y));
+        __m128 tol = _mm_max_ps(abs_v, _mm_mul_ps(rel_v, big));
+        __m128 within = _mm_and_ps(_mm_cmple_ps(diff, tol),
+                                   _mm_cmple_ps(diff, max_v));
+        __m128 near = _mm_or_ps(within, _mm_cmpeq_ps(x, y));
+        count += _lr_popcount32(~_mm_movemask_ps(near) & 0xf);
+    }
+    return count + _lr_count_not_near_f32_scalar(a, b, i, n, abs_tol,
+                                                 rel_tol);
+}
 
-    // char **result = 0;
-    // DIR *d;
-    // struct dirent *dir;
-    // d = opendir(".");
-    // if (d) {
-    //     while ((dir = readdir(d)) != NULL)
-    //     {
-    //         printf("%s\n", dir->d_name);
-    //     }
+int64_t _lr_count_not_near_f64_sse2(double const *a, double const *b,
+                                    int64_t n, double abs_tol,
+                                    double rel_tol)
+{
+    __m128d sign = _mm_set1_pd(-0.0);
+    __m128d abs_v = _mm_set1_pd(abs_tol);
+    __m128d rel_v = _mm_set1_pd(rel_tol);
+    __m128d max_v = _mm_set1_pd(DBL_MAX);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d y = _mm_loadu_pd(b + i);
+        __m128d diff = _mm_andnot_pd(sign, _mm_sub_pd(x, y));
+        __m128d big = _mm_max_pd(_mm_andnot_pd(sign, x),
+                                 _mm_andnot_pd(sign, y));
+        __m128d tol = _mm_max_pd(abs_v, _mm_mul_pd(rel_v, big));
+        __m128d within = _mm_and_pd(_mm_cmple_pd(diff, tol),
+                                    _mm_cmple_pd(diff, max_v));
+        __m128d near = _mm_or_pd(within, _mm_cmpeq_pd(x, y));
+        count += _lr_popcount32(~_mm_movemask_pd(near) & 0x3);
+    }
+    return count + _lr_count_not_near_f64_scalar(a, b, i, n, abs_tol,
+                                                 rel_tol);
+}
 
-    //     closedir(d);
-    // }
+// SSE2 has no 64 bit compare, so only floats get an SSE2 ULP kernel.
+int64_t _lr_count_not_ulp_eq_f32_sse2(float const *a, float const *b,
+                                      int64_t n, uint64_t max_ulps)
+{
+    __m128i magnitude = _mm_set1_epi32(INT32_MAX);
+    __m128i flip = _mm_set1_epi32(INT32_MIN);
+    __m128i limit = _mm_xor_si128(_mm_set1_epi32(
+        (int32_t)(max_ulps < UINT32_MAX ? max_ulps : UINT32_MAX)), flip);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(a + i);
+        __m128 y = _mm_loadu_ps(b + i);
+        __m128i xi = _mm_castps_si128(x);
+        __m128i yi = _mm_castps_si128(y);
+        __m128i x_sign = _mm_srai_epi32(xi, 31);
+        __m128i y_sign = _mm_srai_epi32(yi, 31);
+        xi = _mm_sub_epi32(_mm_xor_si128(_mm_and_si128(xi, magnitude),
+                                         x_sign), x_sign);
+        yi = _mm_sub_epi32(_mm_xor_si128(_mm_and_si128(yi, magnitude),
+                                         y_sign), y_sign);
+
+        __m128i greater = _mm_cmpgt_epi32(xi, yi);
+        __m128i distance = _mm_or_si128(
+            _mm_and_si128(greater, _mm_sub_epi32(xi, yi)),
+            _mm_andnot_si128(greater, _mm_sub_epi32(yi, xi)));
+        __m128i far = _mm_cmpgt_epi32(_mm_xor_si128(distance, flip), limit);
+        __m128 out = _mm_or_ps(_mm_castsi128_ps(far), _mm_cmpunord_ps(x, y));
+        count += _lr_popcount32(_mm_movemask_ps(out));
+    }
+    return count + _lr_count_not_ulp_eq_f32_scalar(a, b, i, n, max_ulps);
 }
+#endif
 
-int32_t lr_is_whitespace(char c)
+#if _LR_HAS_AVX2_KERNELS
+_LR_TARGET_AVX2
+int64_t _lr_count_not_near_f32_avx2(float const *a, float const *b,
+                                    int64_t n, float abs_tol, float rel_tol)
 {
-    return c == ' ' || (c >= '\t' && c <= '\r');
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 abs_v = _mm256_set1_ps(abs_tol);
+    __m256 rel_v = _mm256_set1_ps(rel_tol);
+    __m256 max_v = _mm256_set1_ps(FLT_MAX);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(a + i);
+        __m256 y = _mm256_loadu_ps(b + i);
+        __m256 diff = _mm256_andnot_ps(sign, _mm256_sub_ps(x, y));
+        __m256 big = _mm256_max_ps(_mm256_andnot_ps(sign, x),
+                                   _mm256_andnot_ps(sign, y));
+        __m256 tol = _mm256_max_ps(abs_v, _mm256_mul_ps(rel_v, big));
+        __m256 within = _mm256_and_ps(_mm256_cmp_ps(diff, tol, _CMP_LE_OQ),
+                                      _mm256_cmp_ps(diff, max_v,
+                                                    _CMP_LE_OQ));
+        __m256 near = _mm256_or_ps(within, _mm256_cmp_ps(x, y, _CMP_EQ_OQ));
+        count += _lr_popcount32(~_mm256_movemask_ps(near) & 0xff);
+    }
+    return count + _lr_count_not_near_f32_scalar(a, b, i, n, abs_tol,
+                                                 rel_tol);
 }
 
-lr_slice_t lr_eat_whitespace_and_comments(lr_slice_t s)
+_LR_TARGET_AVX2
+int64_t _lr_count_not_near_f64_avx2(double const *a, double const *b,
+                                    int64_t n, double abs_tol,
+                                    double rel_tol)
 {
-    char *data = s.data;
-    int64_t len = s.len;
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d abs_v = _mm256_set1_pd(abs_tol);
+    __m256d rel_v = _mm256_set1_pd(rel_tol);
+    __m256d max_v = _mm256_set1_pd(DBL_MAX);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(x, y));
+        __m256d big = _mm256_max_pd(_mm256_andnot_pd(sign, x),
+                                    _mm256_andnot_pd(sign, y));
+        __m256d tol = _mm256_max_pd(abs_v, _mm256_mul_pd(rel_v, big));
+        __m256d within = _mm256_and_pd(_mm256_cmp_pd(diff, tol, _CMP_LE_OQ),
+                                       _mm256_cmp_pd(diff, max_v,
+                                                     _CMP_LE_OQ));
+        __m256d near = _mm256_or_pd(within,
+                                    _mm256_cmp_pd(x, y, _CMP_EQ_OQ));
+        count += _lr_popcount32(~_mm256_movemask_pd(near) & 0xf);
+    }
+    return count + _lr_count_not_near_f64_scalar(a, b, i, n, abs_tol,
+                                                 rel_tol);
+}
 
-    while (len > 0) {
-        if (lr_is_whitespace(*data)) {
-            ++data;
-            --len;
-        } else if (len > 1 && data[0] == '/' && data[1] == '/') {
-            data += 2;
-            len -= 2;
-            while (len > 0 && *data != '\n') {
-                ++data;
-                --len;
-            }
-        } else if (len > 1 && data[0] == '/' && data[1] == '*') {
-            data += 2;
-            len -= 2;
-            while (len > 0 && !(data[0] == '*' && len > 1 && data[1] == '/')) {
-                ++data;
-                --len;
-            }
-            if (len > 2) {
-                data += 2;
-                len -= 2;
-            } else {
-                data += len;
-                len = 0;
-            }
-        } else {
-            break;
-        }
+_LR_TARGET_AVX2
+int64_t _lr_count_not_ulp_eq_f32_avx2(float const *a, float const *b,
+                                      int64_t n, uint64_t max_ulps)
+{
+    __m256i magnitude = _mm256_set1_epi32(INT32_MAX);
+    __m256i flip = _mm256_set1_epi32(INT32_MIN);
+    __m256i limit = _mm256_xor_si256(_mm256_set1_epi32(
+        (int32_t)(max_ulps < UINT32_MAX ? max_ulps : UINT32_MAX)), flip);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(a + i);
+        __m256 y = _mm256_loadu_ps(b + i);
+        __m256i xi = _mm256_castps_si256(x);
+        __m256i yi = _mm256_castps_si256(y);
+        __m256i x_sign = _mm256_srai_epi32(xi, 31);
+        __m256i y_sign = _mm256_srai_epi32(yi, 31);
+        xi = _mm256_sub_epi32(_mm256_xor_si256(
+            _mm256_and_si256(xi, magnitude), x_sign), x_sign);
+        yi = _mm256_sub_epi32(_mm256_xor_si256(
+            _mm256_and_si256(yi, magnitude), y_sign), y_sign);
+
+        __m256i greater = _mm256_cmpgt_epi32(xi, yi);
+        __m256i distance = _mm256_blendv_epi8(_mm256_sub_epi32(yi, xi),
+                                              _mm256_sub_epi32(xi, yi),
+                                              greater);
+        __m256i far = _mm256_cmpgt_epi32(_mm256_xor_si256(distance, flip),
+                                         limit);
+        __m256 out = _mm256_or_ps(_mm256_castsi256_ps(far),
+                                  _mm256_cmp_ps(x, y, _CMP_UNORD_Q));
+        count += _lr_popcount32(_mm256_movemask_ps(out));
     }
+    return count + _lr_count_not_ulp_eq_f32_scalar(a, b, i, n, max_ulps);
+}
 
-    lr_slice_t result;
-    result.data = data;
-    result.len = len;
-    return result;
+_LR_TARGET_AVX2
+int64_t _lr_count_not_ulp_eq_f64_avx2(double const *a, double const *b,
+                                      int64_t n, uint64_t max_ulps)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i magnitude = _mm256_set1_epi64x(INT64_MAX);
+    __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+    __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)max_ulps),
+                                     flip);
+    int64_t count = 0;
+    int64_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        __m256i xi = _mm256_castpd_si256(x);
+        __m256i yi = _mm256_castpd_si256(y);
+        __m256i x_sign = _mm256_cmpgt_epi64(zero, xi);
+        __m256i y_sign = _mm256_cmpgt_epi64(zero, yi);
+        xi = _mm256_sub_epi64(_mm256_xor_si256(
+            _mm256_and_si256(xi, magnitude), x_sign), x_sign);
+        yi = _mm256_sub_epi64(_mm256_xor_si256(
+            _mm256_and_si256(yi, magnitude), y_sign), y_sign);
+
+        __m256i greater = _mm256_cmpgt_epi64(xi, yi);
+        __m256i distance = _mm256_blendv_epi8(_mm256_sub_epi64(yi, xi),
+                                              _mm256_sub_epi64(xi, yi),
+                                              greater);
+        __m256i far = _mm256_cmpgt_epi64(_mm256_xor_si256(distance, flip),
+                                         limit);
+        __m256d out = _mm256_or_pd(_mm256_castsi256_pd(far),
+                                   _mm256_cmp_pd(x, y, _CMP_UNORD_Q));
+        count += _lr_popcount32(_mm256_movemask_pd(out));
+    }
+    return count + _lr_count_not_ulp_eq_f64_scalar(a, b, i, n, max_ulps);
 }
+#endif
 
-int32_t lr_is_digit(char c)
+int64_t _lr_count_not_near(void const *a, void const *b, int64_t n,
+                           int32_t element_size, double abs_tol,
+                           double rel_tol)
 {
-    return c >= '0' && c <= '9';
+    if (element_size == sizeof(float)) {
+        float const *x = (float const *)a;
+        float const *y = (float const *)b;
+#if _LR_HAS_AVX2_KERNELS
+        if (_lr_use_avx2_kernels())
+            return _lr_count_not_near_f32_avx2(x, y, n, (float)abs_tol,
+                                               (float)rel_tol);
+#endif
+#if _LR_HAS_SSE2_KERNELS
+        return _lr_count_not_near_f32_sse2(x, y, n, (float)abs_tol,
+                                           (float)rel_tol);
+#else
+        return _lr_count_not_near_f32_scalar(x, y, 0, n, (float)abs_tol,
+                                             (float)rel_tol);
+#endif
+    }
+
+    double const *x = (double const *)a;
+    double const *y = (double const *)b;
+#if _LR_HAS_AVX2_KERNELS
+    if (_lr_use_avx2_kernels())
+        return _lr_count_not_near_f64_avx2(x, y, n, abs_tol, rel_tol);
+#endif
+#if _LR_HAS_SSE2_KERNELS
+    return _lr_count_not_near_f64_sse2(x, y, n, abs_tol, rel_tol);
+#else
+    return _lr_count_not_near_f64_scalar(x, y, 0, n, abs_tol, rel_tol);
+#endif
 }
 
-int32_t lr_is_word_char(char c)
+int64_t _lr_count_not_ulp_eq(void const *a, void const *b, int64_t n,
+                             int32_t element_size, uint64_t max_ulps)
 {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           (c == '_');
+    if (element_size == sizeof(float)) {
+        float const *x = (float const *)a;
+        float const *y = (float const *)b;
+#if _LR_HAS_AVX2_KERNELS
+        if (_lr_use_avx2_kernels())
+            return _lr_count_not_ulp_eq_f32_avx2(x, y, n, max_ulps);
+#endif
+#if _LR_HAS_SSE2_KERNELS
+        return _lr_count_not_ulp_eq_f32_sse2(x, y, n, max_ulps);
+#else
+        return _lr_count_not_ulp_eq_f32_scalar(x, y, 0, n, max_ulps);
+#endif
+    }
+
+    double const *x = (double const *)a;
+    double const *y = (double const *)b;
+#if _LR_HAS_AVX2_KERNELS
+    if (_lr_use_avx2_kernels())
+        return _lr_count_not_ulp_eq_f64_avx2(x, y, n, max_ulps);
+#endif
+    return _lr_count_not_ulp_eq_f64_scalar(x, y, 0, n, max_ulps);
 }
 
-int32_t lr_is_identifier(char c)
+// The error of an element is its distance, or ULP distance, from the other.
+// A NaN's error is NaN, and counts as the largest.
+double _lr_element_error(lr_assert_site_t const *site, void const *a,
+                         void const *b, int64_t i, int32_t element_size)
 {
-    return lr_is_word_char(c) || lr_is_digit(c);
+    bool ulps = site->kind == LR_ASSERT_ULP_EQ ||
+                site->kind == LR_ASSERT_ARRAY_ULP;
+    double x;
+    double y;
+    if (element_size == sizeof(float)) {
+        float fx = ((float const *)a)[i];
+        float fy = ((float const *)b)[i];
+        if (ulps && fx == fx && fy == fy)
+            return (double)_lr_ulp_distance_f32(fx, fy);
+        x = fx;
+        y = fy;
+    } else {
+        x = ((double const *)a)[i];
+        y = ((double const *)b)[i];
+        if (ulps && x == x && y == y)
+            return (double)_lr_ulp_distance_f64(x, y);
+    }
+
+    if (x != x || y != y)
+        return x != x ? x : y;
+    if (x == y)
+        return 0;
+    return x > y ? x - y : y - x;
 }
 
-bool lr_lex_identifier(lr_slice_t *c, c_token_t *token)
+void _lr_assert_tolerance_failed(lr_assert_site_t const *site,
+                                 void const *a, void const *b, int64_t n,
+                                 int32_t element_size, int64_t count,
+                                 double abs_tol, double rel_tol,
+                                 uint64_t max_ulps)
 {
-    if (lr_is_word_char(*c->data)) {
-        int32_t len = 1;
-        while (c->len - len) {
-            if (lr_is_word_char(c->data[len]) || lr_is_digit(c->data[len]))
-                ++len;
-            else
-                break;
+    lr_assert_record_t *record = _lr_next_assert_record();
+    int64_t worst = 0;
+    double error = _lr_element_error(site, a, b, 0, element_size);
+
+    for (int64_t i = 1; i < n && error == error; i++) {
+        double e = _lr_element_error(site, a, b, i, element_size);
+        if (e != e || e > error) {
+            worst = i;
+            error = e;
         }
+    }
 
-        lr_slice_t token_slice = lr_slice_l(*c, len);
-        *c = lr_slice_r(*c, len);
-        token->type = LR_TOKEN_IDENTIFIER;
-        token->slice = token_slice;
-        return true;
-    } else {
-        return false;
+    record->site = site;
+    record->length = n;
+    record->offset = worst;
+    record->element_size = element_size;
+    record->count = count;
+    record->error = error;
+    record->abs_tol = abs_tol;
+    record->rel_tol = rel_tol;
+    record->max_ulps = max_ulps;
+    record->sizes[0] = record->sizes[1] = element_size;
+    memcpy(record->operands[0], (char const *)a + worst * element_size,
+           element_size);
+    memcpy(record->operands[1], (char const *)b + worst * element_size,
+           element_size);
+
+    __lr_test_passed = false;
+}
+
+void _lr_print_tolerance_failure(lr_assert_record_t *record)
+{
+    lr_assert_site_t const *site = record->site;
+    char const *format = record->element_size == sizeof(float) ?
+                         "%.9g" : "%.17g";
+    char a[64];
+    char b[64];
+    char error[64];
+    _lr_format_operand(a, _LR_ARRAY_COUNT(a), format, record->operands[0],
+                       record->element_size);
+    _lr_format_operand(b, _LR_ARRAY_COUNT(b), format, record->operands[1],
+                       record->element_size);
+    snprintf(error, _LR_ARRAY_COUNT(error), "%.3g", record->error);
+
+    switch (site->kind) {
+    case LR_ASSERT_NEAR:
+        printf("Expected %s to be within %g of %s -- %s, line %d\n", a,
+               record->abs_tol, b, _LR_DIR(site->file), site->line);
+        return;
+    case LR_ASSERT_ULP_EQ:
+        printf("Expected %s to be within %" PRIu64 " ULPs of %s, but it "
+               "is %s ULPs away -- %s, line %d\n", a, record->max_ulps, b,
+               error, _LR_DIR(site->file), site->line);
+        return;
+    case LR_ASSERT_ARRAY_NEAR:
+        printf("Expected (%s) to be within %g or %g relative, but %" PRId64
+               " of %" PRId64 " elements are not -- %s, line %d\n",
+               site->expression, record->abs_tol, record->rel_tol,
+               record->count, record->length, _LR_DIR(site->file),
+               site->line);
+        break;
+    default:
+        printf("Expected (%s) to be within %" PRIu64 " ULPs, but %" PRId64
+               " of %" PRId64 " elements are not -- %s, line %d\n",
+               site->expression, record->max_ulps, record->count,
+               record->length, _LR_DIR(site->file), site->line);
+        break;
     }
+    printf("    largest error %s%s at [%" PRId64 "]: %s vs %s\n", error,
+           site->kind == LR_ASSERT_ARRAY_ULP ? " ULPs" : "", record->offset,
+           a, b);
 }
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
 
-bool lr_lex_constant(lr_slice_t *c, c_token_t *token)
+// The first difference is in the first quarter of the window, so that a
+// run of differences after it shows up too. Elements too large to fit in the
+// window are kept as bytes, like ASSERT_MEM_EQ keeps them.
+void _lr_assert_mem_failed(lr_assert_site_t const *site,
+                           void const *a, void const *b, int64_t length,
+                           int64_t offset, int32_t element_size)
 {
-    uint32_t token_type;
+    lr_assert_record_t *record = _lr_next_assert_record();
+    int64_t window = _LR_MAX_ASSERT_OPERAND / element_size * element_size;
+    int64_t start = 0;
+    if (element_size == 1 || window == 0) {
+        window = _LR_MAX_ASSERT_OPERAND;
+        start = (offset - window / 4) & ~(int64_t)15;
+    } else {
+        start = (offset - window / 4) / element_size * element_size;
+    }
+    if (start < 0)
+        start = 0;
+    if (start + window > length)
+        window = length - start;
+
+    record->site = site;
+    record->length = length;
+    record->offset = offset;
+    record->window_start = start;
+    record->element_size = element_size;
+    record->sizes[0] = record->sizes[1] = (int32_t)window;
+    memcpy(record->operands[0], (char const *)a + start, window);
+    memcpy(record->operands[1], (char const *)b + start, window);
 
-    if (lr_is_digit(*c->data)) {
-        token_type = LR_TOKEN_NUMBER;
-        int32_t len = 1;
-        while (c->len - len) {
-            char ch = c->data[len];
-            if (!lr_is_digit(ch) &&
-                ch != '.' &&
-                ch != 'x' &&
-                ch != 'X')
-                break;
-            len++;
-        }
+    __lr_test_passed = false;
+}
 
-        lr_slice_t token_slice = lr_slice_l(*c, len);
-        *c = lr_slice_r(*c, len);
-        token->type = token_type;
-        token->slice = token_slice;
-        return true;
-    } else if (*c->data == '\'') {
-        token_type = LR_TOKEN_CHARACTER;
-        int32_t len = 1;
-        while (c->len - len - 1) {
-            if (c->data[len] == '\\') {
-                if (c->data[len + 1] == 'x') {
-                    len = lr_min(len + 4, (int32_t)c->len + 1);
-                    continue;
-                } else {
-                    len = lr_min(len + 2, (int32_t)c->len + 1);
-                    continue;
-                }
-            }
-            if (c->data[len] == '\'')
-                break;
-            len++;
+// Both sides of the window, 16 bytes to a line, with the differences marked.
+void _lr_print_hexdump(lr_assert_record_t *record)
+{
+    for (int32_t line = 0; line < record->sizes[0]; line += 16) {
+        int32_t end = line + 16 < record->sizes[0] ? line + 16 :
+                      record->sizes[0];
+        for (int32_t side = 0; side < 2; side++) {
+            if (side == 0)
+                printf("    %08" PRIx64 "  a:", record->window_start + line);
+            else
+                printf("              b:");
+            for (int32_t i = line; i < end; i++)
+                printf(" %02x", record->operands[side][i]);
+            printf("\n");
         }
 
-        lr_slice_t token_slice = lr_slice_l(*c, len + 1);
-        *c = lr_slice_r(*c, len + 1);
-        token->type = token_type;
-        token->slice = token_slice;
-        return true;
-    } else {
-        return false;
+        int32_t last = -1;
+        for (int32_t i = line; i < end; i++)
+            if (record->operands[0][i] != record->operands[1][i])
+                last = i;
+        if (last < 0)
+            continue;
+        printf("                ");
+        for (int32_t i = line; i <= last; i++)
+            printf(record->operands[0][i] != record->operands[1][i] ?
+                   " ^^" : "   ");
+        printf("\n");
     }
 }
 
-bool lr_lex_string(lr_slice_t *c, c_token_t *token)
+void _lr_print_mem_failure(lr_assert_record_t *record)
 {
-    if (*c->data == '"') {
-        int32_t len = 1;
-        while (c->len - len - 1) {
-            if (c->data[len] == '\\') {
-                if (c->data[len + 1] == 'x') {
-                    len = lr_min(len + 4, (int32_t)c->len + 1);
-                    continue;
-                } else {
-                    len = lr_min(len + 2, (int32_t)c->len + 1);
-                    continue;
-                }
-            }
-            if (c->data[len] == '"')
-                break;
-            len++;
-        }
+    lr_assert_site_t const *site = record->site;
+    printf("Expected (%s) to be equal, but byte %" PRId64 " of %" PRId64
+           " differs -- %s, line %d\n", site->expression, record->offset,
+           record->length, _LR_DIR(site->file), site->line);
+    _lr_print_hexdump(record);
+}
 
-        lr_slice_t token_slice = lr_slice_l(*c, len + 1);
-        *c = lr_slice_r(*c, len + 1);
-        token->type = LR_TOKEN_STRING;
-        token->slice = token_slice;
-        return true;
-    } else {
-        return false;
+void _lr_print_array_failure(lr_assert_record_t *record)
+{
+    lr_assert_site_t const *site = record->site;
+    int32_t size = record->element_size;
+    printf("Expected (%s) to be equal, but element %" PRId64 " of %" PRId64
+           " differs -- %s, line %d\n", site->expression,
+           record->offset / size, record->length / size,
+           _LR_DIR(site->file), site->line);
+
+    if (size > _LR_MAX_ASSERT_OPERAND) {
+        _lr_print_hexdump(record);
+        return;
+    }
+    for (int32_t i = 0; i + size <= record->sizes[0]; i += size) {
+        char a[128];
+        char b[128];
+        bool differs = memcmp(record->operands[0] + i,
+                              record->operands[1] + i, size) != 0;
+        _lr_format_operand(a, _LR_ARRAY_COUNT(a), site->format,
+                           record->operands[0] + i, size);
+        _lr_format_operand(b, _LR_ARRAY_COUNT(b), site->format,
+                           record->operands[1] + i, size);
+        printf("  %s [%" PRId64 "]  %-16s %s\n", differs ? ">" : " ",
+               (record->window_start + i) / size, a, b);
     }
 }
 
-bool lr_lex_single_char_token(lr_slice_t *c, c_token_t *token)
+// Prints, and forgets, every failure recorded since the last report.
+void _lr_report_assert_failures()
 {
-    uint32_t token_type;
-    lr_slice_t token_slice;
+    char const *descriptions[] = {
+        "to be true", "to be false", "to equal", "to not equal",
+        "to be greater than", "to be less than",
+        "to be greater than or equal to", "to be less than or equal to",
+    };
 
-    switch (*c->data) {
-    case '(': { token_type = LR_TOKEN_L_PAREN; break; }
-    case ')': { token_type = LR_TOKEN_R_PAREN; break; }
-    case '{': { token_type = LR_TOKEN_L_BRACE; break; }
-    case '}': { token_type = LR_TOKEN_R_BRACE; break; }
-    case '[': { token_type = LR_TOKEN_L_BRACKET; break; }
-    case ']': { token_type = LR_TOKEN_R_BRACKET; break; }
-    case '*': { token_type = LR_TOKEN_ASTERISK; break; }
-    case ',': { token_type = LR_TOKEN_COMMA; break; }
-    case '.': { token_type = LR_TOKEN_PERIOD; break; }
-    case '-': { token_type = LR_TOKEN_MINUS; break; }
-    case '+': { token_type = LR_TOKEN_PLUS; break; }
-    case '!': { token_type = LR_TOKEN_EXCLAMATION; break; }
-    case '~': { token_type = LR_TOKEN_TILDE; break; }
-    case '\\': { token_type = LR_TOKEN_BACKSLASH; break; }
-    case '/': { token_type = LR_TOKEN_SLASH; break; }
-    case '=': { token_type = LR_TOKEN_EQ; break; }
-    case '&': { token_type = LR_TOKEN_AMPERSAND; break; }
-    case '#': { token_type = LR_TOKEN_POUND; break; }
-    case ';': { token_type = LR_TOKEN_SEMICOLON; break; }
-    case ':': { token_type = LR_TOKEN_COLON; break; }
-    case '?': { token_type = LR_TOKEN_QUESTION_MARK; break; }
-    default: { token_type = LR_TOKEN_UNKNOWN; break; }
+    if (__lr_assert_head == __lr_assert_tail)
+        return;
+
+    _lr_set_color_yel();
+    if (__lr_assert_head - __lr_assert_tail > _LR_ASSERT_RING_SIZE) {
+        printf("(%" PRId64 " earlier assertion failures were dropped)\n",
+               __lr_assert_head - __lr_assert_tail - _LR_ASSERT_RING_SIZE);
+        __lr_assert_tail = __lr_assert_head - _LR_ASSERT_RING_SIZE;
     }
 
-    if (token_type != LR_TOKEN_UNKNOWN) {
-        token_slice = lr_slice_l(*c, 1);
-        *c = lr_slice_r(*c, 1);
-        token->type = token_type;
-        token->slice = token_slice;
-        return true;
-    } else {
-        return false;
+    for (; __lr_assert_tail < __lr_assert_head; __lr_assert_tail++) {
+        lr_assert_record_t *record =
+            &__lr_assert_ring[__lr_assert_tail % _LR_ASSERT_RING_SIZE];
+        lr_assert_site_t const *site = record->site;
+
+        if (record->record_index >= 0)
+            printf("Assertion Failed on record %" PRId64 ":\n",
+                   record->record_index);
+        else
+            printf("Assertion Failed:\n");
+        if (site->kind == LR_ASSERT_MEM_EQ) {
+            _lr_print_mem_failure(record);
+            continue;
+        } else if (site->kind == LR_ASSERT_ARRAY_EQ) {
+            _lr_print_array_failure(record);
+            continue;
+        } else if (site->kind >= LR_ASSERT_NEAR) {
+            _lr_print_tolerance_failure(record);
+            continue;
+        } else if (!site->format) {
+            printf("Expected (%s) %s -- %s, line %d\n", site->expression,
+                   descriptions[site->kind], _LR_DIR(site->file),
+                   site->line);
+            continue;
+        }
+
+        char actual[128];
+        char comp[128];
+        _lr_format_operand(actual, _LR_ARRAY_COUNT(actual), site->format,
+                           record->operands[0], record->sizes[0]);
+        _lr_format_operand(comp, _LR_ARRAY_COUNT(comp), site->format,
+                           record->operands[1], record->sizes[1]);
+        printf("Expected %s %s %s -- %s, line %d\n", actual,
+               descriptions[site->kind], comp, _LR_DIR(site->file),
+               site->line);
     }
+    _lr_set_color_def();
 }
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
 
-c_token_t *lr_lex_file(lr_slice_t s, int32_t *count)
+#define _LR_MAX_COUNTERS 16
+
+typedef struct {
+    char name[32];
+    double value;
+    bool per_second;
+} lr_counter_t;
+
+_LR_THREAD_LOCAL double __lr_bytes_processed;
+_LR_THREAD_LOCAL double __lr_items_processed;
+_LR_THREAD_LOCAL lr_counter_t __lr_counters[_LR_MAX_COUNTERS];
+_LR_THREAD_LOCAL int32_t __lr_counter_count;
+
+void lr_set_bytes_processed(int64_t bytes)
 {
-    int32_t capacity = 64;
-    c_token_t *result = (c_token_t *)malloc(capacity * sizeof(c_token_t));
-    lr_slice_t c = s;
+    __lr_bytes_processed = (double)bytes;
+}
 
-    int32_t i = 0;
+void lr_set_items_processed(int64_t items)
+{
+    __lr_items_processed = (double)items;
+}
 
-    while (true) {
-        if (i >= capacity) {
-            capacity += capacity / 2;
-            result = (c_token_t *)realloc(result, capacity * sizeof(c_token_t));
+void _lr_add_counter(lr_counter_t *counters, int32_t *count,
+                     char const *name, double value, bool per_second)
+{
+    for (int32_t i = 0; i < *count; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            counters[i].value += value;
+            return;
         }
+    }
 
-        c_token_t *t = &result[i];
+    if (*count == _LR_MAX_COUNTERS)
+        return;
 
-        if (!c.len) {
-            t->type = LR_TOKEN_EOF;
-            t->slice = lr_slice_l(c, 0);
-            ++i;
-            break;
-        } else {
-            c = lr_eat_whitespace_and_comments(c);
+    lr_counter_t *counter = &counters[(*count)++];
+    snprintf(counter->name, _LR_ARRAY_COUNT(counter->name), "%s", name);
+    counter->value = value;
+    counter->per_second = per_second;
+}
 
-            if (c.len) {
-                if (lr_lex_single_char_token(&c, t)) {
-                } else if (lr_lex_constant(&c, t)) {
-                } else if (lr_lex_string(&c, t)) {
-                } else if (lr_lex_identifier(&c, t)) {
-                } else {
-                    t->type = LR_TOKEN_UNKNOWN;
-                    t->slice = lr_slice_l(c, 1);
-                    c = lr_slice_r(c, 1);
-                }
+void lr_counter(char const *name, double value)
+{
+    _lr_add_counter(__lr_counters, &__lr_counter_count, name, value, false);
+}
 
-                assert(c.len >= 0);
-                ++i;
-            }
+void lr_counter_rate(char const *name, double value)
+{
+    _lr_add_counter(__lr_counters, &__lr_counter_count, name, value, true);
+}
+
+typedef struct {
+    int64_t allocations;
+    int64_t bytes;
+    int64_t live;
+    int64_t peak;
+} lr_alloc_stats_t;
+
+_LR_THREAD_LOCAL bool __lr_tracking_allocations;
+_LR_THREAD_LOCAL bool __lr_expect_no_allocations;
+_LR_THREAD_LOCAL lr_alloc_stats_t __lr_alloc_stats;
+
+void lr_expect_no_allocations(void)
+{
+    __lr_expect_no_allocations = true;
+}
+
+// Defining LR_TRACK_ALLOCATIONS in the implementation TU replaces malloc and
+// friends for the whole program with versions which count what happens
+// while a benchmark is running. Only glibc is supported, since it lets us
+// forward to its own allocator.
+#if defined(LR_TRACK_ALLOCATIONS) && !defined(LR_GEN_EXECUTABLE) && \
+    defined(__GLIBC__)
+#define _LR_TRACKS_ALLOCATIONS 1
+
+#include <errno.h>
+#include <malloc.h>
+
+// glibc declares these nothrow, and C++ insists that definitions match
+#ifdef __cplusplus
+#define _LR_NOTHROW __THROW
+extern "C" {
+#else
+#define _LR_NOTHROW
+#endif
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *pointer);
+
+void _lr_track_allocation(void *pointer, size_t size)
+{
+    if (!pointer || !__lr_tracking_allocations)
+        return;
+
+    lr_alloc_stats_t *stats = &__lr_alloc_stats;
+    stats->allocations++;
+    stats->bytes += size;
+    stats->live += malloc_usable_size(pointer);
+    if (stats->live > stats->peak)
+        stats->peak = stats->live;
+}
+
+void _lr_track_free(void *pointer)
+{
+    if (pointer && __lr_tracking_allocations)
+        __lr_alloc_stats.live -= malloc_usable_size(pointer);
+}
+
+void *malloc(size_t size) _LR_NOTHROW
+{
+    void *result = __libc_malloc(size);
+    _lr_track_allocation(result, size);
+    return result;
+}
+
+void *calloc(size_t count, size_t size) _LR_NOTHROW
+{
+    void *result = __libc_calloc(count, size);
+    _lr_track_allocation(result, count * size);
+    return result;
+}
+
+void *realloc(void *pointer, size_t size) _LR_NOTHROW
+{
+    size_t old_size = pointer ? malloc_usable_size(pointer) : 0;
+    void *result = __libc_realloc(pointer, size);
+
+    // when realloc fails the old block is still alive, but a size of 0 frees
+    // it and returns NULL
+    if ((result || size == 0) && __lr_tracking_allocations)
+        __lr_alloc_stats.live -= old_size;
+    _lr_track_allocation(result, size);
+    return result;
+}
+
+void *reallocarray(void *pointer, size_t count, size_t size) _LR_NOTHROW
+{
+    if (size && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(pointer, count * size);
+}
+
+// The aligned allocators all end up in memalign. Their frees go through
+// free like any other block, so they have to be counted here as well or
+// the live bytes would go negative.
+void *memalign(size_t alignment, size_t size) _LR_NOTHROW
+{
+    void *result = __libc_memalign(alignment, size);
+    _lr_track_allocation(result, size);
+    return result;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) _LR_NOTHROW
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) _LR_NOTHROW
+{
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+
+    void *result = memalign(alignment, size);
+    if (!result)
+        return ENOMEM;
+    *pointer = result;
+    return 0;
+}
+
+void *valloc(size_t size) _LR_NOTHROW
+{
+    void *result = __libc_valloc(size);
+    _lr_track_allocation(result, size);
+    return result;
+}
+
+void *pvalloc(size_t size) _LR_NOTHROW
+{
+    void *result = __libc_pvalloc(size);
+    _lr_track_allocation(result, size);
+    return result;
+}
+
+void free(void *pointer) _LR_NOTHROW
+{
+    _lr_track_free(pointer);
+    __libc_free(pointer);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+#define _LR_TRACKS_ALLOCATIONS 0
+#endif
+
+// Measures the cycle counter against the wall clock once, so that cycle
+// counts can be turned into rates.
+double _lr_cycles_per_second()
+{
+    static double result = 0;
+
+    if (result == 0) {
+        double start_time = _lr_wall_time();
+        uint64_t start_cycles = _LR_GETCYCLES();
+        while (_lr_wall_time() - start_time < 0.05) {
         }
+        uint64_t end_cycles = _LR_GETCYCLES();
+        result = (end_cycles - start_cycles) / (_lr_wall_time() - start_time);
     }
+    return result;
+}
 
-    *count = i;
+/******************************************************************************/
+////////////////////// Sean Barrett's Stretchy Buffer///////////////////////////
+//////// https://github.com/nothings/stb/blob/master/stretchy_buffer.h /////////
+/******************************************************************************/
+#define lr_sb_free(a)   ((a) ? free(lr__sbraw(a)), 0 : 0)
+#define lr_sb_push(a, v) (lr__sbmaybegrow(a, 1), (a)[lr__sbn(a)++] = (v))
+#define lr_sb_count(a)  ((a) ? lr__sbn(a) : 0)
+#define lr_sb_add(a, n)  (lr__sbmaybegrow(a, n), \
+                          lr__sbn(a) += (n), \
+                          & (a)[lr__sbn(a) - (n)])
+#define lr_sb_last(a)   ((a)[lr__sbn(a) - 1])
+
+#define lr__sbraw(a) ((int64_t *)(a) - 2)
+#define lr__sbm(a)   lr__sbraw(a)[0]
+#define lr__sbn(a)   lr__sbraw(a)[1]
+
+#define lr__sbneedgrow(a, n)  ((a) == 0 || lr__sbn(a) + (n) >= lr__sbm(a))
+#define lr__sbmaybegrow(a, n) (lr__sbneedgrow(a, (n)) ? lr__sbgrow(a, n) : 0)
+#define lr__sbgrow(a, \
+                   n)      (*((void **)&a) = \
+                                lr__sbgrowf(((void *)a), (n), sizeof(*(a))))
+
+static void *lr__sbgrowf(void *arr, int64_t increment, int64_t itemsize)
+{
+    int64_t dbl_cur = arr ? 2 * lr__sbm(arr) : 0;
+    int64_t min_needed = lr_sb_count(arr) + increment;
+    int64_t m = dbl_cur > min_needed ? dbl_cur : min_needed;
+    int64_t *p = (int64_t *)realloc(arr ?
+                                    lr__sbraw(arr) :
+                                    0, itemsize * m + sizeof(int64_t) * 2);
+
+    if (p) {
+        if (!arr)
+            p[1] = 0;
+        p[0] = m;
+        return p + 2;
+    } else {
+#ifdef STRETCHY_BUFFER_OUT_OF_MEMORY
+        STRETCHY_BUFFER_OUT_OF_MEMORY;
+#endif
+        return (void *)(2 * sizeof(int64_t));
+    }
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+/******************************************************************************/
+////////////////////////////////// Math helpers ////////////////////////////////
+//////////////// (kept local so that users don't have to link libm) ///////////
+/******************************************************************************/
+#define _LR_LN2 0.69314718055994530942
+
+double _lr_abs(double x)
+{
+    return x < 0 ? -x : x;
+}
+
+double _lr_sqrt(double x)
+{
+    if (x <= 0)
+        return 0;
+
+    double result = x > 1 ? x : 1;
+    for (int32_t i = 0; i < 128; i++) {
+        double next = 0.5 * (result + x / result);
+        if (next == result)
+            break;
+        result = next;
+    }
     return result;
 }
 
-lr_slice_t lr_read_file(char *f)
+double _lr_exp(double x)
 {
-    FILE *fp = fopen(f, "rb");
+    if (x > 700)
+        x = 700;
+    else if (x < -700)
+        x = -700;
+
+    // exp(x) = 2^k * exp(r), where |r| <= ln(2) / 2
+    int32_t k = (int32_t)(x / _LR_LN2 + (x < 0 ? -0.5 : 0.5));
+    double r = x - k * _LR_LN2;
+
+    double term = 1;
+    double result = 1;
+    for (int32_t i = 1; i < 20; i++) {
+        term *= r / i;
+        result += term;
+    }
 
-    if (!fp)
-        return lr_as_slice(0, 0);
+    for (; k > 0; k--)
+        result *= 2;
+    for (; k < 0; k++)
+        result /= 2;
+    return result;
+}
 
-    fseek(fp, 0, SEEK_END);
-    int64_t len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+double _lr_log(double x)
+{
+    if (x <= 0)
+        return 0;
+
+    int32_t e = 0;
+    for (; x >= 2; e++)
+        x /= 2;
+    for (; x < 1; e--)
+        x *= 2;
+
+    // ln(x) = 2 * atanh(y), where y = (x - 1) / (x + 1) <= 1 / 3
+    double y = (x - 1) / (x + 1);
+    double term = y;
+    double result = 0;
+    for (int32_t i = 1; i < 40; i += 2) {
+        result += term / i;
+        term *= y * y;
+    }
+    return 2 * result + e * _LR_LN2;
+}
 
-    char *data = (char *)malloc(len + 1);
-    if (!fread(data, len, 1, fp))
-        return lr_as_slice(0, 0);
+// Abramowitz & Stegun 7.1.26, absolute error < 1.5e-7
+double _lr_erfc(double x)
+{
+    double z = _lr_abs(x);
+    double t = 1 / (1 + 0.3275911 * z);
+    double poly = t * (0.254829592 +
+                  t * (-0.284496736 +
+                  t * (1.421413741 +
+                  t * (-1.453152027 +
+                  t * 1.061405429))));
+    double result = poly * _lr_exp(-z * z);
+    return x >= 0 ? result : 2 - result;
+}
+
+int _lr_compare_doubles(const void *a, const void *b)
+{
+    double lhs = *(const double *)a;
+    double rhs = *(const double *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+double _lr_median(double *samples, int64_t count)
+{
+    if (!count)
+        return 0;
+
+    double *sorted = (double *)malloc(count * sizeof(double));
+    memcpy(sorted, samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), _lr_compare_doubles);
+
+    double result = count % 2 ?
+                    sorted[count / 2] :
+                    0.5 * (sorted[count / 2 - 1] + sorted[count / 2]);
+    free(sorted);
+    return result;
+}
+
+// Two-sided Mann-Whitney U test using the normal approximation, with tie and
+// continuity correction. Returns the p-value for the hypothesis that both
+// sets of samples come from the same distribution.
+double _lr_mann_whitney_p(double *a, int64_t a_count,
+                          double *b, int64_t b_count)
+{
+    int64_t n = a_count + b_count;
+    if (!a_count || !b_count)
+        return 1;
+
+    typedef struct {
+        double value;
+        int32_t group;
+    } lr_ranked_t;
+
+    lr_ranked_t *all = (lr_ranked_t *)malloc(n * sizeof(lr_ranked_t));
+    for (int64_t i = 0; i < a_count; i++) {
+        all[i].value = a[i];
+        all[i].group = 0;
+    }
+    for (int64_t i = 0; i < b_count; i++) {
+        all[a_count + i].value = b[i];
+        all[a_count + i].group = 1;
+    }
+
+    // value is the first member, so the doubles comparator sorts these too
+    qsort(all, n, sizeof(lr_ranked_t), _lr_compare_doubles);
+
+    double rank_sum_a = 0;
+    double tie_sum = 0;
+    for (int64_t i = 0; i < n;) {
+        int64_t j = i;
+        while (j < n && all[j].value == all[i].value)
+            j++;
+
+        double rank = 0.5 * (i + 1 + j); // average of ranks i + 1 .. j
+        for (int64_t k = i; k < j; k++)
+            if (all[k].group == 0)
+                rank_sum_a += rank;
+
+        double ties = (double)(j - i);
+        tie_sum += ties * ties * ties - ties;
+        i = j;
+    }
+    free(all);
+
+    double u = rank_sum_a - a_count * (a_count + 1) / 2.0;
+    double mean = a_count * b_count / 2.0;
+    double variance = a_count * b_count / 12.0 *
+                      ((n + 1) - tie_sum / ((double)n * (n - 1)));
+    if (variance <= 0)
+        return 1;
+
+    double delta = _lr_abs(u - mean) - 0.5;
+    if (delta < 0)
+        delta = 0;
+
+    double z = delta / _lr_sqrt(variance);
+    return _lr_erfc(z / _lr_sqrt(2));
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+#if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST)
+typedef struct {
+    char const *name;
+    void *(*create)(void);
+    void (*destroy)(void *fixture);
+    void *instance;
+} lr_fixture_t;
+
+lr_fixture_t __lr_fixtures[] = {
+    { 0, 0, 0, 0 },
+#define FIXTURE_DEFINITION(name) { #name, __lr_fixture_create_##name, 0, 0 },
+#include "labrat_data.c"
+#undef FIXTURE_DEFINITION
+};
+
+lr_fixture_t *_lr_find_fixture(char const *name)
+{
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(__lr_fixtures); i++)
+        if (strcmp(__lr_fixtures[i].name, name) == 0)
+            return &__lr_fixtures[i];
+    return 0;
+}
+
+// Sets the fixture up the first time that it's asked for.
+void *_lr_get_fixture(char const *name)
+{
+    lr_fixture_t *fixture = _lr_find_fixture(name);
+    if (!fixture) {
+        printf("LABRAT: No FIXTURE_SETUP found for fixture: %s\n", name);
+        return 0;
+    }
+
+    if (!fixture->instance)
+        fixture->instance = fixture->create();
+    return fixture->instance;
+}
+
+void _lr_destroy_fixtures()
+{
+    lr_fixture_t *fixture;
+#define FIXTURE_TEARDOWN_DEFINITION(name) \
+    fixture = _lr_find_fixture(#name); \
+    if (fixture) \
+        fixture->destroy = __lr_fixture_destroy_##name;
+#include "labrat_data.c"
+#undef FIXTURE_TEARDOWN_DEFINITION
+
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(__lr_fixtures); i++) {
+        fixture = &__lr_fixtures[i];
+        if (!fixture->instance)
+            continue;
+
+        if (fixture->destroy)
+            fixture->destroy(fixture->instance);
+        free(fixture->instance);
+        fixture->instance = 0;
+    }
+}
+
+void _lr_print_warning(char const *message)
+{
+    _lr_set_color_yel();
+    printf("    [ WARNING  ] -- %s\n", message);
+    _lr_set_color_def();
+}
+
+bool _lr_report_test(const char *name)
+{
+    _lr_report_assert_failures();
+    if (__lr_test_passed) {
+        _lr_set_color_grn();
+        printf("    [ PASSED ] -- %s\n", name);
+        _lr_set_color_def();
+        return true;
+    } else {
+        _lr_set_color_red();
+        printf("    [ FAILED ] -- %s\n", name);
+        _lr_set_color_def();
+        return false;
+    }
+}
+
+bool __lr_test_definition(void (*func)(void), const char *name)
+{
+    __lr_test_passed = true;
+    func();
+    return _lr_report_test(name);
+}
+
+bool __lr_test_f_definition(void (*func)(void *), const char *name,
+                            const char *fixture)
+{
+    void *instance = _lr_get_fixture(fixture);
+
+    __lr_test_passed = instance != 0;
+    if (instance)
+        func(instance);
+    return _lr_report_test(name);
+}
+
+/******************************************************************************/
+/////////////////////////////// Test vector files //////////////////////////////
+/******************************************************************************/
+// The file is split into a chunk per thread at line boundaries. Each thread
+// counts the records in its chunk, so that every record knows its index, and
+// then runs them.
+typedef struct {
+    void (*func)(char const *record, int64_t record_size,
+                 int64_t record_index);
+    char const *begin;
+    char const *end;
+    int64_t first_index;
+    int64_t records;
+    int64_t failed;
+    int64_t first_failed;
+} lr_vectors_chunk_t;
+
+void *_lr_count_vectors(void *param)
+{
+    lr_vectors_chunk_t *chunk = (lr_vectors_chunk_t *)param;
+    char const *c = chunk->begin;
+
+    while (c < chunk->end) {
+        char const *newline = (char const *)memchr(c, '\n', chunk->end - c);
+        chunk->records++;
+        c = newline ? newline + 1 : chunk->end;
+    }
+    return 0;
+}
+
+// Runs func on every chunk at once. A chunk whose thread couldn't be started
+// runs on this one instead.
+void _lr_run_chunks(void *(*func)(void *), lr_vectors_chunk_t *chunks,
+                    int32_t count)
+{
+    lr_thread_t handles[64];
+    bool started[64];
+    for (int32_t i = 0; i < count; i++) {
+        started[i] = _lr_start_thread(&handles[i], func, &chunks[i]);
+        if (!started[i])
+            func(&chunks[i]);
+    }
+    for (int32_t i = 0; i < count; i++)
+        if (started[i])
+            _lr_join_thread(handles[i]);
+}
+
+void *_lr_run_vectors(void *param)
+{
+    lr_vectors_chunk_t *chunk = (lr_vectors_chunk_t *)param;
+    char const *c = chunk->begin;
+    chunk->first_failed = -1;
+
+    for (int64_t i = chunk->first_index; c < chunk->end; i++) {
+        char const *newline = (char const *)memchr(c, '\n', chunk->end - c);
+        char const *next = newline ? newline + 1 : chunk->end;
+        int64_t size = (newline ? newline : chunk->end) - c;
+        if (size && c[size - 1] == '\r')
+            size--;
+
+        __lr_test_passed = true;
+        __lr_record_index = i;
+        chunk->func(c, size, i);
+        if (!__lr_test_passed) {
+            if (!chunk->failed)
+                chunk->first_failed = i;
+            chunk->failed++;
+        }
+        c = next;
+    }
+    __lr_record_index = -1;
+    return 0;
+}
+
+bool __lr_test_vectors_definition(void (*func)(char const *, int64_t,
+                                               int64_t),
+                                  const char *name, const char *path)
+{
+    int64_t size = 0;
+    char const *data = _lr_map_file(path, &size);
+    if (!data) {
+        printf("LABRAT: Failed to map test vectors: %s\n", path);
+        __lr_test_passed = false;
+        return _lr_report_test(name);
+    }
+
+    // small files aren't worth a thread per core
+    int32_t thread_count = _lr_cpu_count();
+    if (thread_count > 64)
+        thread_count = 64;
+    if (thread_count > size / 4096 + 1)
+        thread_count = (int32_t)(size / 4096 + 1);
+
+    lr_vectors_chunk_t chunks[64];
+    char const *end = data + size;
+    char const *begin = data;
+    for (int32_t i = 0; i < thread_count; i++) {
+        lr_vectors_chunk_t *chunk = &chunks[i];
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->func = func;
+        chunk->begin = begin;
+        chunk->end = i == thread_count - 1 ? end :
+                     data + size * (i + 1) / thread_count;
+        if (chunk->end < begin)
+            chunk->end = begin;
+
+        // every chunk but the last ends just after a line
+        char const *newline = chunk->end > data && chunk->end < end ?
+            (char const *)memchr(chunk->end - 1, '\n', end - chunk->end + 1)
+            : 0;
+        if (chunk->end < end)
+            chunk->end = newline ? newline + 1 : end;
+        begin = chunk->end;
+    }
+
+    _lr_run_chunks(_lr_count_vectors, chunks, thread_count);
+
+    int64_t records = 0;
+    for (int32_t i = 0; i < thread_count; i++) {
+        chunks[i].first_index = records;
+        records += chunks[i].records;
+    }
+
+    _lr_run_chunks(_lr_run_vectors, chunks, thread_count);
+    _lr_unmap_file(data, size);
+
+    int64_t failed = 0;
+    int64_t first_failed = -1;
+    for (int32_t i = 0; i < thread_count; i++) {
+        failed += chunks[i].failed;
+        if (first_failed < 0)
+            first_failed = chunks[i].first_failed;
+    }
+
+    _lr_report_assert_failures();
+    __lr_test_passed = failed == 0;
+    if (failed) {
+        _lr_set_color_yel();
+        printf("%" PRId64 " of %" PRId64 " records in %s failed, the first "
+               "being record %" PRId64 "\n", failed, records, path,
+               first_failed);
+        _lr_set_color_def();
+    }
+    return _lr_report_test(name);
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+/******************************************************************************/
+//////////////////////////// Change-aware selection ////////////////////////////
+/******************************************************************************/
+// labrat records the file every test is in, and the graph of quoted includes
+// reachable from them. With --lr-changed-since, a test only runs if its file
+// or anything the file includes, however indirectly, has changed. Paths are
+// relative to where labrat ran, which should be where the tests run too.
+// The data file refers to files by path, so that the shard for a directory
+// only changes with the directory, and the paths are resolved to indices
+// into __lr_source_files before any test runs.
+typedef struct {
+    char const *changed_since; // a git revision, or a file to compare mtimes
+    bool record_coverage;
+    bool no_cache; // run tests which passed last time too
+} lr_test_options_t;
+
+lr_test_options_t __lr_test_options = { 0 };
+
+typedef struct {
+    char const *path;
+    uint64_t hash; // of its tokens and those of everything it includes
+} lr_source_t;
+
+lr_source_t __lr_source_files[] = {
+    { 0, 0 },
+#define SOURCE_FILE_DEFINITION(path, hash) { path, hash },
+#include "labrat_data.c"
+#undef SOURCE_FILE_DEFINITION
+};
+
+char const *__lr_include_paths[][2] = {
+    { 0, 0 },
+#define INCLUDE_DEFINITION(from, to) { from, to },
+#include "labrat_data.c"
+#undef INCLUDE_DEFINITION
+};
+
+typedef struct {
+    char const *name;
+    char const *path;
+    int32_t file; // the index of the path, once resolved, or 0
+} lr_named_file_t;
+
+lr_named_file_t __lr_test_files[] = {
+    { 0, 0, 0 },
+#define TEST_FILE_DEFINITION(id, path) { #id, path, 0 },
+#include "labrat_data.c"
+#undef TEST_FILE_DEFINITION
+};
+
+lr_named_file_t __lr_function_files[] = {
+    { 0, 0, 0 },
+#define FUNCTION_DEFINITION(name, path) { #name, path, 0 },
+#include "labrat_data.c"
+#undef FUNCTION_DEFINITION
+};
+
+typedef struct {
+    char const *name;
+    int32_t index;
+} lr_name_index_t;
+
+int _lr_compare_name_index(void const *a, void const *b)
+{
+    return strcmp(((lr_name_index_t const *)a)->name,
+                  ((lr_name_index_t const *)b)->name);
+}
+
+// The first of the entries sorted by name to have the name, or -1.
+int64_t _lr_find_name(lr_name_index_t *sorted, int64_t count,
+                      char const *name)
+{
+    int64_t lo = 0;
+    int64_t hi = count;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (strcmp(sorted[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && strcmp(sorted[lo].name, name) == 0 ? lo : -1;
+}
+
+lr_name_index_t *_lr_sort_named_files(lr_named_file_t *entries,
+                                      int64_t count)
+{
+    lr_name_index_t *sorted = (lr_name_index_t *)malloc(
+        (count + 1) * sizeof(lr_name_index_t));
+    for (int64_t i = 1; i < count; i++) {
+        sorted[i - 1].name = entries[i].name;
+        sorted[i - 1].index = (int32_t)i;
+    }
+    qsort(sorted, count - 1, sizeof(lr_name_index_t), _lr_compare_name_index);
+    return sorted;
+}
+
+lr_name_index_t *__lr_sources_by_path;
+int32_t (*__lr_includes)[2];
+
+// The index of the source file with the path, or 0 if labrat didn't list it.
+int32_t _lr_source_index(char const *path)
+{
+    int64_t i = _lr_find_name(__lr_sources_by_path,
+                              _LR_ARRAY_COUNT(__lr_source_files) - 1, path);
+    return i < 0 ? 0 : __lr_sources_by_path[i].index;
+}
+
+void _lr_resolve_source_files(void)
+{
+    if (__lr_sources_by_path)
+        return;
+
+    int64_t count = _LR_ARRAY_COUNT(__lr_source_files);
+    __lr_sources_by_path = (lr_name_index_t *)malloc(
+        count * sizeof(lr_name_index_t));
+    for (int64_t i = 1; i < count; i++) {
+        __lr_sources_by_path[i - 1].name = __lr_source_files[i].path;
+        __lr_sources_by_path[i - 1].index = (int32_t)i;
+    }
+    qsort(__lr_sources_by_path, count - 1, sizeof(lr_name_index_t),
+          _lr_compare_name_index);
+
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(__lr_test_files); i++)
+        __lr_test_files[i].file = _lr_source_index(__lr_test_files[i].path);
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(__lr_function_files); i++)
+        __lr_function_files[i].file =
+            _lr_source_index(__lr_function_files[i].path);
+
+    int64_t include_count = _LR_ARRAY_COUNT(__lr_include_paths);
+    __lr_includes = (int32_t (*)[2])malloc(include_count *
+                                           sizeof(*__lr_includes));
+    for (int64_t i = 1; i < include_count; i++) {
+        __lr_includes[i - 1][0] = _lr_source_index(__lr_include_paths[i][0]);
+        __lr_includes[i - 1][1] = _lr_source_index(__lr_include_paths[i][1]);
+    }
+}
+
+bool *__lr_affected_files; // by index, or 0 to run every test
+bool *__lr_changed_files; // by index, the ones which changed themselves
+bool *__lr_mapped_tests; // by number, those the coverage map lists, or 0
+bool *__lr_affected_tests; // by number, from the coverage map, or 0
+
+bool _lr_mark_git_changes(char const *rev, bool *changed)
+{
+    // the revision goes through the shell, so it can only look like one
+    if (!rev[0] ||
+        strspn(rev, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                    "0123456789._-/~^@{}") != strlen(rev))
+        return false;
+
+    char command[512];
+    snprintf(command, _LR_ARRAY_COUNT(command),
+             "git diff --name-only --relative %s -- && "
+             "git ls-files --others --exclude-standard", rev);
+    fflush(stdout);
+    FILE *pipe = _lr_popen(command, "r");
+    if (!pipe)
+        return false;
+
+    char line[2048];
+    while (fgets(line, _LR_ARRAY_COUNT(line), pipe)) {
+        line[strcspn(line, "\r\n")] = 0;
+        changed[_lr_source_index(line)] = true;
+    }
+    return _lr_pclose(pipe) == 0;
+}
+
+// A file is affected if it changed or includes one which is affected.
+void _lr_propagate_changes(bool *affected, int32_t (*includes)[2],
+                           int64_t include_count)
+{
+    for (bool more = true; more;) {
+        more = false;
+        for (int64_t i = 0; i < include_count; i++) {
+            if (affected[includes[i][1]] && !affected[includes[i][0]]) {
+                affected[includes[i][0]] = true;
+                more = true;
+            }
+        }
+    }
+}
+
+// An existing file means anything written after it changed, and anything
+// else is handed to git diff.
+void _lr_find_affected_files(char const *since)
+{
+    int64_t count = _LR_ARRAY_COUNT(__lr_source_files);
+    bool *affected = (bool *)calloc(count, sizeof(bool));
+    int64_t cutoff = _lr_file_mtime(since);
+
+    if (cutoff >= 0) {
+        for (int64_t i = 1; i < count; i++) {
+            int64_t mtime = _lr_file_mtime(__lr_source_files[i].path);
+            affected[i] = mtime < 0 || mtime > cutoff;
+        }
+    } else if (!_lr_mark_git_changes(since, affected)) {
+        char message[512];
+        snprintf(message, _LR_ARRAY_COUNT(message),
+                 "could not tell what changed since %s, so every test runs",
+                 since);
+        _lr_print_warning(message);
+        free(affected);
+        return;
+    }
+
+    affected[0] = false; // git may name files labrat didn't list
+    __lr_changed_files = (bool *)malloc(count * sizeof(bool));
+    memcpy(__lr_changed_files, affected, count * sizeof(bool));
+    _lr_propagate_changes(affected, __lr_includes,
+                          _LR_ARRAY_COUNT(__lr_include_paths) - 1);
+    __lr_affected_files = affected;
+}
+
+// Tests are numbered in the order they are in the data file, which is also
+// the order of their files, unless the data file was edited by hand. Returns
+// the test's place in __lr_test_files, or 0 if it isn't there.
+int32_t _lr_test_number(int32_t number, char const *name)
+{
+    int64_t count = _LR_ARRAY_COUNT(__lr_test_files);
+    if (number < count && strcmp(__lr_test_files[number].name, name) == 0)
+        return number;
+
+    for (int32_t i = 1; i < count; i++)
+        if (strcmp(__lr_test_files[i].name, name) == 0)
+            return i;
+    return 0;
+}
+
+// A test the coverage map lists runs if it ran a function in an affected
+// file, or if its own file changed, since the map doesn't have the test's own
+// body. The rest go by the include graph.
+bool _lr_test_affected(int32_t number, char const *name)
+{
+    number = _lr_test_number(number, name);
+    if (!__lr_affected_files || !number)
+        return true;
+
+    int32_t file = __lr_test_files[number].file;
+    if (__lr_mapped_tests && __lr_mapped_tests[number])
+        return __lr_changed_files[file] || __lr_affected_tests[number];
+    return __lr_affected_files[file];
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+/******************************************************************************/
+//////////////////////////////// Coverage impact ///////////////////////////////
+/******************************************************************************/
+// --lr-record-coverage writes down the functions every test ran, with the
+// files labrat found them in, to labrat_coverage.txt. From then on,
+// --lr-changed-since runs the tests it lists if they ran a function in an
+// affected file, or their own file changed. So a change to calculator.c reruns
+// the tests in other files which call into it, and a change to a header only
+// reruns the tests which ran something it touched. Build with
+// -finstrument-functions, or with the sanitizer coverage --lr-fuzz uses, and
+// link with -rdynamic so that dladdr can name the functions. It can't name
+// static ones, so those count through the exported functions which call them,
+// which are usually in the same file.
+#define _LR_COVERAGE_FILE "labrat_coverage.txt"
+
+#if defined(__clang__)
+#define _LR_NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#elif defined(__GNUC__) && __GNUC__ >= 12
+#define _LR_NO_COVERAGE __attribute__((no_sanitize_coverage))
+#else
+#define _LR_NO_COVERAGE
+#endif
+
+// Marks the tests which, when the map was recorded, ran a function in a file
+// which is now affected, out of the ones the map lists.
+void _lr_find_covering_tests(void)
+{
+    FILE *fp = fopen(_LR_COVERAGE_FILE, "rb");
+    if (!fp)
+        return;
+
+    int64_t test_count = _LR_ARRAY_COUNT(__lr_test_files);
+    lr_name_index_t *tests = _lr_sort_named_files(__lr_test_files,
+                                                  test_count);
+    __lr_mapped_tests = (bool *)calloc(test_count, sizeof(bool));
+    __lr_affected_tests = (bool *)calloc(test_count, sizeof(bool));
+
+    // test, file and function, separated by tabs
+    char line[4096];
+    while (fgets(line, _LR_ARRAY_COUNT(line), fp)) {
+        char *file = strchr(line, '\t');
+        char *function = file ? strchr(file + 1, '\t') : 0;
+        if (!function)
+            continue;
+        *file++ = 0;
+        *function = 0;
+
+        int64_t t = _lr_find_name(tests, test_count - 1, line);
+        if (t < 0)
+            continue;
+        __lr_mapped_tests[tests[t].index] = true;
+        if (__lr_affected_files[_lr_source_index(file)])
+            __lr_affected_tests[tests[t].index] = true;
+    }
+
+    free(tests);
+    fclose(fp);
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+#define _LR_CAN_RECORD_COVERAGE 1
+
+#include <dlfcn.h>
+
+#define _LR_NO_INSTRUMENT __attribute__((no_instrument_function))
+
+// Every address seen while a test runs, kept in an open addressed set so
+// that a function called a million times costs one slot.
+#define _LR_COVERAGE_SLOTS (1 << 18)
+
+volatile bool __lr_recording_coverage;
+volatile bool __lr_coverage_overflowed;
+uintptr_t *__lr_covered;
+FILE *__lr_coverage_fp;
+lr_name_index_t *__lr_functions_by_name;
+int64_t __lr_coverage_lines;
+
+// Called from the compiler's instrumentation, so nothing in here may be
+// instrumented, or call anything which is.
+_LR_NO_INSTRUMENT _LR_NO_COVERAGE
+void _lr_record_covered(uintptr_t address)
+{
+    uint64_t hash = (uint64_t)address * 0x9E3779B97F4A7C15ull >> 46;
+    for (uint64_t i = 0; i < 64; i++) {
+        uintptr_t *slot = &__lr_covered[(hash + i) & (_LR_COVERAGE_SLOTS - 1)];
+        uintptr_t seen = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        if (!seen && __atomic_compare_exchange_n(slot, &seen, address, false,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+            return;
+        if (seen == address)
+            return;
+    }
+    __lr_coverage_overflowed = true;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// -finstrument-functions calls these on the way into and out of every
+// function.
+_LR_NO_INSTRUMENT _LR_NO_COVERAGE
+void __cyg_profile_func_enter(void *func, void *call_site)
+{
+    if (__lr_recording_coverage)
+        _lr_record_covered((uintptr_t)func);
+}
+
+_LR_NO_INSTRUMENT _LR_NO_COVERAGE
+void __cyg_profile_func_exit(void *func, void *call_site)
+{
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+// dladdr gives C++ functions their mangled names, in which _ZN3Foo3barEv is
+// Foo::bar, and the scanner only saw bar.
+void _lr_unmangle(char const *symbol, char *name, int64_t size)
+{
+    snprintf(name, size, "%s", symbol);
+    if (strncmp(symbol, "_Z", 2) != 0)
+        return;
+
+    char const *c = symbol + 2;
+    bool nested = *c == 'N';
+    if (nested)
+        c++;
+    while (nested && (*c == 'r' || *c == 'V' || *c == 'K'))
+        c++;
+    while (*c >= '0' && *c <= '9') {
+        char *end;
+        int64_t len = strtol(c, &end, 10);
+        if ((int64_t)strlen(end) < len)
+            return;
+        snprintf(name, size, "%.*s", (int32_t)len, end);
+        c = end + len;
+        if (!nested)
+            return;
+    }
+}
+
+void _lr_start_coverage(void)
+{
+    __lr_coverage_fp = fopen(_LR_COVERAGE_FILE, "wb");
+    if (!__lr_coverage_fp) {
+        printf("LABRAT: Failed to open %s\n", _LR_COVERAGE_FILE);
+        return;
+    }
+    __lr_covered = (uintptr_t *)malloc(_LR_COVERAGE_SLOTS *
+                                       sizeof(uintptr_t));
+    __lr_functions_by_name = _lr_sort_named_files(
+        __lr_function_files, _LR_ARRAY_COUNT(__lr_function_files));
+    __lr_coverage_lines = 0;
+}
+
+void _lr_begin_test_coverage(void)
+{
+    if (!__lr_coverage_fp)
+        return;
+    memset(__lr_covered, 0, _LR_COVERAGE_SLOTS * sizeof(uintptr_t));
+    __lr_recording_coverage = true;
+}
+
+// Writes a line for each function the test ran which labrat knows the file
+// of. A name defined in more than one file gets a line for every file.
+void _lr_end_test_coverage(char const *test)
+{
+    if (!__lr_coverage_fp)
+        return;
+    __lr_recording_coverage = false;
+
+    int64_t count = _LR_ARRAY_COUNT(__lr_function_files) - 1;
+    bool *ran = (bool *)calloc(count + 1, sizeof(bool));
+    for (int64_t i = 0; i < _LR_COVERAGE_SLOTS; i++) {
+        Dl_info info;
+        char name[256];
+        if (!__lr_covered[i] || !dladdr((void *)__lr_covered[i], &info) ||
+            !info.dli_sname)
+            continue;
+        _lr_unmangle(info.dli_sname, name, _LR_ARRAY_COUNT(name));
+        int64_t j = _lr_find_name(__lr_functions_by_name, count, name);
+        for (; j >= 0 && j < count &&
+               strcmp(__lr_functions_by_name[j].name, name) == 0; j++)
+            ran[j] = true;
+    }
+
+    for (int64_t j = 0; j < count; j++) {
+        if (!ran[j])
+            continue;
+        lr_named_file_t *function =
+            &__lr_function_files[__lr_functions_by_name[j].index];
+        fprintf(__lr_coverage_fp, "%s\t%s\t%s\n", test, function->path,
+                function->name);
+        __lr_coverage_lines++;
+    }
+    free(ran);
+}
+
+void _lr_finish_coverage(void)
+{
+    if (!__lr_coverage_fp)
+        return;
+    fclose(__lr_coverage_fp);
+    __lr_coverage_fp = 0;
+    free(__lr_covered);
+    free(__lr_functions_by_name);
+
+    if (__lr_coverage_overflowed)
+        _lr_print_warning("tests ran too much code to record all of it");
+    if (!__lr_coverage_lines)
+        _lr_print_warning("no coverage was recorded, so build with "
+                          "-finstrument-functions and link with -rdynamic");
+    else
+        printf("\nRecorded which functions the tests ran in %s\n",
+               _LR_COVERAGE_FILE);
+}
+#else
+#define _LR_CAN_RECORD_COVERAGE 0
+
+volatile bool __lr_recording_coverage;
+
+void _lr_record_covered(uintptr_t address)
+{
+}
+
+void _lr_start_coverage(void)
+{
+    printf("LABRAT: Recording coverage needs dladdr, which this platform "
+           "doesn't have\n");
+}
+
+void _lr_begin_test_coverage(void)
+{
+}
+
+void _lr_end_test_coverage(char const *test)
+{
+}
+
+void _lr_finish_coverage(void)
+{
+}
+#endif
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+/******************************************************************************/
+///////////////////////////////// Result cache /////////////////////////////////
+/******************************************************************************/
+// A test which passed is skipped until something it could depend on changes:
+// the tokens of its file and of everything that includes, however indirectly,
+// which labrat hashes, and the binary, which its build ID stands for. Without
+// a build ID the whole executable is hashed instead. Tests reading records
+// from a file hash that too. The keys of passing tests are kept in
+// labrat_cache.txt, and --lr-no-cache runs every test regardless.
+#define _LR_CACHE_FILE "labrat_cache.txt"
+
+uint64_t __lr_build_id; // 0 if unknown, and then nothing is cached
+uint64_t *__lr_cached_keys; // sorted, from the last run
+uint64_t *__lr_passed_keys; // from this one
+int32_t __lr_cached_count;
+
+#ifdef __linux__
+#include <link.h>
+
+// The executable is the first object dl_iterate_phdr reports.
+int _lr_find_build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+    for (int32_t i = 0; i < info->dlpi_phnum; i++) {
+        ElfW(Phdr) const *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE)
+            continue;
+
+        char const *note = (char const *)(info->dlpi_addr + phdr->p_vaddr);
+        char const *end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            ElfW(Nhdr) const *header = (ElfW(Nhdr) const *)note;
+            char const *name = note + sizeof(ElfW(Nhdr));
+            char const *desc = name + ((header->n_namesz + 3) & ~3);
+            if (header->n_type == NT_GNU_BUILD_ID &&
+                header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                *(uint64_t *)data = _lr_hash(desc, header->n_descsz,
+                                             _LR_HASH_SEED);
+                return 1;
+            }
+            note = desc + ((header->n_descsz + 3) & ~3);
+        }
+    }
+    return 1;
+}
+#endif
+
+uint64_t _lr_find_executable_hash(void)
+{
+    uint64_t hash = 0;
+#ifdef __linux__
+    dl_iterate_phdr(_lr_find_build_id, &hash);
+    if (hash)
+        return hash;
+#endif
+
+    char path[4096];
+    int64_t size = 0;
+    char const *data = _lr_executable_path(path, _LR_ARRAY_COUNT(path)) ?
+                       _lr_map_file(path, &size) : 0;
+    if (data) {
+        hash = _lr_hash(data, size, _LR_HASH_SEED);
+        _lr_unmap_file(data, size);
+    }
+    return hash;
+}
+
+int _lr_compare_keys(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return x < y ? -1 : x > y;
+}
+
+void _lr_load_cache(bool use_cached)
+{
+    __lr_build_id = _lr_find_executable_hash();
+    if (!__lr_build_id || !use_cached)
+        return;
+
+    FILE *fp = fopen(_LR_CACHE_FILE, "rb");
+    if (!fp)
+        return;
+    char line[64];
+    while (fgets(line, _LR_ARRAY_COUNT(line), fp))
+        lr_sb_push(__lr_cached_keys, strtoull(line, 0, 16));
+    fclose(fp);
+    qsort(__lr_cached_keys, lr_sb_count(__lr_cached_keys), sizeof(uint64_t),
+          _lr_compare_keys);
+}
+
+// 0 if the test can't be cached, as when labrat doesn't know its file.
+uint64_t _lr_test_key(int32_t number, char const *name,
+                      char const *vectors_path)
+{
+    number = _lr_test_number(number, name);
+    int32_t file = number ? __lr_test_files[number].file : 0;
+    if (!__lr_build_id || !file)
+        return 0;
+
+    uint64_t key = _lr_hash(name, strlen(name), _LR_HASH_SEED);
+    key = _lr_hash(&__lr_source_files[file].hash, sizeof(uint64_t), key);
+    key = _lr_hash(&__lr_build_id, sizeof(uint64_t), key);
+    if (vectors_path) {
+        int64_t size = 0;
+        char const *data = _lr_map_file(vectors_path, &size);
+        if (!data)
+            return 0;
+        key = _lr_hash(data, size, key);
+        _lr_unmap_file(data, size);
+    }
+    return key ? key : 1;
+}
+
+// Carries a cached pass over to the next run.
+bool _lr_keep_cached(uint64_t key)
+{
+    if (!key || !bsearch(&key, __lr_cached_keys,
+                         lr_sb_count(__lr_cached_keys), sizeof(uint64_t),
+                         _lr_compare_keys))
+        return false;
+
+    lr_sb_push(__lr_passed_keys, key);
+    return true;
+}
+
+bool _lr_test_cached(uint64_t key, char const *name)
+{
+    if (!_lr_keep_cached(key))
+        return false;
+
+    __lr_cached_count++;
+    _lr_set_color_grn();
+    printf("    [ CACHED ] -- %s\n", name);
+    _lr_set_color_def();
+    return true;
+}
+
+void _lr_remember_result(uint64_t key, bool passed)
+{
+    if (key && passed)
+        lr_sb_push(__lr_passed_keys, key);
+}
+
+// Only the tests which passed this time are kept, so the file never holds
+// more than a line per test.
+void _lr_save_cache(void)
+{
+    if (__lr_build_id) {
+        FILE *fp = fopen(_LR_CACHE_FILE, "wb");
+        for (int64_t i = 0; fp && i < lr_sb_count(__lr_passed_keys); i++)
+            fprintf(fp, "%016" PRIx64 "\n", __lr_passed_keys[i]);
+        if (fp)
+            fclose(fp);
+    }
+
+    lr_sb_free(__lr_cached_keys);
+    lr_sb_free(__lr_passed_keys);
+    __lr_cached_keys = 0;
+    __lr_passed_keys = 0;
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+void lr_run_tests(void)
+{
+#ifndef LR_OFF // just produce an empty function if LR_OFF
+    _lr_set_color_wht();
+    printf("\nRunning tests:\n\n");
+    _lr_set_color_def();
+
+    bool tests[] = {
+        0,
+#define TEST_DEFINITION(id) 0,
+#define TEST_F_DEFINITION(id, fixture) 0,
+#define TEST_VECTORS_DEFINITION(id) 0,
+#include "labrat_data.c"
+#undef TEST_DEFINITION
+#undef TEST_F_DEFINITION
+#undef TEST_VECTORS_DEFINITION
+    };
+    int32_t ix = 1;
+    int32_t number = 0; // of every test, whether it runs or not
+
+    _lr_resolve_source_files();
+    char const *since = __lr_test_options.changed_since;
+    if (since)
+        _lr_find_affected_files(since);
+    if (since && __lr_affected_files)
+        _lr_find_covering_tests();
+    // recording coverage needs every test to run
+    bool record_coverage = __lr_test_options.record_coverage;
+    if (record_coverage)
+        _lr_start_coverage();
+    _lr_load_cache(!__lr_test_options.no_cache && !record_coverage);
+
+#define _LR_RUN_TEST(name, vectors_path, run) \
+    if (_lr_test_affected(++number, name)) { \
+        uint64_t key = _lr_test_key(number, name, vectors_path); \
+        if (_lr_test_cached(key, name)) { \
+            tests[ix++] = true; \
+        } else { \
+            _lr_begin_test_coverage(); \
+            tests[ix] = run; \
+            _lr_end_test_coverage(name); \
+            _lr_remember_result(key, tests[ix++]); \
+        } \
+    } else { \
+        _lr_keep_cached(_lr_test_key(number, name, vectors_path)); \
+    }
+#define TEST_DEFINITION(id) \
+    _LR_RUN_TEST(#id, 0, __lr_test_definition(id, #id))
+#define TEST_F_DEFINITION(id, fixture) \
+    _LR_RUN_TEST(#id, 0, __lr_test_f_definition(id, #id, #fixture))
+#define TEST_VECTORS_DEFINITION(id) \
+    _LR_RUN_TEST(#id, __lr_vectors_path_##id, \
+                 __lr_test_vectors_definition(id, #id, \
+                                              __lr_vectors_path_##id))
+#include "labrat_data.c"
+#undef TEST_DEFINITION
+#undef TEST_F_DEFINITION
+#undef TEST_VECTORS_DEFINITION
+#undef _LR_RUN_TEST
+
+    _lr_destroy_fixtures();
+    _lr_finish_coverage();
+    _lr_save_cache();
+
+    int32_t passed = 0;
+    int32_t total = ix - 1;
+    for (int64_t i = 1; i <= total; i++)
+        if (tests[i])
+            passed++;
+
+    if (number > total)
+        printf("\n%d tests skipped, unaffected by changes since %s\n",
+               number - total, since);
+    if (__lr_cached_count)
+        printf("\n%d tests passed last time and weren't run again, which "
+               "--lr-no-cache would do\n", __lr_cached_count);
+    __lr_cached_count = 0;
+    free(__lr_affected_files);
+    free(__lr_changed_files);
+    free(__lr_mapped_tests);
+    free(__lr_affected_tests);
+    __lr_affected_files = 0;
+    __lr_changed_files = 0;
+    __lr_mapped_tests = 0;
+    __lr_affected_tests = 0;
+
+    bool all_passed = passed == total;
+    puts("\nFinished running tests: ");
+    if (all_passed) {
+        _lr_set_color_grn();
+    } else {
+        _lr_set_color_red();
+    }
+    printf("%d ", passed);
+    _lr_set_color_wht();
+
+    printf("of %d tests passed (", total);
+
+    if (all_passed) {
+        _lr_set_color_grn();
+    } else {
+        _lr_set_color_red();
+    }
+    printf("%d", total - passed);
+    _lr_set_color_wht();
+
+    puts(" failed)\n");
+    _lr_set_color_def();
+#endif // #ifndef LR_OFF
+}
+
+/******************************************************************************/
+////////////////////////////// Sampling profiler ///////////////////////////////
+/******************************************************************************/
+// SIGPROF fires after every millisecond of CPU time the process uses, and the
+// handler walks the frame pointer chain of whichever thread it interrupted.
+// Build with -fno-omit-frame-pointer for whole stacks, and link with -rdynamic
+// so that dladdr can name the functions in the executable.
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define _LR_CAN_PROFILE 1
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#define _LR_PROFILE_MAX_DEPTH 64
+#define _LR_PROFILE_MAX_SAMPLES 16384
+
+uintptr_t *__lr_profile_frames; // _LR_PROFILE_MAX_DEPTH per sample
+int32_t *__lr_profile_depths;
+volatile int32_t __lr_profile_count;
+
+// Frames are only followed inside the stack of a thread which registered it,
+// so that a bogus frame pointer can't send the handler into unmapped memory.
+_LR_THREAD_LOCAL uintptr_t __lr_stack_lo;
+_LR_THREAD_LOCAL uintptr_t __lr_stack_hi;
+
+void _lr_profiler_register_thread()
+{
+    pthread_attr_t attr;
+    void *stack;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return;
+    if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+        __lr_stack_lo = (uintptr_t)stack;
+        __lr_stack_hi = (uintptr_t)stack + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void _lr_profiler_handler(int signal, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = (ucontext_t *)context;
+    (void)signal;
+    (void)info;
+
+#if defined(__x86_64__)
+    uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#else
+    uintptr_t pc = (uintptr_t)uc->uc_mcontext.pc;
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#endif
+
+    int32_t sample = __atomic_fetch_add(&__lr_profile_count, 1,
+                                        __ATOMIC_RELAXED);
+    if (sample >= _LR_PROFILE_MAX_SAMPLES)
+        return;
+
+    uintptr_t *frames = __lr_profile_frames + sample * _LR_PROFILE_MAX_DEPTH;
+    int32_t depth = 0;
+    frames[depth++] = pc;
+
+    // each frame holds the caller's frame pointer, then the return address
+    while (depth < _LR_PROFILE_MAX_DEPTH &&
+           fp % sizeof(uintptr_t) == 0 &&
+           fp >= __lr_stack_lo &&
+           fp + 2 * sizeof(uintptr_t) <= __lr_stack_hi) {
+        uintptr_t *frame = (uintptr_t *)fp;
+        if (!frame[1])
+            break;
+        frames[depth++] = frame[1];
+
+        // the stack grows down, so callers' frames are always higher
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    __lr_profile_depths[sample] = depth;
+}
+
+bool _lr_start_profiler()
+{
+    if (!__lr_profile_frames) {
+        __lr_profile_frames = (uintptr_t *)calloc(
+            _LR_PROFILE_MAX_SAMPLES * _LR_PROFILE_MAX_DEPTH, sizeof(uintptr_t));
+        __lr_profile_depths = (int32_t *)calloc(_LR_PROFILE_MAX_SAMPLES,
+                                                sizeof(int32_t));
+        _lr_profiler_register_thread();
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = _lr_profiler_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, 0) != 0)
+            return false;
+    }
+
+    memset(__lr_profile_depths, 0, _LR_PROFILE_MAX_SAMPLES * sizeof(int32_t));
+    __lr_profile_count = 0;
+
+    struct itimerval timer = { { 0, 1000 }, { 0, 1000 } };
+    return setitimer(ITIMER_PROF, &timer, 0) == 0;
+}
+
+void _lr_stop_profiler()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+}
+
+// Return addresses point after the call, so every frame but the innermost is
+// looked up one byte back to land inside the calling function.
+void _lr_append_frame_name(char *stack, int64_t size, uintptr_t address)
+{
+    int64_t len = strlen(stack);
+    Dl_info info;
+    bool found = dladdr((void *)address, &info) != 0;
+
+    if (found && info.dli_sname)
+        snprintf(stack + len, size - len, "%s", info.dli_sname);
+    else if (found && info.dli_fname)
+        snprintf(stack + len, size - len, "%s+0x%" PRIxPTR,
+                 _LR_DIR(info.dli_fname),
+                 address - (uintptr_t)info.dli_fbase);
+    else
+        snprintf(stack + len, size - len, "0x%" PRIxPTR, address);
+}
+
+int _lr_compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Writes <dir>/<name>.folded with one "root;...;leaf count" line per
+// distinct stack, which is what flamegraph.pl and friends read.
+void _lr_write_profile(char const *dir, char const *name)
+{
+    char message[512];
+    int32_t count = __lr_profile_count;
+    if (count > _LR_PROFILE_MAX_SAMPLES) {
+        snprintf(message, _LR_ARRAY_COUNT(message),
+                 "the profile of %s dropped %d samples", name,
+                 count - _LR_PROFILE_MAX_SAMPLES);
+        _lr_print_warning(message);
+        count = _LR_PROFILE_MAX_SAMPLES;
+    }
+
+    char path[512];
+    int32_t len = snprintf(path, _LR_ARRAY_COUNT(path), "%s/", dir);
+    for (char const *c = name; *c && len < 500; c++)
+        path[len++] = (*c == '/' || *c == ':') ? '_' : *c;
+    snprintf(path + len, _LR_ARRAY_COUNT(path) - len, ".folded");
+
+    mkdir(dir, 0777);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        snprintf(message, _LR_ARRAY_COUNT(message),
+                 "could not write the profile of %s to %s", name, dir);
+        _lr_print_warning(message);
+        return;
+    }
+
+    const int64_t stack_size = _LR_PROFILE_MAX_DEPTH * 128;
+    char **stacks = (char **)calloc(count + 1, sizeof(char *));
+    int32_t stack_count = 0;
+    for (int32_t i = 0; i < count; i++) {
+        int32_t depth = __lr_profile_depths[i];
+        if (!depth)
+            continue;
+
+        uintptr_t *frames = __lr_profile_frames + i * _LR_PROFILE_MAX_DEPTH;
+        char *stack = (char *)calloc(stack_size, 1);
+        for (int32_t j = depth - 1; j >= 0; j--) {
+            _lr_append_frame_name(stack, stack_size,
+                                  j > 0 ? frames[j] - 1 : frames[j]);
+            if (j > 0)
+                strncat(stack, ";", stack_size - strlen(stack) - 1);
+        }
+        stacks[stack_count++] = stack;
+    }
+
+    qsort(stacks, stack_count, sizeof(char *), _lr_compare_strings);
+    for (int32_t i = 0; i < stack_count;) {
+        int32_t j = i + 1;
+        while (j < stack_count && strcmp(stacks[i], stacks[j]) == 0)
+            j++;
+        fprintf(fp, "%s %d\n", stacks[i], j - i);
+        i = j;
+    }
+
+    for (int32_t i = 0; i < stack_count; i++)
+        free(stacks[i]);
+    free(stacks);
+    fclose(fp);
+}
+
+#else
+#define _LR_CAN_PROFILE 0
+
+void _lr_profiler_register_thread()
+{
+}
+
+bool _lr_start_profiler()
+{
+    return false;
+}
+
+void _lr_stop_profiler()
+{
+}
+
+void _lr_write_profile(char const *dir, char const *name)
+{
+    (void)dir;
+    (void)name;
+}
+#endif
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+typedef struct {
+    char const *name;
+    void (*func)(int64_t iterations);
+    void (*range_func)(int64_t iterations, int64_t n);
+    int64_t *range; // lo, hi, mult
+    void (*threaded_func)(int64_t iterations, int32_t thread_index,
+                          int32_t thread_count);
+    void (*latency_func)(int64_t iteration);
+    void (*fixture_func)(void *fixture, int64_t iterations);
+    char const *fixture;
+} lr_bench_t;
+
+typedef struct {
+    char name[128];
+    int64_t n; // -1 unless this is one size of a BENCHMARK_RANGE
+    int32_t threads; // 0 unless this is a BENCHMARK_THREADED
+    double *samples; // cycles / iteration, one per repetition
+    double *cold_samples; // the same, with --lr-bench-cache=cold
+
+    // summed across every repetition
+    double cycles;
+    int64_t iterations;
+    double bytes;
+    double items;
+    lr_counter_t counters[_LR_MAX_COUNTERS];
+    int32_t counter_count;
+    int64_t allocations;
+    int64_t allocated_bytes;
+    int64_t peak_live_bytes; // the largest of any one repetition
+    bool expect_no_allocations;
+    uint64_t *histogram; // per-iteration cycles, for BENCHMARK_LATENCY
+} lr_bench_result_t;
+
+#define _LR_MAX_BENCH_FILTERS 32
+
+typedef struct {
+    int32_t repetitions;
+    char const *save_path;
+    char const *compare_path;
+    double threshold; // percent slowdown which counts as a regression
+    int32_t cpu; // -1 to leave the runner unpinned
+    bool fail_on_alloc;
+    bool cold_cache; // also time every repetition with the caches evicted
+    char const *profile_dir; // where to write folded stacks, if anywhere
+    char const *json_path; // Google Benchmark's JSON and CSV formats
+    char const *csv_path;
+    bool isolate; // run every benchmark in a child process
+    char const *filters[_LR_MAX_BENCH_FILTERS]; // each is comma separated
+    int32_t filter_count;
+} lr_bench_options_t;
+
+lr_bench_options_t __lr_bench_options = {
+    0, 0, 0, 5.0, -1, false, false, 0, 0, 0, false, { 0 }, 0
+};
+
+typedef struct {
+    char const *corpus_dir; // <name>_corpus unless given
+    double seconds; // how long to fuzz for, or 0 for until it fails
+    int64_t runs; // the same for the number of inputs tried
+    int64_t max_len;
+} lr_fuzz_options_t;
+
+lr_fuzz_options_t __lr_fuzz_options = { 0, 0, 0, 4096 };
+
+char const *__lr_executable = "";
+
+// Matches both "--name value" and "--name=value".
+bool _lr_option_value(int32_t argc, char const **argv, int32_t *i,
+                      char const *name, char const **value)
+{
+    int64_t name_len = strlen(name);
+    char const *arg = argv[*i];
+
+    if (strncmp(arg, name, name_len) != 0)
+        return false;
+
+    if (arg[name_len] == '=') {
+        *value = arg + name_len + 1;
+        return true;
+    } else if (arg[name_len] == 0 && *i + 1 < argc) {
+        *value = argv[++*i];
+        return true;
+    }
+    return false;
+}
+
+bool _lr_parse_bench_options(int32_t argc, char const **argv)
+{
+    lr_bench_options_t *options = &__lr_bench_options;
+
+    for (int32_t i = 0; i < argc; i++) {
+        char const *value;
+        if (_lr_option_value(argc, argv, &i, "--lr-bench-save", &value)) {
+            options->save_path = value;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-compare",
+                                    &value)) {
+            options->compare_path = value;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-threshold",
+                                    &value)) {
+            options->threshold = atof(value);
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-repetitions",
+                                    &value)) {
+            options->repetitions = atoi(value);
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-cpu",
+                                    &value)) {
+            options->cpu = atoi(value);
+        } else if (strcmp(argv[i], "--lr-bench-fail-on-alloc") == 0) {
+            options->fail_on_alloc = true;
+        } else if (strcmp(argv[i], "--lr-bench-isolate") == 0) {
+            options->isolate = true;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-filter",
+                                    &value) &&
+                   options->filter_count < _LR_MAX_BENCH_FILTERS) {
+            options->filters[options->filter_count++] = value;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-cache",
+                                    &value) &&
+                   (strcmp(value, "cold") == 0 ||
+                    strcmp(value, "warm") == 0)) {
+            options->cold_cache = strcmp(value, "cold") == 0;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-profile",
+                                    &value)) {
+            options->profile_dir = value;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-bench-out",
+                                    &value) &&
+                   (strncmp(value, "json:", 5) == 0 ||
+                    strncmp(value, "csv:", 4) == 0)) {
+            if (value[0] == 'j')
+                options->json_path = value + 5;
+            else
+                options->csv_path = value + 4;
+        } else {
+            printf("LABRAT: Unrecognized benchmark option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool _lr_parse_test_options(int32_t argc, char const **argv)
+{
+    lr_test_options_t *options = &__lr_test_options;
+
+    for (int32_t i = 0; i < argc; i++) {
+        char const *value;
+        if (_lr_option_value(argc, argv, &i, "--lr-changed-since", &value)) {
+            options->changed_since = value;
+        } else if (strcmp(argv[i], "--lr-record-coverage") == 0) {
+            options->record_coverage = true;
+        } else if (strcmp(argv[i], "--lr-no-cache") == 0) {
+            options->no_cache = true;
+        } else {
+            printf("LABRAT: Unrecognized test option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool _lr_parse_fuzz_options(int32_t argc, char const **argv)
+{
+    lr_fuzz_options_t *options = &__lr_fuzz_options;
+
+    for (int32_t i = 0; i < argc; i++) {
+        char const *value;
+        if (_lr_option_value(argc, argv, &i, "--lr-fuzz-corpus", &value)) {
+            options->corpus_dir = value;
+        } else if (_lr_option_value(argc, argv, &i, "--lr-fuzz-time",
+                                    &value)) {
+            options->seconds = atof(value);
+        } else if (_lr_option_value(argc, argv, &i, "--lr-fuzz-runs",
+                                    &value)) {
+            options->runs = strtoll(value, 0, 10);
+        } else if (_lr_option_value(argc, argv, &i, "--lr-fuzz-max-len",
+                                    &value) && atoi(value) > 0) {
+            options->max_len = atoi(value);
+        } else {
+            printf("LABRAT: Unrecognized fuzzing option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rob Pike's matcher from The Practice of Programming, which understands
+// c, ., ^, $ and * and searches for a match anywhere in the text.
+bool _lr_regex_match_here(char const *regex, char const *text);
+
+bool _lr_regex_match_star(char c, char const *regex, char const *text)
+{
+    do {
+        if (_lr_regex_match_here(regex, text))
+            return true;
+    } while (*text != 0 && (*text++ == c || c == '.'));
+    return false;
+}
+
+bool _lr_regex_match_here(char const *regex, char const *text)
+{
+    if (regex[0] == 0)
+        return true;
+    if (regex[1] == '*')
+        return _lr_regex_match_star(regex[0], regex + 2, text);
+    if (regex[0] == '$' && regex[1] == 0)
+        return *text == 0;
+    if (*text != 0 && (regex[0] == '.' || regex[0] == *text))
+        return _lr_regex_match_here(regex + 1, text + 1);
+    return false;
+}
+
+bool _lr_regex_match(char const *regex, char const *text)
+{
+    if (regex[0] == '^')
+        return _lr_regex_match_here(regex + 1, text);
+    do {
+        if (_lr_regex_match_here(regex, text))
+            return true;
+    } while (*text++ != 0);
+    return false;
+}
+
+// Matches the whole text, with * and ? as wildcards.
+bool _lr_glob_match(char const *glob, char const *text)
+{
+    if (*glob == 0)
+        return *text == 0;
+    if (*glob == '*')
+        return _lr_glob_match(glob + 1, text) ||
+               (*text != 0 && _lr_glob_match(glob, text + 1));
+    if (*text != 0 && (*glob == '?' || *glob == *text))
+        return _lr_glob_match(glob + 1, text + 1);
+    return false;
+}
+
+// Benchmark names can't contain ^, $ or ., so a pattern with any of them is
+// taken to be a regex and anything else a glob.
+bool _lr_pattern_match(char const *pattern, char const *name)
+{
+    if (strpbrk(pattern, "^$."))
+        return _lr_regex_match(pattern, name);
+    return _lr_glob_match(pattern, name);
+}
+
+// Runs the benchmark if it matches any filter (or there are none which
+// include anything) and matches no filter starting with '-'.
+bool _lr_bench_selected(char const *name)
+{
+    lr_bench_options_t *options = &__lr_bench_options;
+    bool has_includes = false;
+    bool included = false;
+
+    for (int32_t i = 0; i < options->filter_count; i++) {
+        char const *filter = options->filters[i];
+        while (*filter) {
+            char pattern[128];
+            int32_t len = (int32_t)strcspn(filter, ",");
+            snprintf(pattern, _LR_ARRAY_COUNT(pattern), "%.*s", len, filter);
+            filter += filter[len] ? len + 1 : len;
+
+            if (pattern[0] == '-') {
+                if (_lr_pattern_match(pattern + 1, name))
+                    return false;
+            } else if (pattern[0]) {
+                has_includes = true;
+                included |= _lr_pattern_match(pattern, name);
+            }
+        }
+    }
+    return included || !has_includes;
+}
+
+int32_t _lr_prelude(int32_t argc, char const **argv)
+{
+    if (argc < 2)
+        return -1;
+
+#ifdef _WIN32
+    _lr_console_h = GetStdHandle(STD_OUTPUT_HANDLE);
+#endif
+    __lr_executable = argv[0];
+
+    if (strcmp("--lr-run-tests", argv[1]) == 0) {
+        if (!_lr_parse_test_options(argc - 2, argv + 2))
+            return 1;
+        lr_run_tests();
+        return 0;
+    } else if (strcmp("--lr-run-benchmarks", argv[1]) == 0) {
+        // without an iteration count, each benchmark is calibrated
+        int32_t first_option = 2;
+        uint64_t iterations = 0;
+        if (argc >= 3 && argv[2][0] >= '0' && argv[2][0] <= '9') {
+            iterations = strtoull(argv[2], 0, 10);
+            first_option = 3;
+        }
+        if (!_lr_parse_bench_options(argc - first_option,
+                                     argv + first_option))
+            return 1;
+        return lr_run_benchmarks(iterations);
+    } else if (strcmp("--lr-fuzz", argv[1]) == 0) {
+        if (argc < 3) {
+            printf("LABRAT: --lr-fuzz needs the name of a FUZZ_TEST\n");
+            return 1;
+        }
+        if (!_lr_parse_fuzz_options(argc - 3, argv + 3))
+            return 1;
+        return lr_fuzz(argv[2]);
+    }
+
+    return -1;
+}
+
+/******************************************************************************/
+///////////////////////////// Latency histograms ///////////////////////////////
+/******************************************************************************/
+// Log-linear buckets in the style of HdrHistogram: values below 64 get a
+// bucket each, and above that every power of two is split into 32 buckets,
+// so any recorded value is within about 3% of its bucket.
+#define _LR_HISTOGRAM_SUB_BITS 5
+#define _LR_HISTOGRAM_SUB (1 << _LR_HISTOGRAM_SUB_BITS)
+// 64 values of their own, then 32 for each power of two from 2^6 to 2^63
+#define _LR_HISTOGRAM_BUCKETS \
+    ((64 - _LR_HISTOGRAM_SUB_BITS + 1) * _LR_HISTOGRAM_SUB)
+
+// Index 0 holds the total count and index 1 the largest value seen.
+#define _LR_HISTOGRAM_SIZE (_LR_HISTOGRAM_BUCKETS + 2)
+
+int32_t _lr_histogram_bucket(uint64_t value)
+{
+    int32_t shift = value ? _lr_msb64(value) - _LR_HISTOGRAM_SUB_BITS : 0;
+    if (shift < 0)
+        shift = 0;
+    return shift * _LR_HISTOGRAM_SUB + (int32_t)(value >> shift);
+}
+
+uint64_t _lr_histogram_bucket_value(int32_t bucket)
+{
+    int32_t shift = bucket < 2 * _LR_HISTOGRAM_SUB ?
+                    0 : bucket / _LR_HISTOGRAM_SUB - 1;
+    uint64_t sub = bucket - shift * _LR_HISTOGRAM_SUB;
+
+    // the middle of the range of values which land in this bucket
+    return (sub << shift) + ((1ull << shift) >> 1);
+}
+
+void _lr_histogram_record(uint64_t *histogram, uint64_t value)
+{
+    histogram[2 + _lr_histogram_bucket(value)]++;
+    histogram[0]++;
+    if (value > histogram[1])
+        histogram[1] = value;
+}
+
+uint64_t _lr_histogram_percentile(uint64_t *histogram, double percentile)
+{
+    uint64_t target = (uint64_t)(histogram[0] * percentile / 100.0 + 0.5);
+    if (target < 1)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (int32_t i = 0; i < _LR_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram[2 + i];
+        if (seen >= target) {
+            uint64_t value = _lr_histogram_bucket_value(i);
+            return value < histogram[1] ? value : histogram[1];
+        }
+    }
+    return histogram[1];
+}
+
+// lfence keeps the reads from being reordered around the operation itself
+uint64_t _lr_fenced_start()
+{
+    _mm_lfence();
+    uint64_t result = __rdtsc();
+    _mm_lfence();
+    return result;
+}
+
+uint64_t _lr_fenced_end()
+{
+    uint32_t aux;
+    uint64_t result = __rdtscp(&aux);
+    _mm_lfence();
+    return result;
+}
+
+void _lr_empty_latency_func(int64_t iteration)
+{
+    (void)iteration;
+}
+
+// The cost of timing an empty call, which is taken off of every sample.
+uint64_t _lr_latency_overhead()
+{
+    static int64_t result = -1;
+
+    if (result < 0) {
+        void (*volatile func)(int64_t) = _lr_empty_latency_func;
+        for (int32_t i = 0; i < 1000; i++) {
+            uint64_t start = _lr_fenced_start();
+            func(i);
+            int64_t cycles = (int64_t)(_lr_fenced_end() - start);
+            if (result < 0 || cycles < result)
+                result = cycles;
+        }
+    }
+    return (uint64_t)result;
+}
+
+uint64_t _lr_time_latency_benchmark(lr_bench_t *bench, int64_t iterations,
+                                    uint64_t *histogram)
+{
+    uint64_t overhead = _lr_latency_overhead();
+    uint64_t total = 0;
+
+    for (int64_t i = 0; i < iterations; i++) {
+        uint64_t start = _lr_fenced_start();
+        bench->latency_func(i);
+        uint64_t cycles = _lr_fenced_end() - start;
+
+        cycles = cycles > overhead ? cycles - overhead : 0;
+        if (histogram)
+            _lr_histogram_record(histogram, cycles);
+        total += cycles;
+    }
+    return total;
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+typedef struct {
+    lr_bench_t *bench;
+    int64_t iterations;
+    int32_t thread_index;
+    int32_t thread_count;
+    volatile int32_t *ready;
+    volatile int32_t *go;
+
+    uint64_t cycles;
+    double bytes;
+    double items;
+    lr_counter_t counters[_LR_MAX_COUNTERS];
+    int32_t counter_count;
+    lr_alloc_stats_t alloc_stats;
+    bool expect_no_allocations;
+} lr_bench_thread_t;
+
+void *_lr_bench_thread(void *arg)
+{
+    lr_bench_thread_t *thread = (lr_bench_thread_t *)arg;
+
+    _lr_reset_benchmark_window();
+    __lr_bytes_processed = 0;
+    __lr_items_processed = 0;
+    __lr_counter_count = 0;
+    memset(&__lr_alloc_stats, 0, sizeof(__lr_alloc_stats));
+    __lr_expect_no_allocations = false;
+
+    // spread pinned threads over consecutive cpus
+    if (__lr_bench_options.cpu >= 0)
+        _lr_pin_thread((__lr_bench_options.cpu + thread->thread_index) %
+                       _lr_cpu_count());
+
+    if (__lr_bench_options.profile_dir)
+        _lr_profiler_register_thread();
+
+    // don't start until every thread is ready to go
+    _lr_atomic_increment(thread->ready);
+    while (!_lr_atomic_load(thread->go)) {
+    }
+
+    __lr_tracking_allocations = true;
+    uint64_t start_time = _LR_GETCYCLES();
+    thread->bench->threaded_func(thread->iterations, thread->thread_index,
+                                 thread->thread_count);
+    uint64_t end_time = _LR_GETCYCLES();
+    __lr_tracking_allocations = false;
+
+    thread->cycles = _lr_benchmark_window_cycles(start_time, end_time);
+    thread->bytes = __lr_bytes_processed;
+    thread->items = __lr_items_processed;
+    thread->counter_count = __lr_counter_count;
+    memcpy(thread->counters, __lr_counters, sizeof(__lr_counters));
+    thread->alloc_stats = __lr_alloc_stats;
+    thread->expect_no_allocations = __lr_expect_no_allocations;
+    return 0;
+}
+
+// Set when a benchmark couldn't run at all, which fails the run.
+bool __lr_bench_failed;
+
+// Returns the cycles taken by the slowest thread. Byte, item, counter and
+// allocation totals from every thread are added to the calling thread's. If
+// not every thread can be started, the benchmark runs on the ones which were,
+// which only learn how many there are once they're let go.
+uint64_t _lr_time_threaded_benchmark(lr_bench_t *bench, int64_t iterations,
+                                     int32_t thread_count)
+{
+    volatile int32_t ready = 0;
+    volatile int32_t go = 0;
+
+    lr_bench_thread_t *threads = (lr_bench_thread_t *)calloc(
+        thread_count, sizeof(lr_bench_thread_t));
+    lr_thread_t *handles = (lr_thread_t *)calloc(thread_count,
+                                                 sizeof(lr_thread_t));
+
+    for (int32_t i = 0; i < thread_count; i++) {
+        threads[i].bench = bench;
+        threads[i].iterations = iterations;
+        threads[i].thread_index = i;
+        threads[i].thread_count = thread_count;
+        threads[i].ready = &ready;
+        threads[i].go = &go;
+        if (!_lr_start_thread(&handles[i], _lr_bench_thread, &threads[i])) {
+            char message[256];
+            snprintf(message, _LR_ARRAY_COUNT(message),
+                     "%s could only start %d of %d threads", bench->name, i,
+                     thread_count);
+            _lr_print_warning(message);
+            thread_count = i;
+            for (int32_t j = 0; j < thread_count; j++)
+                threads[j].thread_count = thread_count;
+            __lr_bench_failed |= !thread_count;
+            break;
+        }
+    }
+
+    while (_lr_atomic_load(&ready) != thread_count) {
+    }
+    _lr_atomic_store(&go, 1);
+
+    uint64_t slowest = 0;
+    for (int32_t i = 0; i < thread_count; i++) {
+        _lr_join_thread(handles[i]);
+
+        lr_bench_thread_t *thread = &threads[i];
+        if (thread->cycles > slowest)
+            slowest = thread->cycles;
+
+        __lr_bytes_processed += thread->bytes;
+        __lr_items_processed += thread->items;
+        for (int32_t j = 0; j < thread->counter_count; j++)
+            _lr_add_counter(__lr_counters, &__lr_counter_count,
+                            thread->counters[j].name,
+                            thread->counters[j].value,
+                            thread->counters[j].per_second);
+
+        // per-thread peaks may not coincide, so this is an upper bound
+        __lr_alloc_stats.allocations += thread->alloc_stats.allocations;
+        __lr_alloc_stats.bytes += thread->alloc_stats.bytes;
+        __lr_alloc_stats.peak += thread->alloc_stats.peak;
+        __lr_expect_no_allocations |= thread->expect_no_allocations;
+    }
+
+    free(threads);
+    free(handles);
+    return slowest;
+}
+
+uint64_t _lr_time_benchmark(lr_bench_t *bench, int64_t iterations,
+                            int64_t n, int32_t threads, uint64_t *histogram)
+{
+    if (bench->threaded_func) {
+        _lr_evict_caches();
+        return _lr_time_threaded_benchmark(bench, iterations, threads);
+    }
+
+    if (bench->latency_func) {
+        _lr_evict_caches();
+        __lr_tracking_allocations = true;
+        uint64_t result = _lr_time_latency_benchmark(bench, iterations,
+                                                     histogram);
+        __lr_tracking_allocations = false;
+        return result;
+    }
+
+    // built before the clock starts, and only once per run
+    void *fixture = bench->fixture ? _lr_get_fixture(bench->fixture) : 0;
+
+    _lr_evict_caches();
+    _lr_reset_benchmark_window();
+
+    __lr_tracking_allocations = true;
+    uint64_t start_time = _LR_GETCYCLES();
+    if (bench->range_func)
+        bench->range_func(iterations, n);
+    else if (bench->fixture_func)
+        bench->fixture_func(fixture, iterations);
+    else
+        bench->func(iterations);
+    uint64_t end_time = _LR_GETCYCLES();
+    __lr_tracking_allocations = false;
+
+    return _lr_benchmark_window_cycles(start_time, end_time);
+}
+
+void _lr_save_bench_results(char const *path, lr_bench_result_t *results)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("LABRAT: Failed to write benchmark baseline: %s\n", path);
+        return;
+    }
+
+    fprintf(fp, "labrat-bench-v1\n");
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        fprintf(fp, "%s %d", results[i].name,
+                (int32_t)lr_sb_count(results[i].samples));
+        for (int64_t j = 0; j < lr_sb_count(results[i].samples); j++)
+            fprintf(fp, " %.3f", results[i].samples[j]);
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+}
+
+lr_bench_result_t *_lr_load_bench_results(char const *path)
+{
+    lr_bench_result_t *results = 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+
+    char magic[32];
+    if (fscanf(fp, "%31s", magic) != 1 ||
+        strcmp(magic, "labrat-bench-v1") != 0) {
+        fclose(fp);
+        return 0;
+    }
+
+    lr_bench_result_t result;
+    int32_t count;
+    memset(&result, 0, sizeof(result));
+    while (fscanf(fp, "%127s %d", result.name, &count) == 2) {
+        char *size = strrchr(result.name, '/');
+        result.n = size && size[1] >= '0' && size[1] <= '9' ?
+                   atoi(size + 1) : -1;
+        result.samples = 0;
+        for (int32_t i = 0; i < count; i++) {
+            double sample;
+            if (fscanf(fp, "%lf", &sample) != 1)
+                break;
+            lr_sb_push(result.samples, sample);
+        }
+        lr_sb_push(results, result);
+    }
+
+    fclose(fp);
+    return results;
+}
+
+void _lr_free_bench_results(lr_bench_result_t *results)
+{
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        lr_sb_free(results[i].samples);
+        lr_sb_free(results[i].cold_samples);
+        free(results[i].histogram);
+    }
+    lr_sb_free(results);
+}
+
+/******************************************************************************/
+/////////////////////////////// Result formats /////////////////////////////////
+/******************************************************************************/
+// Both follow Google Benchmark's reporters so that existing tooling, like
+// its compare.py, can read them. Times are nanoseconds per iteration from the
+// measured cycle rate, and labrat doesn't time the CPU separately, so
+// cpu_time is always real_time. Every repetition is reported, followed by
+// the median when there was more than one.
+
+double _lr_cycles_to_ns(double cycles)
+{
+    return cycles * 1e9 / _lr_cycles_per_second();
+}
+
+// Rates and counters come from the totals of every repetition.
+double _lr_bench_rate(lr_bench_result_t *result, double total)
+{
+    double seconds = result->cycles / _lr_cycles_per_second();
+    return seconds > 0 ? total / seconds : 0;
+}
+
+double _lr_bench_counter_value(lr_bench_result_t *result,
+                               lr_counter_t *counter)
+{
+    if (counter->per_second)
+        return _lr_bench_rate(result, counter->value);
+    return result->iterations ? counter->value / result->iterations : 0;
+}
+
+void _lr_write_json_string(FILE *fp, char const *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+void _lr_write_json_context(FILE *fp)
+{
+    char date[64];
+    time_t now = time(0);
+    strftime(date, _LR_ARRAY_COUNT(date), "%Y-%m-%dT%H:%M:%S%z",
+             localtime(&now));
+
+    char host[256];
+    _lr_host_name(host, _LR_ARRAY_COUNT(host));
+
+    char line[128];
+    bool scaling = _lr_read_first_line(
+        "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", line,
+        _LR_ARRAY_COUNT(line)) && strcmp(line, "performance") != 0;
+
+    fprintf(fp, "  \"context\": {\n");
+    fprintf(fp, "    \"date\": \"%s\",\n", date);
+    fprintf(fp, "    \"host_name\": ");
+    _lr_write_json_string(fp, host);
+    fprintf(fp, ",\n    \"executable\": ");
+    _lr_write_json_string(fp, __lr_executable);
+    fprintf(fp, ",\n    \"num_cpus\": %d,\n", _lr_cpu_count());
+    fprintf(fp, "    \"mhz_per_cpu\": %.0f,\n",
+            _lr_cycles_per_second() / 1e6);
+    fprintf(fp, "    \"cpu_scaling_enabled\": %s,\n",
+            scaling ? "true" : "false");
+
+    lr_cache_info_t caches[16];
+    int32_t cache_count = _lr_cache_info(caches, _LR_ARRAY_COUNT(caches));
+    fprintf(fp, "    \"caches\": [");
+    for (int32_t i = 0; i < cache_count; i++) {
+        fprintf(fp, "%s\n      {\n", i ? "," : "");
+        fprintf(fp, "        \"type\": \"%s\",\n", caches[i].type);
+        fprintf(fp, "        \"level\": %d,\n", caches[i].level);
+        fprintf(fp, "        \"size\": %" PRId64 ",\n", caches[i].size);
+        fprintf(fp, "        \"num_sharing\": %d\n", caches[i].num_sharing);
+        fprintf(fp, "      }");
+    }
+    fprintf(fp, "%s],\n", cache_count ? "\n    " : "");
+
+    double load[3];
+    fprintf(fp, "    \"load_avg\": [");
+    if (_lr_read_first_line("/proc/loadavg", line, _LR_ARRAY_COUNT(line)) &&
+        sscanf(line, "%lf %lf %lf", &load[0], &load[1], &load[2]) == 3)
+        fprintf(fp, "%g, %g, %g", load[0], load[1], load[2]);
+    fprintf(fp, "]\n");
+    fprintf(fp, "  },\n");
+}
+
+// index is the repetition, or -1 for the median of all of them.
+void _lr_write_json_run(FILE *fp, lr_bench_result_t *result, int64_t index)
+{
+    int64_t repetitions = lr_sb_count(result->samples);
+    double cycles = index >= 0 ? result->samples[index] :
+                    _lr_median(result->samples, repetitions);
+    double ns = _lr_cycles_to_ns(cycles);
+
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"name\": \"%s%s\",\n", result->name,
+            index >= 0 ? "" : "_median");
+    fprintf(fp, "      \"run_name\": \"%s\",\n", result->name);
+    if (index >= 0) {
+        fprintf(fp, "      \"run_type\": \"iteration\",\n");
+        fprintf(fp, "      \"repetitions\": %" PRId64 ",\n", repetitions);
+        fprintf(fp, "      \"repetition_index\": %" PRId64 ",\n", index);
+    } else {
+        fprintf(fp, "      \"run_type\": \"aggregate\",\n");
+        fprintf(fp, "      \"repetitions\": %" PRId64 ",\n", repetitions);
+        fprintf(fp, "      \"aggregate_name\": \"median\",\n");
+    }
+    fprintf(fp, "      \"threads\": %d,\n",
+            result->threads > 0 ? result->threads : 1);
+    fprintf(fp, "      \"iterations\": %" PRId64 ",\n",
+            index >= 0 ? result->iterations / repetitions : repetitions);
+    fprintf(fp, "      \"real_time\": %.6g,\n", ns);
+    fprintf(fp, "      \"cpu_time\": %.6g,\n", ns);
+    fprintf(fp, "      \"time_unit\": \"ns\"");
+
+    if (result->bytes)
+        fprintf(fp, ",\n      \"bytes_per_second\": %.6g",
+                _lr_bench_rate(result, result->bytes));
+    if (result->items)
+        fprintf(fp, ",\n      \"items_per_second\": %.6g",
+                _lr_bench_rate(result, result->items));
+    for (int32_t i = 0; i < result->counter_count; i++) {
+        fprintf(fp, ",\n      ");
+        _lr_write_json_string(fp, result->counters[i].name);
+        fprintf(fp, ": %.6g",
+                _lr_bench_counter_value(result, &result->counters[i]));
+    }
+    fprintf(fp, "\n    }");
+}
+
+void _lr_write_json_results(char const *path, lr_bench_result_t *results)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("LABRAT: Failed to write benchmark results: %s\n", path);
+        return;
+    }
+
+    fprintf(fp, "{\n");
+    _lr_write_json_context(fp);
+    fprintf(fp, "  \"benchmarks\": [");
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        int64_t repetitions = lr_sb_count(results[i].samples);
+        for (int64_t j = 0; j < repetitions; j++) {
+            fprintf(fp, "%s\n", i || j ? "," : "");
+            _lr_write_json_run(fp, &results[i], j);
+        }
+        if (repetitions > 1) {
+            fprintf(fp, ",\n");
+            _lr_write_json_run(fp, &results[i], -1);
+        }
+    }
+    fprintf(fp, "\n  ]\n}\n");
+
+    fclose(fp);
+}
+
+void _lr_write_csv_run(FILE *fp, lr_bench_result_t *result, int64_t index,
+                       char const **counters, int32_t counter_count)
+{
+    int64_t repetitions = lr_sb_count(result->samples);
+    double cycles = index >= 0 ? result->samples[index] :
+                    _lr_median(result->samples, repetitions);
+    double ns = _lr_cycles_to_ns(cycles);
+
+    fprintf(fp, "\"%s%s\",%" PRId64 ",%.6g,%.6g,ns,", result->name,
+            index >= 0 ? "" : "_median",
+            index >= 0 ? result->iterations / repetitions : repetitions,
+            ns, ns);
+    if (result->bytes)
+        fprintf(fp, "%.6g", _lr_bench_rate(result, result->bytes));
+    fprintf(fp, ",");
+    if (result->items)
+        fprintf(fp, "%.6g", _lr_bench_rate(result, result->items));
+    fprintf(fp, ",,,");
+
+    for (int32_t i = 0; i < counter_count; i++) {
+        fprintf(fp, ",");
+        for (int32_t j = 0; j < result->counter_count; j++)
+            if (strcmp(result->counters[j].name, counters[i]) == 0)
+                fprintf(fp, "%.6g", _lr_bench_counter_value(
+                            result, &result->counters[j]));
+    }
+    fprintf(fp, "\n");
+}
+
+void _lr_write_csv_results(char const *path, lr_bench_result_t *results)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("LABRAT: Failed to write benchmark results: %s\n", path);
+        return;
+    }
+
+    // every counter gets a column, left empty by benchmarks without it
+    char const *counters[64];
+    int32_t counter_count = 0;
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        for (int32_t j = 0; j < results[i].counter_count; j++) {
+            char const *name = results[i].counters[j].name;
+            int32_t k = 0;
+            while (k < counter_count && strcmp(counters[k], name) != 0)
+                k++;
+            if (k == counter_count && counter_count < 64)
+                counters[counter_count++] = name;
+        }
+    }
+
+    fprintf(fp, "name,iterations,real_time,cpu_time,time_unit,"
+                "bytes_per_second,items_per_second,label,error_occurred,"
+                "error_message");
+    for (int32_t i = 0; i < counter_count; i++)
+        fprintf(fp, ",\"%s\"", counters[i]);
+    fprintf(fp, "\n");
+
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        int64_t repetitions = lr_sb_count(results[i].samples);
+        for (int64_t j = 0; j < repetitions; j++)
+            _lr_write_csv_run(fp, &results[i], j, counters, counter_count);
+        if (repetitions > 1)
+            _lr_write_csv_run(fp, &results[i], -1, counters, counter_count);
+    }
+
+    fclose(fp);
+}
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+enum {
+    LR_COMPLEXITY_1,
+    LR_COMPLEXITY_N,
+    LR_COMPLEXITY_N_LOG_N,
+    LR_COMPLEXITY_N_SQUARED,
+    LR_COMPLEXITY_COUNT,
+};
+
+char const *_lr_complexity_names[] = {
+    "O(1)", "O(n)", "O(n log n)", "O(n^2)",
+};
+
+double _lr_complexity_curve(int32_t complexity, double n)
+{
+    switch (complexity) {
+    case LR_COMPLEXITY_N: { return n; }
+    case LR_COMPLEXITY_N_LOG_N: { return n * _lr_log(n > 1 ? n : 1); }
+    case LR_COMPLEXITY_N_SQUARED: { return n * n; }
+    default: { return 1; }
+    }
+}
+
+int32_t _lr_bench_group_len(char const *name)
+{
+    char const *size = strrchr(name, '/');
+    return size ? (int32_t)(size - name) : (int32_t)strlen(name);
+}
+
+// Fills ns and times with the sizes of one BENCHMARK_RANGE and their median
+// times, and returns how many there are.
+int32_t _lr_range_times(lr_bench_result_t *results, char const *group,
+                        double *ns, double *times, int32_t max_count)
+{
+    int32_t group_len = _lr_bench_group_len(group);
+    int32_t count = 0;
+
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        lr_bench_result_t *result = &results[i];
+        if (result->n < 0 ||
+            _lr_bench_group_len(result->name) != group_len ||
+            strncmp(result->name, group, group_len) != 0 ||
+            count == max_count)
+            continue;
+
+        ns[count] = (double)result->n;
+        times[count] = _lr_median(result->samples,
+                                  lr_sb_count(result->samples));
+        count++;
+    }
+    return count;
+}
+
+// The RMS error of the least-squares fit of time = c * f(n), relative to the
+// mean time.
+double _lr_complexity_rms(double *ns, double *times, int32_t count,
+                          int32_t complexity)
+{
+    double mean = 0;
+    double ft = 0;
+    double ff = 0;
+    for (int32_t i = 0; i < count; i++) {
+        double f = _lr_complexity_curve(complexity, ns[i]);
+        mean += times[i] / count;
+        ft += f * times[i];
+        ff += f * f;
+    }
+
+    double coefficient = ff > 0 ? ft / ff : 0;
+    double error = 0;
+    for (int32_t i = 0; i < count; i++) {
+        double d = times[i] -
+                   coefficient * _lr_complexity_curve(complexity, ns[i]);
+        error += d * d;
+    }
+    return _lr_sqrt(error / count) / (mean > 0 ? mean : 1);
+}
+
+// Picks the curve with the lowest normalized RMS over every size of one
+// BENCHMARK_RANGE. Returns -1 when there are too few sizes to tell the curves
+// apart.
+int32_t _lr_fit_complexity(lr_bench_result_t *results, char const *group,
+                           double *rms_out)
+{
+    double ns[64];
+    double times[64];
+    int32_t count = _lr_range_times(results, group, ns, times,
+                                    _LR_ARRAY_COUNT(ns));
+    if (count < 3)
+        return -1;
+
+    int32_t best = -1;
+    double best_rms = 0;
+    for (int32_t c = 0; c < LR_COMPLEXITY_COUNT; c++) {
+        double rms = _lr_complexity_rms(ns, times, count, c);
+        if (best == -1 || rms < best_rms) {
+            best = c;
+            best_rms = rms;
+        }
+    }
+
+    if (rms_out)
+        *rms_out = best_rms;
+    return best;
+}
+
+// Neighbouring curves like O(n) and O(n log n) fit a short range about as
+// well as each other, so noise can flip which one fits best. A worse curve
+// only counts when the old one no longer fits the data: its error has to be
+// large, and well above the error of the curve which fits now.
+#define _LR_COMPLEXITY_MAX_RMS 0.10
+#define _LR_COMPLEXITY_MARGIN 2.0
+
+bool _lr_complexity_regressed(double *ns, double *times, int32_t count,
+                              int32_t before, int32_t after,
+                              double *before_rms, double *after_rms)
+{
+    *before_rms = _lr_complexity_rms(ns, times, count, before);
+    *after_rms = _lr_complexity_rms(ns, times, count, after);
+    return after > before && *before_rms > _LR_COMPLEXITY_MAX_RMS &&
+           *before_rms > _LR_COMPLEXITY_MARGIN * *after_rms;
+}
+
+// Returns the number of benchmarks which regressed beyond the threshold.
+int32_t _lr_compare_bench_results(char const *path,
+                                  lr_bench_result_t *results,
+                                  int32_t name_width)
+{
+    lr_bench_result_t *baseline = _lr_load_bench_results(path);
+    if (!baseline) {
+        _lr_set_color_red();
+        printf("\nLABRAT: Failed to read benchmark baseline: %s\n", path);
+        _lr_set_color_def();
+        return 1;
+    }
+
+    const double alpha = 0.05;
+    int32_t regressions = 0;
+
+    _lr_set_color_wht();
+    printf("\nComparing against %s (threshold %.1f%%, alpha %.2f):\n\n",
+           path, __lr_bench_options.threshold, alpha);
+    _lr_set_color_def();
+
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        lr_bench_result_t *current = &results[i];
+        lr_bench_result_t *base = 0;
+        for (int64_t j = 0; j < lr_sb_count(baseline); j++)
+            if (strcmp(baseline[j].name, current->name) == 0)
+                base = &baseline[j];
+
+        if (!base || !lr_sb_count(base->samples)) {
+            _lr_set_color_yel();
+            printf("    [ NEW      ] -- %-*s: no baseline\n",
+                   name_width, current->name);
+            _lr_set_color_def();
+            continue;
+        }
+
+        double before = _lr_median(base->samples,
+                                   lr_sb_count(base->samples));
+        double after = _lr_median(current->samples,
+                                  lr_sb_count(current->samples));
+        double change = before > 0 ? 100.0 * (after - before) / before : 0;
+        double p = _lr_mann_whitney_p(base->samples,
+                                      lr_sb_count(base->samples),
+                                      current->samples,
+                                      lr_sb_count(current->samples));
+
+        char const *verdict;
+        if (p >= alpha) {
+            _lr_set_color_wht();
+            verdict = "SAME    ";
+        } else if (change > __lr_bench_options.threshold) {
+            _lr_set_color_red();
+            verdict = "SLOWER  ";
+            regressions++;
+        } else if (change > 0) {
+            _lr_set_color_yel();
+            verdict = "SLOWER  ";
+        } else {
+            _lr_set_color_grn();
+            verdict = "FASTER  ";
+        }
+
+        printf("    [ %s ] -- %-*s: %12.1f -> %12.1f cycles  %+7.2f%%  "
+               "(p = %.4f, %.1f%% confidence)\n",
+               verdict, name_width, current->name, before, after, change,
+               p, 100.0 * (1 - p));
+        _lr_set_color_def();
+    }
+
+    // a range benchmark which clearly fits a worse curve than it used to is
+    // flagged even if every individual size stayed within the threshold
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        lr_bench_result_t *current = &results[i];
+        if (current->n < 0 ||
+            (i > 0 && results[i - 1].n >= 0 &&
+             _lr_bench_group_len(results[i - 1].name) ==
+             _lr_bench_group_len(current->name) &&
+             strncmp(results[i - 1].name, current->name,
+                     _lr_bench_group_len(current->name)) == 0))
+            continue;
+
+        int32_t before = _lr_fit_complexity(baseline, current->name, 0);
+        int32_t after = _lr_fit_complexity(results, current->name, 0);
+        if (before < 0 || after < 0)
+            continue;
+
+        // both curves are judged on the current data
+        double ns[64];
+        double times[64];
+        int32_t count = _lr_range_times(results, current->name, ns, times,
+                                        _LR_ARRAY_COUNT(ns));
+        double before_rms;
+        double after_rms;
+        if (_lr_complexity_regressed(ns, times, count, before, after,
+                                     &before_rms, &after_rms)) {
+            _lr_set_color_red();
+            regressions++;
+        } else if (after > before) {
+            _lr_set_color_yel();
+        } else {
+            _lr_set_color_wht();
+        }
+
+        printf("    [ BIG-O    ] -- %-*.*s: %s -> %s (rms %.0f%% -> "
+               "%.0f%%)\n", name_width, _lr_bench_group_len(current->name),
+               current->name, _lr_complexity_names[before],
+               _lr_complexity_names[after], 100 * before_rms,
+               100 * after_rms);
+        _lr_set_color_def();
+    }
+
+    if (regressions) {
+        _lr_set_color_red();
+        printf("\n%d benchmark(s) regressed by more than %.1f%%.\n",
+               regressions, __lr_bench_options.threshold);
+        _lr_set_color_def();
+    }
+
+    _lr_free_bench_results(baseline);
+    return regressions;
+}
+
+void _lr_print_rate(double value, char const *unit)
+{
+    char const *prefixes[] = { "", "k", "M", "G", "T" };
+    int32_t prefix = 0;
+    for (; value >= 1000 && prefix < _LR_ARRAY_COUNT(prefixes) - 1; prefix++)
+        value /= 1000;
+    printf("  %.2f %s%s", value, prefixes[prefix], unit);
+}
+
+void _lr_print_bench_rates(lr_bench_result_t *result)
+{
+    if (!result->bytes && !result->items && !result->counter_count)
+        return;
+
+    double seconds = result->cycles / _lr_cycles_per_second();
+    if (seconds <= 0)
+        return;
+
+    if (result->bytes)
+        _lr_print_rate(result->bytes / seconds, "B/s");
+    if (result->items)
+        _lr_print_rate(result->items / seconds, " items/s");
+
+    for (int32_t i = 0; i < result->counter_count; i++) {
+        lr_counter_t *counter = &result->counters[i];
+        if (counter->per_second)
+            printf("  %s: %.3g / s", counter->name, counter->value / seconds);
+        else
+            printf("  %s: %.3g / iteration", counter->name,
+                   counter->value / result->iterations);
+    }
+}
+
+void _lr_print_bench_latency(lr_bench_result_t *result)
+{
+    if (!result->histogram || !result->histogram[0])
+        return;
+
+    printf("  p50 %" PRIu64 "  p90 %" PRIu64 "  p99 %" PRIu64
+           "  p99.9 %" PRIu64 "  max %" PRIu64 " cycles",
+           _lr_histogram_percentile(result->histogram, 50),
+           _lr_histogram_percentile(result->histogram, 90),
+           _lr_histogram_percentile(result->histogram, 99),
+           _lr_histogram_percentile(result->histogram, 99.9),
+           result->histogram[1]);
+}
+
+bool _lr_bench_allocated_unexpectedly(lr_bench_result_t *result)
+{
+    return result->expect_no_allocations && result->allocations > 0;
+}
+
+void _lr_print_bench_allocations(lr_bench_result_t *result)
+{
+    if (!_LR_TRACKS_ALLOCATIONS)
+        return;
+
+    if (_lr_bench_allocated_unexpectedly(result))
+        _lr_set_color_red();
+
+    printf("  %.2f allocs / iteration  %.1f B / iteration  %" PRId64
+           " B peak",
+           (double)result->allocations / result->iterations,
+           (double)result->allocated_bytes / result->iterations,
+           result->peak_live_bytes);
+
+    if (_lr_bench_allocated_unexpectedly(result)) {
+        printf(" (expected no allocations)");
+        _lr_set_color_wht();
+    }
+}
+
+// Doubles, and then scales, the iteration count until a run takes long
+// enough to swamp the timer and the per-run overhead.
+#define _LR_MIN_BENCH_SECONDS 0.1
+
+uint64_t _lr_calibrate_iterations(lr_bench_t *bench, int64_t n,
+                                  int32_t threads)
+{
+    double target = _LR_MIN_BENCH_SECONDS * _lr_cycles_per_second();
+    uint64_t iterations = 1;
+
+    while (iterations < 1000000000) {
+        double cycles = (double)_lr_time_benchmark(bench, iterations, n,
+                                                   threads, 0);
+        if (cycles >= target)
+            break;
+
+        if (cycles < target / 10)
+            iterations *= 10;
+        else
+            iterations = (uint64_t)(iterations * 1.2 * target / cycles) + 1;
+    }
+    return iterations;
+}
+
+// Runs one size of a benchmark (or one thread count of a threaded one) and
+// returns its median cycles per iteration. single_thread is the median of
+// the one thread run, used to work out parallel efficiency.
+double _lr_run_benchmark_size(lr_bench_t *bench, int64_t n, int32_t threads,
+                              double single_thread, uint64_t iterations,
+                              int32_t repetitions, int32_t name_width,
+                              lr_bench_result_t **results)
+{
+    lr_bench_result_t result;
+    memset(&result, 0, sizeof(result));
+    if (n >= 0)
+        snprintf(result.name, _LR_ARRAY_COUNT(result.name), "%s/%" PRId64,
+                 bench->name, n);
+    else if (threads > 0)
+        snprintf(result.name, _LR_ARRAY_COUNT(result.name), "%s/threads:%d",
+                 bench->name, threads);
+    else
+        snprintf(result.name, _LR_ARRAY_COUNT(result.name), "%s",
+                 bench->name);
+    result.n = n;
+    result.threads = threads;
+    if (bench->latency_func)
+        result.histogram = (uint64_t *)calloc(_LR_HISTOGRAM_SIZE,
+                                              sizeof(uint64_t));
+
+    if (!iterations)
+        iterations = _lr_calibrate_iterations(bench, n, threads);
+
+    bool profiling = __lr_bench_options.profile_dir && _lr_start_profiler();
+
+    for (int32_t r = 0; r < repetitions; r++) {
+        __lr_bytes_processed = 0;
+        __lr_items_processed = 0;
+        __lr_counter_count = 0;
+        memset(&__lr_alloc_stats, 0, sizeof(__lr_alloc_stats));
+        __lr_expect_no_allocations = false;
+
+        uint64_t cycles = _lr_time_benchmark(bench, iterations, n, threads,
+                                             result.histogram);
+        lr_sb_push(result.samples, (double)cycles / iterations);
+
+        result.cycles += (double)cycles;
+        result.iterations += iterations * (threads > 0 ? threads : 1);
+        result.bytes += __lr_bytes_processed;
+        result.items += __lr_items_processed;
+        for (int32_t i = 0; i < __lr_counter_count; i++)
+            _lr_add_counter(result.counters, &result.counter_count,
+                            __lr_counters[i].name, __lr_counters[i].value,
+                            __lr_counters[i].per_second);
+
+        result.allocations += __lr_alloc_stats.allocations;
+        result.allocated_bytes += __lr_alloc_stats.bytes;
+        if (__lr_alloc_stats.peak > result.peak_live_bytes)
+            result.peak_live_bytes = __lr_alloc_stats.peak;
+        result.expect_no_allocations |= __lr_expect_no_allocations;
+
+        // the warm run above is the one every other number comes from
+        if (__lr_bench_options.cold_cache) {
+            __lr_cold_cache = true;
+            cycles = _lr_time_benchmark(bench, iterations, n, threads, 0);
+            lr_sb_push(result.cold_samples, (double)cycles / iterations);
+            __lr_cold_cache = false;
+        }
+    }
+    __lr_cold_range_count = 0;
+
+    if (profiling) {
+        _lr_stop_profiler();
+        _lr_write_profile(__lr_bench_options.profile_dir, result.name);
+    }
+
+    double median = _lr_median(result.samples, lr_sb_count(result.samples));
+
+    _lr_set_color_wht();
+    printf("    [ FINISHED ] -- "
+           "%-*s: %12" PRIu64 " cycles / iteration",
+           name_width,
+           result.name,
+           (uint64_t)median);
+    if (repetitions > 1)
+        printf(" (median of %d runs)", repetitions);
+    if (result.cold_samples) {
+        double cold = _lr_median(result.cold_samples,
+                                 lr_sb_count(result.cold_samples));
+        printf(", %" PRIu64 " cold", (uint64_t)cold);
+        if (median > 0)
+            printf(" (%.1fx)", cold / median);
+    }
+    _lr_print_bench_latency(&result);
+    _lr_print_bench_rates(&result);
+    _lr_print_bench_allocations(&result);
+    if (threads > 0 && median > 0) {
+        _lr_print_rate(threads * _lr_cycles_per_second() / median,
+                       " iterations/s");
+        printf(", %.0f%% efficiency",
+               100 * (single_thread > 0 ? single_thread : median) / median);
+    }
+    printf("\n");
+    _lr_set_color_def();
+
+    lr_sb_push(*results, result);
+    return median;
+}
+
+// The sizes only grow by multiplying, so they have to start above 0.
+bool _lr_check_range(char const *name, int64_t *range)
+{
+    if (range[0] > 0)
+        return true;
+
+    printf("LABRAT: %s's range starts at %" PRId64 ", but it has to start "
+           "at 1 or more\n", name, range[0]);
+    return false;
+}
+
+int64_t _lr_next_range_size(int64_t *range, int64_t n)
+{
+    int64_t mult = range[2] > 1 ? range[2] : 2;
+    if (n >= range[1])
+        return -1;
+    return n * mult < range[1] ? n * mult : range[1];
+}
+
+int32_t _lr_next_thread_count(int32_t threads)
+{
+    int32_t cpus = _lr_cpu_count();
+    if (threads >= cpus)
+        return -1;
+    return threads * 2 < cpus ? threads * 2 : cpus;
+}
+
+// Runs every size or thread count of one benchmark.
+void _lr_run_benchmark(lr_bench_t *bench, uint64_t iterations,
+                       int32_t repetitions, int32_t name_width,
+                       lr_bench_result_t **results)
+{
+    if (bench->threaded_func) {
+        double single_thread = 0;
+        for (int32_t threads = 1;
+             threads > 0;
+             threads = _lr_next_thread_count(threads)) {
+            double median = _lr_run_benchmark_size(bench, -1, threads,
+                                                   single_thread, iterations,
+                                                   repetitions, name_width,
+                                                   results);
+            if (threads == 1)
+                single_thread = median;
+        }
+        return;
+    } else if (!bench->range) {
+        _lr_run_benchmark_size(bench, -1, 0, 0, iterations, repetitions,
+                               name_width, results);
+        return;
+    }
+
+    for (int64_t n = bench->range[0];
+         n >= 0;
+         n = _lr_next_range_size(bench->range, n))
+        _lr_run_benchmark_size(bench, n, 0, 0, iterations, repetitions,
+                               name_width, results);
+
+    double rms;
+    int32_t complexity = _lr_fit_complexity(*results, bench->name, &rms);
+    if (complexity >= 0) {
+        _lr_set_color_wht();
+        printf("    [ BIG-O    ] -- %-*s: %s (rms %.0f%%)\n",
+               name_width, bench->name,
+               _lr_complexity_names[complexity], 100 * rms);
+        _lr_set_color_def();
+    }
+}
+
+/******************************************************************************/
+////////////////////////////// Benchmark isolation /////////////////////////////
+/******************************************************************************/
+// With --lr-bench-isolate every benchmark runs in a child process of its own,
+// so one which crashes, leaks or trashes the heap can't take down or skew
+// the rest. The child prints as usual and sends its results back through a
+// pipe, with the pointers in each result followed by what they point at.
+#ifndef _WIN32
+#define _LR_CAN_ISOLATE 1
+
+#include <sys/wait.h>
+
+bool _lr_write_all(int fd, void const *data, int64_t size)
+{
+    char const *bytes = (char const *)data;
+    while (size > 0) {
+        int64_t written = write(fd, bytes, size);
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool _lr_read_all(int fd, void *data, int64_t size)
+{
+    char *bytes = (char *)data;
+    while (size > 0) {
+        int64_t got = read(fd, bytes, size);
+        if (got <= 0)
+            return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+void _lr_send_samples(int fd, double *samples)
+{
+    int64_t count = lr_sb_count(samples);
+    _lr_write_all(fd, &count, sizeof(count));
+    _lr_write_all(fd, samples, count * sizeof(double));
+}
+
+bool _lr_receive_samples(int fd, double **samples)
+{
+    int64_t count;
+    *samples = 0;
+    if (!_lr_read_all(fd, &count, sizeof(count)))
+        return false;
+
+    for (int64_t i = 0; i < count; i++) {
+        double sample;
+        if (!_lr_read_all(fd, &sample, sizeof(sample)))
+            return false;
+        lr_sb_push(*samples, sample);
+    }
+    return true;
+}
+
+void _lr_send_bench_results(int fd, lr_bench_result_t *results)
+{
+    for (int64_t i = 0; i < lr_sb_count(results); i++) {
+        bool has_histogram = results[i].histogram != 0;
+        _lr_write_all(fd, &results[i], sizeof(results[i]));
+        _lr_send_samples(fd, results[i].samples);
+        _lr_send_samples(fd, results[i].cold_samples);
+        _lr_write_all(fd, &has_histogram, sizeof(has_histogram));
+        if (has_histogram)
+            _lr_write_all(fd, results[i].histogram,
+                          _LR_HISTOGRAM_SIZE * sizeof(uint64_t));
+    }
+}
+
+bool _lr_receive_bench_result(int fd, lr_bench_result_t *result)
+{
+    bool has_histogram;
+    if (!_lr_read_all(fd, result, sizeof(*result)))
+        return false;
+
+    result->histogram = 0;
+    if (!_lr_receive_samples(fd, &result->samples) ||
+        !_lr_receive_samples(fd, &result->cold_samples) ||
+        !_lr_read_all(fd, &has_histogram, sizeof(has_histogram)))
+        return false;
+
+    if (has_histogram) {
+        result->histogram = (uint64_t *)calloc(_LR_HISTOGRAM_SIZE,
+                                               sizeof(uint64_t));
+        if (!_lr_read_all(fd, result->histogram,
+                          _LR_HISTOGRAM_SIZE * sizeof(uint64_t)))
+            return false;
+    }
+    return true;
+}
+
+// Returns false if the child didn't finish the benchmark.
+bool _lr_run_isolated_benchmark(lr_bench_t *bench, uint64_t iterations,
+                                int32_t repetitions, int32_t name_width,
+                                lr_bench_result_t **results)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        _lr_run_benchmark(bench, iterations, repetitions, name_width,
+                          results);
+        return true;
+    }
+
+    // or anything still buffered would be printed twice
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        lr_bench_result_t *child_results = 0;
+        close(fds[0]);
+        _lr_run_benchmark(bench, iterations, repetitions, name_width,
+                          &child_results);
+        _lr_destroy_fixtures();
+        _lr_send_bench_results(fds[1], child_results);
+        fflush(stdout);
+        _exit(__lr_bench_failed);
+    }
+    close(fds[1]);
+
+    lr_bench_result_t result;
+    while (pid > 0 && _lr_receive_bench_result(fds[0], &result))
+        lr_sb_push(*results, result);
+    close(fds[0]);
+
+    int status = 0;
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return true;
+
+    _lr_set_color_red();
+    if (pid > 0 && WIFSIGNALED(status))
+        printf("    [ CRASHED  ] -- %-*s: signal %d\n", name_width,
+               bench->name, WTERMSIG(status));
+    else
+        printf("    [ CRASHED  ] -- %-*s: could not run it\n", name_width,
+               bench->name);
+    _lr_set_color_def();
+    return false;
+}
+
+#else
+#define _LR_CAN_ISOLATE 0
+
+bool _lr_run_isolated_benchmark(lr_bench_t *bench, uint64_t iterations,
+                                int32_t repetitions, int32_t name_width,
+                                lr_bench_result_t **results)
+{
+    _lr_run_benchmark(bench, iterations, repetitions, name_width, results);
+    return true;
+}
+#endif
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+
+// Pins and prioritizes the runner, then warns about anything on the machine
+// which is likely to make the numbers noisy. The /sys and /proc files only
+// exist on Linux, so elsewhere the checks quietly find nothing.
+void _lr_prepare_machine(int32_t cpu)
+{
+    char message[256];
+    char line[128];
+
+    if (cpu >= 0 && !_lr_pin_thread(cpu)) {
+        snprintf(message, _LR_ARRAY_COUNT(message),
+                 "could not pin the runner to CPU %d", cpu);
+        _lr_print_warning(message);
+    }
+    _lr_raise_priority();
+
+    char path[128];
+    snprintf(path, _LR_ARRAY_COUNT(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor",
+             cpu >= 0 ? cpu : 0);
+    if (_lr_read_first_line(path, line, _LR_ARRAY_COUNT(line)) &&
+        strcmp(line, "performance") != 0) {
+        snprintf(message, _LR_ARRAY_COUNT(message),
+                 "CPU frequency governor is \"%s\", not \"performance\"",
+                 line);
+        _lr_print_warning(message);
+    }
+
+    if (_lr_read_first_line("/sys/devices/system/cpu/intel_pstate/no_turbo",
+                            line, _LR_ARRAY_COUNT(line))) {
+        if (strcmp(line, "0") == 0)
+            _lr_print_warning("turbo boost is enabled");
+    } else if (_lr_read_first_line("/sys/devices/system/cpu/cpufreq/boost",
+                                   line, _LR_ARRAY_COUNT(line))) {
+        if (strcmp(line, "1") == 0)
+            _lr_print_warning("turbo boost is enabled");
+    }
+
+    if (_lr_read_first_line("/proc/loadavg", line, _LR_ARRAY_COUNT(line))) {
+        double load = atof(line);
+        if (load > 1.0) {
+            snprintf(message, _LR_ARRAY_COUNT(message),
+                     "system load average is %.2f, other processes may "
+                     "interfere", load);
+            _lr_print_warning(message);
+        }
+    }
+}
+
+int32_t lr_run_benchmarks(uint64_t iterations)
+{
+    int32_t exit_code = 0;
+#ifndef LR_OFF // just produce an empty function if LR_OFF
+    _lr_set_color_wht();
+    printf("\nRunning benchmarks:\n\n");
+    _lr_set_color_def();
+
+    lr_bench_t benchmarks[] = {
+        { 0, 0, 0, 0, 0, 0, 0, 0 },
+#define BENCH_DEFINITION(id) { #id, id, 0, 0, 0, 0, 0, 0 },
+#define BENCH_RANGE_DEFINITION(id) \
+        { #id, 0, id, __lr_range_##id, 0, 0, 0, 0 },
+#define BENCH_THREADED_DEFINITION(id) { #id, 0, 0, 0, id, 0, 0, 0 },
+#define BENCH_LATENCY_DEFINITION(id) { #id, 0, 0, 0, 0, id, 0, 0 },
+#define BENCH_F_DEFINITION(id, fixture) \
+        { #id, 0, 0, 0, 0, 0, id, #fixture },
+#include "labrat_data.c"
+#undef BENCH_DEFINITION
+#undef BENCH_RANGE_DEFINITION
+#undef BENCH_THREADED_DEFINITION
+#undef BENCH_LATENCY_DEFINITION
+#undef BENCH_F_DEFINITION
+    };
+
+    lr_bench_options_t *options = &__lr_bench_options;
+
+    _lr_prepare_machine(options->cpu);
+    if (options->cold_cache)
+        _lr_allocate_eviction_buffer();
+    _lr_pause_overhead();
+    _lr_latency_overhead();
+
+    if (options->profile_dir && !_LR_CAN_PROFILE)
+        _lr_print_warning("profiling needs Linux on x86-64 or ARM64");
+
+    if (options->fail_on_alloc && !_LR_TRACKS_ALLOCATIONS)
+        _lr_print_warning("allocation tracking needs glibc and "
+                          "LR_TRACK_ALLOCATIONS defined in the "
+                          "implementation");
+
+    // significance testing is meaningless without repeated samples
+    int32_t repetitions = options->repetitions;
+    if (repetitions <= 0)
+        repetitions = (options->save_path || options->compare_path) ? 10 : 1;
+
+    int32_t max_bench_name_size = -1;
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(benchmarks); i++) {
+        if (!_lr_bench_selected(benchmarks[i].name))
+            continue;
+
+        char name[128];
+        if (benchmarks[i].range)
+            snprintf(name, _LR_ARRAY_COUNT(name), "%s/%" PRId64,
+                     benchmarks[i].name, benchmarks[i].range[1]);
+        else if (benchmarks[i].threaded_func)
+            snprintf(name, _LR_ARRAY_COUNT(name), "%s/threads:%d",
+                     benchmarks[i].name, _lr_cpu_count());
+        else
+            snprintf(name, _LR_ARRAY_COUNT(name), "%s", benchmarks[i].name);
+
+        int32_t size = (int32_t)strlen(name);
+        if (size > max_bench_name_size)
+            max_bench_name_size = size;
+    }
+    int32_t name_width = max_bench_name_size + 2;
+
+    if (options->isolate && !_LR_CAN_ISOLATE)
+        _lr_print_warning("isolating benchmarks needs fork");
+
+    lr_bench_result_t *results = 0;
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(benchmarks); i++) {
+        if (!_lr_bench_selected(benchmarks[i].name))
+            continue;
+        if (benchmarks[i].range &&
+            !_lr_check_range(benchmarks[i].name, benchmarks[i].range)) {
+            exit_code = 1;
+            continue;
+        }
+
+        if (options->isolate && _LR_CAN_ISOLATE) {
+            if (!_lr_run_isolated_benchmark(&benchmarks[i], iterations,
+                                            repetitions, name_width,
+                                            &results))
+                exit_code = 1;
+        } else {
+            _lr_run_benchmark(&benchmarks[i], iterations, repetitions,
+                              name_width, &results);
+        }
+    }
+    if (__lr_bench_failed)
+        exit_code = 1;
+
+    int32_t allocating = 0;
+    for (int64_t i = 0; i < lr_sb_count(results); i++)
+        if (_lr_bench_allocated_unexpectedly(&results[i]))
+            allocating++;
+
+    if (allocating) {
+        _lr_set_color_red();
+        printf("\n%d allocation-free benchmark(s) allocated.\n", allocating);
+        _lr_set_color_def();
+        if (options->fail_on_alloc)
+            exit_code = 1;
+    }
+
+    if (options->save_path)
+        _lr_save_bench_results(options->save_path, results);
+    if (options->json_path)
+        _lr_write_json_results(options->json_path, results);
+    if (options->csv_path)
+        _lr_write_csv_results(options->csv_path, results);
+
+    if (options->compare_path &&
+        _lr_compare_bench_results(options->compare_path, results,
+                                  name_width))
+        exit_code = 1;
+
+    _lr_free_bench_results(results);
+    _lr_destroy_fixtures();
+
+    _lr_set_color_wht();
+    printf("\nFinished running benchmarks.\n");
+    _lr_set_color_def();
+#endif // #ifndef LR_OFF
+    return exit_code;
+}
+
+/******************************************************************************/
+/////////////////////////////////// Fuzzing ////////////////////////////////////
+/******************************************************************************/
+// --lr-fuzz runs a FUZZ_TEST over and over in one process, mutating inputs
+// from its corpus and keeping the ones which reach new code. The loop runs in
+// a child, with the input being tried in memory shared with the parent, so
+// when the child dies the parent still has the input which killed it, and
+// shrinks it by trying smaller ones in children of their own.
+typedef struct {
+    char const *name;
+    void (*func)(uint8_t const *data, int64_t size);
+} lr_fuzz_target_t;
+
+lr_fuzz_target_t __lr_fuzz_targets[] = {
+    { 0, 0 },
+#define FUZZ_DEFINITION(id) { #id, id },
+#include "labrat_data.c"
+#undef FUZZ_DEFINITION
+};
+
+#ifndef _WIN32
+#include <sys/wait.h>
+
+// One hit counter per edge. Edges past the end of the map share counters.
+#define _LR_FUZZ_MAP_SIZE (1 << 16)
+
+uint8_t __lr_fuzz_counters[_LR_FUZZ_MAP_SIZE];
+uint32_t __lr_fuzz_guard_count;
+
+// The compiler calls these from every instrumented edge, so they have to have
+// C names, and mustn't be instrumented themselves.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+_LR_NO_COVERAGE
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop)
+{
+    if (start == stop || *start)
+        return;
+    for (uint32_t *guard = start; guard < stop; guard++)
+        *guard = 1 + __lr_fuzz_guard_count++ % (_LR_FUZZ_MAP_SIZE - 1);
+}
+
+_LR_NO_COVERAGE
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard)
+{
+    __lr_fuzz_counters[*guard]++;
+    if (_LR_CAN_RECORD_COVERAGE && __lr_recording_coverage)
+        _lr_record_covered((uintptr_t)__builtin_return_address(0));
+}
+
+// GCC's trace-pc has no guards, so the caller's address picks the counter.
+_LR_NO_COVERAGE
+void __sanitizer_cov_trace_pc(void)
+{
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    __lr_fuzz_counters[1 + (pc ^ (pc >> 16)) % (_LR_FUZZ_MAP_SIZE - 1)]++;
+    if (_LR_CAN_RECORD_COVERAGE && __lr_recording_coverage)
+        _lr_record_covered(pc);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+typedef struct {
+    uint8_t *data;
+    int64_t size;
+} lr_fuzz_input_t;
+
+// What the parent can see of the child: the input it is running right now.
+typedef struct {
+    int64_t size;
+    uint8_t data[1];
+} lr_fuzz_shared_t;
+
+uint64_t _lr_fuzz_random(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+uint64_t _lr_fuzz_hash(uint8_t const *data, int64_t size)
+{
+    return _lr_hash(data, size, _LR_HASH_SEED);
+}
+
+// Only the part of the map which the guards use needs clearing, but trace-pc
+// could land anywhere in it.
+int64_t _lr_fuzz_map_used()
+{
+    if (!__lr_fuzz_guard_count ||
+        __lr_fuzz_guard_count >= _LR_FUZZ_MAP_SIZE - 8)
+        return _LR_FUZZ_MAP_SIZE;
+    return (__lr_fuzz_guard_count + 8) & ~7;
+}
+
+// Runs the target on a copy of exactly size bytes, so that a sanitizer can
+// catch reads past the end. Returns false if an assertion failed.
+bool _lr_fuzz_run(lr_fuzz_target_t *target, uint8_t const *data, int64_t size)
+{
+    uint8_t *copy = (uint8_t *)malloc(size ? size : 1);
+    memcpy(copy, data, size);
+    memset(__lr_fuzz_counters, 0, _lr_fuzz_map_used());
+    __lr_test_passed = true;
+    target->func(copy, size);
+    free(copy);
+    return __lr_test_passed;
+}
+
+// AFL's buckets, so that a loop running more times only counts as new
+// behaviour when it's a different order of magnitude.
+int32_t _lr_fuzz_bucket(uint8_t count)
+{
+    if (count <= 3)
+        return count;
+    if (count < 8)
+        return 4;
+    if (count < 16)
+        return 5;
+    if (count < 32)
+        return 6;
+    return count < 128 ? 7 : 8;
+}
+
+// Folds the last run's counters into seen, which has a bit per bucket of
+// every edge, and returns how many bits were new.
+int32_t _lr_fuzz_merge_coverage(uint8_t *seen)
+{
+    int64_t used = _lr_fuzz_map_used();
+    int32_t found = 0;
+
+    for (int64_t i = 0; i < used; i += 8) {
+        uint64_t word;
+        memcpy(&word, __lr_fuzz_counters + i, sizeof(word));
+        if (!word)
+            continue;
+
+        for (int64_t j = i; j < i + 8; j++) {
+            if (!__lr_fuzz_counters[j])
+                continue;
+            uint8_t bit = 1 << (_lr_fuzz_bucket(__lr_fuzz_counters[j]) - 1);
+            if (!(seen[j] & bit)) {
+                seen[j] |= bit;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+int64_t _lr_fuzz_mutate(uint8_t *data, int64_t size, int64_t max_len,
+                        lr_fuzz_input_t *corpus, uint64_t *rng)
+{
+    static const uint8_t interesting[] = {
+        0, 1, '0', '9', ' ', '\n', 0x7f, 0x80, 0xff
+    };
+    int32_t mutations = 1 + (int32_t)(_lr_fuzz_random(rng) % 4);
+
+    for (int32_t m = 0; m < mutations; m++) {
+        uint64_t r = _lr_fuzz_random(rng);
+        int64_t at = size ? (int64_t)(r >> 8) % size : 0;
+        int32_t kind = (int32_t)(r % 7);
+
+        // everything but inserting needs a byte to work on
+        if (!size && kind != 3 && kind != 6)
+            kind = 3;
+        if (size >= max_len && (kind == 3 || kind == 6))
+            kind = 0;
+
+        switch (kind) {
+        case 0: // flip a bit
+            data[at] ^= 1 << (r >> 40) % 8;
+            break;
+        case 1: // any byte
+            data[at] = (uint8_t)(r >> 40);
+            break;
+        case 2:
+            data[at] = interesting[(r >> 40) % sizeof(interesting)];
+            break;
+        case 3: // insert a byte
+            at = (int64_t)(r >> 8) % (size + 1);
+            memmove(data + at + 1, data + at, size - at);
+            data[at] = (uint8_t)(r >> 40);
+            size++;
+            break;
+        case 4: { // erase a run of bytes
+            int64_t count = 1 + (int64_t)(r >> 40) % 8;
+            if (count > size - at)
+                count = size - at;
+            memmove(data + at, data + at + count, size - at - count);
+            size -= count;
+            break;
+        }
+        case 5: // nudge a byte up or down
+            data[at] += (uint8_t)((r >> 40) % 33) - 16;
+            break;
+        default: { // splice in part of another input
+            lr_fuzz_input_t *other =
+                &corpus[(r >> 16) % lr_sb_count(corpus)];
+            if (!other->size)
+                break;
+            int64_t from = (int64_t)(r >> 24) % other->size;
+            int64_t count = 1 + (int64_t)(r >> 40) % (other->size - from);
+            if (count > max_len - size)
+                count = max_len - size;
+            at = (int64_t)(r >> 8) % (size + 1);
+            memmove(data + at + count, data + at, size - at);
+            memcpy(data + at, other->data + from, count);
+            size += count;
+            break;
+        }
+        }
+    }
+    return size;
+}
+
+uint8_t *_lr_fuzz_read_file(char const *path, int64_t max_len,
+                            int64_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+
+    uint8_t *data = (uint8_t *)malloc(max_len ? max_len : 1);
+    *size = (int64_t)fread(data, 1, max_len, fp);
+    fclose(fp);
+    return data;
+}
+
+void _lr_fuzz_write_input(char const *dir, char const *prefix,
+                          uint8_t const *data, int64_t size, char *path,
+                          int64_t path_size)
+{
+    snprintf(path, path_size, "%s%s%s%016" PRIx64, dir, dir[0] ? "/" : "",
+             prefix, _lr_fuzz_hash(data, size));
+    FILE *fp = fopen(path, "wb");
+    if (fp) {
+        fwrite(data, 1, size, fp);
+        fclose(fp);
+    }
+}
+
+void _lr_fuzz_print_status(char const *event, int64_t execs, int32_t edges,
+                           int32_t features, int64_t corpus_count,
+                           double start)
+{
+    double elapsed = _lr_wall_time() - start;
+    printf("    #%-10" PRId64 " %-6s cov: %-6d ft: %-6d corpus: %-6" PRId64
+           " exec/s: %.0f\n", execs, event, edges, features, corpus_count,
+           elapsed > 0 ? execs / elapsed : 0);
+    fflush(stdout);
+}
+
+// The child's side. Returns 0 when it ran out of time or runs, and exits as
+// soon as an assertion fails.
+int32_t _lr_fuzz_loop(lr_fuzz_target_t *target, lr_fuzz_shared_t *shared,
+                      char const *corpus_dir)
+{
+    lr_fuzz_options_t *options = &__lr_fuzz_options;
+    uint8_t *seen = (uint8_t *)calloc(_LR_FUZZ_MAP_SIZE, 1);
+    lr_fuzz_input_t *corpus = 0;
+    int32_t features = 0;
+    char path[1024];
+
+    // replaying the corpus first also reproduces any crash saved into it
+    DIR *dir = opendir(corpus_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        lr_fuzz_input_t input;
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", corpus_dir,
+                 entry->d_name);
+        input.data = _lr_fuzz_read_file(path, options->max_len,
+                                        &input.size);
+        if (input.data)
+            lr_sb_push(corpus, input);
+    }
+    if (dir)
+        closedir(dir);
+
+    if (!lr_sb_count(corpus)) {
+        lr_fuzz_input_t empty = { (uint8_t *)malloc(1), 0 };
+        lr_sb_push(corpus, empty);
+    }
+
+    for (int64_t i = 0; i < lr_sb_count(corpus); i++) {
+        memcpy(shared->data, corpus[i].data, corpus[i].size);
+        shared->size = corpus[i].size;
+        if (!_lr_fuzz_run(target, corpus[i].data, corpus[i].size)) {
+            _lr_report_assert_failures();
+            return 1;
+        }
+        features += _lr_fuzz_merge_coverage(seen);
+    }
+
+    int32_t edges = 0;
+    for (int64_t i = 0; i < _LR_FUZZ_MAP_SIZE; i++)
+        edges += seen[i] != 0;
+    if (!edges && !__lr_fuzz_guard_count)
+        _lr_print_warning("no coverage, so inputs are mutated blindly; "
+                          "build with -fsanitize-coverage=trace-pc-guard, "
+                          "or trace-pc with GCC");
+
+    double start = _lr_wall_time();
+    uint64_t rng = _lr_fuzz_hash((uint8_t const *)&start, sizeof(start)) | 1;
+    int64_t next_pulse = 1024;
+    _lr_fuzz_print_status("INITED", 0, edges, features,
+                          lr_sb_count(corpus), start);
+
+    for (int64_t execs = 1; ; execs++) {
+        lr_fuzz_input_t *parent =
+            &corpus[_lr_fuzz_random(&rng) % lr_sb_count(corpus)];
+        memcpy(shared->data, parent->data, parent->size);
+        shared->size = _lr_fuzz_mutate(shared->data, parent->size,
+                                       options->max_len, corpus, &rng);
+
+        if (!_lr_fuzz_run(target, shared->data, shared->size)) {
+            _lr_report_assert_failures();
+            return 1;
+        }
+
+        int32_t found = _lr_fuzz_merge_coverage(seen);
+        if (found) {
+            lr_fuzz_input_t input;
+            input.size = shared->size;
+            input.data = (uint8_t *)malloc(input.size ? input.size : 1);
+            memcpy(input.data, shared->data, input.size);
+            lr_sb_push(corpus, input);
+            _lr_fuzz_write_input(corpus_dir, "", input.data, input.size,
+                                 path, _LR_ARRAY_COUNT(path));
+
+            features += found;
+            edges = 0;
+            for (int64_t i = 0; i < _LR_FUZZ_MAP_SIZE; i++)
+                edges += seen[i] != 0;
+            _lr_fuzz_print_status("NEW", execs, edges, features,
+                                  lr_sb_count(corpus), start);
+        }
+
+        if (execs == next_pulse) {
+            _lr_fuzz_print_status("pulse", execs, edges, features,
+                                  lr_sb_count(corpus), start);
+            next_pulse *= 2;
+        }
+
+        bool done = options->runs && execs >= options->runs;
+        if (options->seconds > 0 && (execs & 255) == 0)
+            done = done || _lr_wall_time() - start >= options->seconds;
+        if (done) {
+            _lr_fuzz_print_status("DONE", execs, edges, features,
+                                  lr_sb_count(corpus), start);
+            return 0;
+        }
+    }
+}
+
+// Runs one input in a child with its output thrown away, and says whether it
+// crashed or failed an assertion.
+bool _lr_fuzz_fails(lr_fuzz_target_t *target, uint8_t const *data,
+                    int64_t size)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        _exit(_lr_fuzz_run(target, data, size) ? 0 : 1);
+    }
+
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+// Takes out ever smaller chunks for as long as the input still fails. It may
+// end up failing in a different way, but it fails.
+int64_t _lr_fuzz_minimize(lr_fuzz_target_t *target, uint8_t *data,
+                          int64_t size)
+{
+    uint8_t *candidate = (uint8_t *)malloc(size ? size : 1);
+
+    for (int64_t chunk = size / 2; chunk >= 1; chunk /= 2) {
+        for (int64_t at = 0; at + chunk <= size;) {
+            memcpy(candidate, data, at);
+            memcpy(candidate + at, data + at + chunk, size - at - chunk);
+            if (_lr_fuzz_fails(target, candidate, size - chunk)) {
+                size -= chunk;
+                memcpy(data, candidate, size);
+            } else {
+                at += chunk;
+            }
+        }
+    }
+
+    free(candidate);
+    return size;
+}
+
+int32_t lr_fuzz(char const *name)
+{
+    int32_t exit_code = 0;
+#ifndef LR_OFF // just produce an empty function if LR_OFF
+    lr_fuzz_options_t *options = &__lr_fuzz_options;
+    lr_fuzz_target_t *target = 0;
+    for (int64_t i = 1; i < _LR_ARRAY_COUNT(__lr_fuzz_targets); i++)
+        if (strcmp(__lr_fuzz_targets[i].name, name) == 0)
+            target = &__lr_fuzz_targets[i];
+    if (!target) {
+        printf("LABRAT: No FUZZ_TEST found named: %s\n", name);
+        return 1;
+    }
+
+    char corpus_dir[512];
+    if (options->corpus_dir)
+        snprintf(corpus_dir, _LR_ARRAY_COUNT(corpus_dir), "%s",
+                 options->corpus_dir);
+    else
+        snprintf(corpus_dir, _LR_ARRAY_COUNT(corpus_dir), "%s_corpus", name);
+    mkdir(corpus_dir, 0777);
+
+    lr_fuzz_shared_t *shared = (lr_fuzz_shared_t *)mmap(
+        0, sizeof(lr_fuzz_shared_t) + options->max_len,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        printf("LABRAT: Could not map memory to share with the fuzzer\n");
+        return 1;
+    }
+
+    _lr_set_color_wht();
+    printf("\nFuzzing %s with corpus %s:\n\n", name, corpus_dir);
+    _lr_set_color_def();
+
+    // or anything still buffered would be printed twice
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int32_t code = _lr_fuzz_loop(target, shared, corpus_dir);
+        fflush(stdout);
+        _exit(code);
+    }
+
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        printf("LABRAT: Could not start the fuzzer\n");
+        exit_code = 1;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        char path[1024];
+        int64_t size = shared->size;
+        uint8_t *input = (uint8_t *)malloc(size ? size : 1);
+        memcpy(input, shared->data, size);
+
+        _lr_set_color_red();
+        if (WIFSIGNALED(status))
+            printf("    [ CRASHED  ] -- %s: signal %d", name,
+                   WTERMSIG(status));
+        else
+            printf("    [ FAILED   ] -- %s", name);
+        _lr_fuzz_write_input("", "crash-", input, size, path,
+                             _LR_ARRAY_COUNT(path));
+        printf(" on %" PRId64 " bytes, saved to %s\n", size, path);
+        _lr_set_color_def();
+
+        int64_t minimized = _lr_fuzz_minimize(target, input, size);
+        if (minimized < size) {
+            _lr_fuzz_write_input("", "crash-min-", input, minimized, path,
+                                 _LR_ARRAY_COUNT(path));
+            printf("    minimized to %" PRId64 " bytes, saved to %s\n",
+                   minimized, path);
+        }
+        free(input);
+        exit_code = 1;
+    }
+
+    munmap(shared, sizeof(lr_fuzz_shared_t) + options->max_len);
+
+    _lr_set_color_wht();
+    printf("\nFinished fuzzing.\n");
+    _lr_set_color_def();
+#endif // #ifndef LR_OFF
+    return exit_code;
+}
+
+#else
+int32_t lr_fuzz(char const *name)
+{
+    (void)name;
+    printf("LABRAT: Fuzzing needs fork, which Windows doesn't have\n");
+    return 1;
+}
+#endif
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
+#endif // #if !defined(LR_GEN_EXECUTABLE) || defined(LR_SELF_TEST)
+
+enum {
+    LR_TOKEN_L_PAREN,
+    LR_TOKEN_R_PAREN,
+    LR_TOKEN_L_BRACE,
+    LR_TOKEN_R_BRACE,
+    LR_TOKEN_L_BRACKET,
+    LR_TOKEN_R_BRACKET,
+    LR_TOKEN_COMMA,
+    LR_TOKEN_PERIOD,
+    LR_TOKEN_ASTERISK,
+    LR_TOKEN_MINUS,
+    LR_TOKEN_PLUS,
+    LR_TOKEN_EXCLAMATION,
+    LR_TOKEN_TILDE,
+    LR_TOKEN_BACKSLASH,
+    LR_TOKEN_SLASH,
+    LR_TOKEN_EQ,
+    LR_TOKEN_AMPERSAND,
+    LR_TOKEN_POUND,
+    LR_TOKEN_SEMICOLON,
+    LR_TOKEN_COLON,
+    LR_TOKEN_QUESTION_MARK,
+    LR_TOKEN_IDENTIFIER,
+    LR_TOKEN_NUMBER,
+    LR_TOKEN_CHARACTER,
+    LR_TOKEN_STRING,
+    LR_TOKEN_UNKNOWN,
+    LR_TOKEN_EOF,
+};
+
+typedef struct {
+    int64_t len;
+    char *data;
+} lr_slice_t;
+
+typedef struct {
+    uint32_t type;
+    lr_slice_t slice;
+} c_token_t;
+
+char *get_token_type_name(uint32_t type)
+{
+    switch (type) {
+    case LR_TOKEN_L_PAREN: { return "LR_TOKEN_L_PAREN"; }
+    case LR_TOKEN_R_PAREN: { return "LR_TOKEN_R_PAREN"; }
+    case LR_TOKEN_L_BRACE: { return "LR_TOKEN_L_BRACE"; }
+    case LR_TOKEN_R_BRACE: { return "LR_TOKEN_R_BRACE"; }
+    case LR_TOKEN_L_BRACKET: { return "LR_TOKEN_L_BRACKET"; }
+    case LR_TOKEN_R_BRACKET: { return "LR_TOKEN_R_BRACKET"; }
+    case LR_TOKEN_ASTERISK: { return "LR_TOKEN_ASTERISK"; }
+    case LR_TOKEN_COMMA: { return "LR_TOKEN_COMMA"; }
+    case LR_TOKEN_PERIOD: { return "LR_TOKEN_PERIOD"; }
+    case LR_TOKEN_MINUS: { return "LR_TOKEN_MINUS"; }
+    case LR_TOKEN_PLUS: { return "LR_TOKEN_PLUS"; }
+    case LR_TOKEN_EXCLAMATION: { return "LR_TOKEN_EXCLAMATION"; }
+    case LR_TOKEN_TILDE: { return "LR_TOKEN_TILDE"; }
+    case LR_TOKEN_BACKSLASH: { return "LR_TOKEN_BACKSLASH"; }
+    case LR_TOKEN_SLASH: { return "LR_TOKEN_SLASH"; }
+    case LR_TOKEN_EQ: { return "LR_TOKEN_EQ"; }
+    case LR_TOKEN_AMPERSAND: { return "LR_TOKEN_AMPERSAND"; }
+    case LR_TOKEN_POUND: { return "LR_TOKEN_POUND"; }
+    case LR_TOKEN_SEMICOLON: { return "LR_TOKEN_SEMICOLON"; }
+    case LR_TOKEN_COLON: { return "LR_TOKEN_COLON"; }
+    case LR_TOKEN_QUESTION_MARK: { return "LR_TOKEN_QUESTION_MARK"; }
+    case LR_TOKEN_IDENTIFIER: { return "LR_TOKEN_IDENTIFIER"; }
+    case LR_TOKEN_NUMBER: { return "LR_TOKEN_NUMBER"; }
+    case LR_TOKEN_CHARACTER: { return "LR_TOKEN_CHARACTER"; }
+    case LR_TOKEN_STRING: { return "LR_TOKEN_STRING"; }
+    case LR_TOKEN_UNKNOWN: { return "LR_TOKEN_UNKNOWN"; }
+    case LR_TOKEN_EOF: { return "LR_TOKEN_EOF"; }
+    default: { return "---"; }
+    }
+}
+
+lr_slice_t lr_as_slice(char *s, int64_t len)
+{
+    lr_slice_t result;
+
+    result.len = len;
+    result.data = s;
+    return result;
+}
+
+lr_slice_t lr_slice(lr_slice_t s, int64_t start, int64_t end)
+{
+    lr_slice_t result;
+
+    result.len = end - start;
+    result.data = s.data + start;
+    return result;
+}
+
+lr_slice_t lr_slice_r(lr_slice_t s, int64_t start)
+{
+    lr_slice_t result;
+
+    result.len = s.len - start;
+    result.data = s.data + start;
+    return result;
+}
+
+lr_slice_t lr_slice_l(lr_slice_t s, int64_t end)
+{
+    lr_slice_t result;
+
+    result.len = end;
+    result.data = s.data;
+    return result;
+}
+
+lr_slice_t lr_copy_slice(lr_slice_t s)
+{
+    lr_slice_t result;
+
+    result.data = (char *)malloc(s.len);
+    result.len = s.len;
+    memcpy(result.data, s.data, s.len);
+    return result;
+}
+
+bool lr_slices_equal(lr_slice_t lhs, lr_slice_t rhs)
+{
+    if (lhs.len != rhs.len)
+        return false;
+    else
+        return memcmp(lhs.data, rhs.data, lhs.len) != 0;
+}
+
+#undef LR_IMPLEMENTATION
+#endif // #ifdef LR_IMPLEMENTATION
+
+/******************************************************************************/
+////////////////////////////// END IMPLEMENTATION //////////////////////////////
+/******************************************************************************/
+
+
+/******************************************************************************/
+/////////////////////////////// BEGIN EXECUTABLE ///////////////////////////////
+/******************************************************************************/
+
+
+#ifdef LR_GEN_EXECUTABLE
+
+int32_t lr_min(int32_t a, int32_t b)
+{
+    return a > b ? b : a;
+}
+
+char **lr_get_directory(char *start_dir, int64_t *file_count)
+{
+    char **result = 0;
+
+    char *stack[1024] = { 0 };
+    int32_t stack_size = 0;
+
+    stack[stack_size++] = start_dir;
+
+    while (stack_size) {
+        char *dir_path = stack[--stack_size];
+
+#ifdef _WIN32
+
+        char path[2048];
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/*.*", dir_path);
+
+        WIN32_FIND_DATA fd;
+        HANDLE handle = NULL;
+        if ((handle = FindFirstFile(path, &fd)) == INVALID_HANDLE_VALUE)
+            continue;
+
+        do {
+            if (strcmp(fd.cFileName, ".") != 0 &&
+                strcmp(fd.cFileName, "..") != 0) {
+                snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir_path,
+                         fd.cFileName);
+
+                if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                    int64_t path_length = strlen(path) + 1;
+                    stack[stack_size] = (char *)malloc(path_length);
+                    memcpy(stack[stack_size], path, path_length);
+                    stack_size++;
+                } else {
+                    int64_t path_length = strlen(path) + 1;
+                    char *filename = (char *)malloc(path_length);
+                    memcpy(filename, path, path_length);
+
+                    lr_sb_push(result, filename);
+                }
+            }
+        } while (FindNextFile(handle, &fd));
+
+        FindClose(handle);
+
+#else // !_WIN32
+        char path[2048];
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s", dir_path);
+
+        DIR *dir = 0;
+        struct dirent *fd = {0};
+
+        dir = opendir(path);
+        if (!dir) {
+            printf("Could not open directory %s.", path);
+            continue;
+        }
+
+        fd = readdir(dir);
+        if (!fd) {
+            printf("Could not read directory %s.", path);
+            continue;
+        }
+
+        do {
+            if (strcmp(fd->d_name, ".") != 0 &&
+                strcmp(fd->d_name, "..") != 0) {
+                snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir_path,
+                    fd->d_name);
+
+                if (fd->d_type == DT_DIR) {
+                    int64_t path_length = strlen(path) + 1;
+                    stack[stack_size] = (char *)malloc(path_length);
+                    memcpy(stack[stack_size], path, path_length);
+                    stack_size++;
+                } else {
+                    int64_t path_length = strlen(path) + 1;
+                    char *filename = (char *)malloc(path_length);
+                    memcpy(filename, path, path_length);
+
+                    lr_sb_push(result, filename);
+                }
+            }
+        } while ((fd = readdir(dir)));
+
+        closedir(dir);
+
+#endif // /_WIN32
+        if (dir_path != start_dir)
+            free(dir_path);
+    }
+
+    *file_count = lr_sb_count(result);
+    return result;
+
+    // char **result = 0;
+    // DIR *d;
+    // struct dirent *dir;
+    // d = opendir(".");
+    // if (d) {
+    //     while ((dir = readdir(d)) != NULL)
+    //     {
+    //         printf("%s\n", dir->d_name);
+    //     }
+
+    //     closedir(d);
+    // }
+}
+
+int32_t lr_is_whitespace(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+lr_slice_t lr_eat_whitespace_and_comments(lr_slice_t s)
+{
+    char *data = s.data;
+    int64_t len = s.len;
+
+    while (len > 0) {
+        if (lr_is_whitespace(*data)) {
+            ++data;
+            --len;
+        } else if (len > 1 && data[0] == '/' && data[1] == '/') {
+            data += 2;
+            len -= 2;
+            while (len > 0 && *data != '\n') {
+                ++data;
+                --len;
+            }
+        } else if (len > 1 && data[0] == '/' && data[1] == '*') {
+            data += 2;
+            len -= 2;
+            while (len > 0 && !(data[0] == '*' && len > 1 && data[1] == '/')) {
+                ++data;
+                --len;
+            }
+            if (len > 2) {
+                data += 2;
+                len -= 2;
+            } else {
+                data += len;
+                len = 0;
+            }
+        } else {
+            break;
+        }
+    }
+
+    lr_slice_t result;
+    result.data = data;
+    result.len = len;
+    return result;
+}
+
+int32_t lr_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+int32_t lr_is_word_char(char c)
+{
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c == '_');
+}
+
+int32_t lr_is_identifier(char c)
+{
+    return lr_is_word_char(c) || lr_is_digit(c);
+}
+
+bool lr_lex_identifier(lr_slice_t *c, c_token_t *token)
+{
+    if (lr_is_word_char(*c->data)) {
+        int32_t len = 1;
+        while (c->len - len) {
+            if (lr_is_word_char(c->data[len]) || lr_is_digit(c->data[len]))
+                ++len;
+            else
+                break;
+        }
+
+        lr_slice_t token_slice = lr_slice_l(*c, len);
+        *c = lr_slice_r(*c, len);
+        token->type = LR_TOKEN_IDENTIFIER;
+        token->slice = token_slice;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool lr_lex_constant(lr_slice_t *c, c_token_t *token)
+{
+    uint32_t token_type;
+
+    if (lr_is_digit(*c->data)) {
+        token_type = LR_TOKEN_NUMBER;
+        int32_t len = 1;
+        while (c->len - len) {
+            char ch = c->data[len];
+            if (!lr_is_digit(ch) &&
+                ch != '.' &&
+                ch != 'x' &&
+                ch != 'X')
+                break;
+            len++;
+        }
+
+        lr_slice_t token_slice = lr_slice_l(*c, len);
+        *c = lr_slice_r(*c, len);
+        token->type = token_type;
+        token->slice = token_slice;
+        return true;
+    } else if (*c->data == '\'') {
+        token_type = LR_TOKEN_CHARACTER;
+        int32_t len = 1;
+        while (c->len - len - 1) {
+            if (c->data[len] == '\\') {
+                if (c->data[len + 1] == 'x') {
+                    len = lr_min(len + 4, (int32_t)c->len + 1);
+                    continue;
+                } else {
+                    len = lr_min(len + 2, (int32_t)c->len + 1);
+                    continue;
+                }
+            }
+            if (c->data[len] == '\'')
+                break;
+            len++;
+        }
+
+        lr_slice_t token_slice = lr_slice_l(*c, len + 1);
+        *c = lr_slice_r(*c, len + 1);
+        token->type = token_type;
+        token->slice = token_slice;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool lr_lex_string(lr_slice_t *c, c_token_t *token)
+{
+    if (*c->data == '"') {
+        int32_t len = 1;
+        while (c->len - len - 1) {
+            if (c->data[len] == '\\') {
+                if (c->data[len + 1] == 'x') {
+                    len = lr_min(len + 4, (int32_t)c->len + 1);
+                    continue;
+                } else {
+                    len = lr_min(len + 2, (int32_t)c->len + 1);
+                    continue;
+                }
+            }
+            if (c->data[len] == '"')
+                break;
+            len++;
+        }
+
+        lr_slice_t token_slice = lr_slice_l(*c, len + 1);
+        *c = lr_slice_r(*c, len + 1);
+        token->type = LR_TOKEN_STRING;
+        token->slice = token_slice;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool lr_lex_single_char_token(lr_slice_t *c, c_token_t *token)
+{
+    uint32_t token_type;
+    lr_slice_t token_slice;
+
+    switch (*c->data) {
+    case '(': { token_type = LR_TOKEN_L_PAREN; break; }
+    case ')': { token_type = LR_TOKEN_R_PAREN; break; }
+    case '{': { token_type = LR_TOKEN_L_BRACE; break; }
+    case '}': { token_type = LR_TOKEN_R_BRACE; break; }
+    case '[': { token_type = LR_TOKEN_L_BRACKET; break; }
+    case ']': { token_type = LR_TOKEN_R_BRACKET; break; }
+    case '*': { token_type = LR_TOKEN_ASTERISK; break; }
+    case ',': { token_type = LR_TOKEN_COMMA; break; }
+    case '.': { token_type = LR_TOKEN_PERIOD; break; }
+    case '-': { token_type = LR_TOKEN_MINUS; break; }
+    case '+': { token_type = LR_TOKEN_PLUS; break; }
+    case '!': { token_type = LR_TOKEN_EXCLAMATION; break; }
+    case '~': { token_type = LR_TOKEN_TILDE; break; }
+    case '\\': { token_type = LR_TOKEN_BACKSLASH; break; }
+    case '/': { token_type = LR_TOKEN_SLASH; break; }
+    case '=': { token_type = LR_TOKEN_EQ; break; }
+    case '&': { token_type = LR_TOKEN_AMPERSAND; break; }
+    case '#': { token_type = LR_TOKEN_POUND; break; }
+    case ';': { token_type = LR_TOKEN_SEMICOLON; break; }
+    case ':': { token_type = LR_TOKEN_COLON; break; }
+    case '?': { token_type = LR_TOKEN_QUESTION_MARK; break; }
+    default: { token_type = LR_TOKEN_UNKNOWN; break; }
+    }
+
+    if (token_type != LR_TOKEN_UNKNOWN) {
+        token_slice = lr_slice_l(*c, 1);
+        *c = lr_slice_r(*c, 1);
+        token->type = token_type;
+        token->slice = token_slice;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+c_token_t *lr_lex_file(lr_slice_t s, int32_t *count)
+{
+    int32_t capacity = 64;
+    c_token_t *result = (c_token_t *)malloc(capacity * sizeof(c_token_t));
+    lr_slice_t c = s;
+
+    int32_t i = 0;
+
+    while (true) {
+        if (i >= capacity) {
+            capacity += capacity / 2;
+            result = (c_token_t *)realloc(result, capacity * sizeof(c_token_t));
+        }
+
+        c_token_t *t = &result[i];
+
+        if (!c.len) {
+            t->type = LR_TOKEN_EOF;
+            t->slice = lr_slice_l(c, 0);
+            ++i;
+            break;
+        } else {
+            c = lr_eat_whitespace_and_comments(c);
+
+            if (c.len) {
+                if (lr_lex_single_char_token(&c, t)) {
+                } else if (lr_lex_constant(&c, t)) {
+                } else if (lr_lex_string(&c, t)) {
+                } else if (lr_lex_identifier(&c, t)) {
+                } else {
+                    t->type = LR_TOKEN_UNKNOWN;
+                    t->slice = lr_slice_l(c, 1);
+                    c = lr_slice_r(c, 1);
+                }
+
+                assert(c.len >= 0);
+                ++i;
+            }
+        }
+    }
+
+    *count = i;
+    return result;
+}
+
+lr_slice_t lr_read_file(char *f)
+{
+    FILE *fp = fopen(f, "rb");
+
+    if (!fp)
+        return lr_as_slice(0, 0);
+
+    fseek(fp, 0, SEEK_END);
+    int64_t len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *data = (char *)malloc(len + 1);
+    if (!fread(data, len, 1, fp))
+        return lr_as_slice(0, 0);
+
+    // ensure string result is null-terminated
+    data[len] = 0;
+
+    fclose(fp);
+
+    return lr_as_slice(data, len);
+}
+
+void lr_free_file(lr_slice_t slice)
+{
+    free(slice.data);
+}
+
+bool match_identifier(c_token_t token, char *identifier)
+{
+    if (token.type != LR_TOKEN_IDENTIFIER)
+        return false;
+
+    for (int32_t i = 0; i < token.slice.len; i++)
+        if (!identifier[i] || token.slice.data[i] != identifier[i])
+            return false;
+
+    return !identifier[token.slice.len];
+}
+
+bool match_string(c_token_t token, char *s)
+{
+    if (token.type != LR_TOKEN_STRING)
+        return false;
+
+    for (int32_t i = 1; i < token.slice.len - 1; i++)
+        if (!s[i - 1] || token.slice.data[i] != s[i - 1])
+            return false;
+
+    return !s[token.slice.len - 2];
+}
+
+bool match_labrat_include(c_token_t *ts, int32_t ct, int32_t i)
+{
+#ifdef LR_SELF_TEST
+    return true;
+#else
+    const int32_t include_len = 3;
+    if (i + include_len > ct)
+        return false;
+    return ts[i].type == LR_TOKEN_POUND &&
+           match_identifier(ts[i + 1], "include") &&
+           match_string(ts[i + 2], "labrat.h");
+#endif
+}
+
+// Matches #include "file", setting name to the string with its quotes.
+bool match_include(c_token_t *ts, int32_t ct, int32_t i, c_token_t *name)
+{
+    if (i + 3 > ct)
+        return false;
+    bool result = ts[i].type == LR_TOKEN_POUND &&
+                  match_identifier(ts[i + 1], "include") &&
+                  ts[i + 2].type == LR_TOKEN_STRING;
+
+    if (result)
+        *name = ts[i + 2];
+
+    return result;
+}
+
+// Matches a function definition's name, parameters and opening brace. Names
+// without a lowercase letter are taken to be macros, like TEST_CASE.
+bool match_function_definition(c_token_t *ts, int32_t ct, int32_t i,
+                               c_token_t *name)
+{
+    if (i + 4 > ct || ts[i].type != LR_TOKEN_IDENTIFIER ||
+        ts[i + 1].type != LR_TOKEN_L_PAREN)
+        return false;
+    if (i >= 2 && ts[i - 2].type == LR_TOKEN_POUND &&
+        match_identifier(ts[i - 1], "define"))
+        return false;
+    if (match_identifier(ts[i], "__attribute__") ||
+        match_identifier(ts[i], "__declspec") ||
+        match_identifier(ts[i], "noexcept") ||
+        match_identifier(ts[i], "throw"))
+        return false;
+
+    bool lowercase = false;
+    for (int32_t j = 0; j < ts[i].slice.len; j++)
+        lowercase = lowercase || (ts[i].slice.data[j] >= 'a' &&
+                                  ts[i].slice.data[j] <= 'z');
+    if (!lowercase)
+        return false;
+
+    int32_t depth = 0;
+    int32_t j = i + 1;
+    for (; j < ct; j++) {
+        if (ts[j].type == LR_TOKEN_L_PAREN)
+            depth++;
+        else if (ts[j].type == LR_TOKEN_R_PAREN && --depth == 0)
+            break;
+    }
+    // C++ member functions can have qualifiers after their parameters
+    while (j + 1 < ct && (match_identifier(ts[j + 1], "const") ||
+                          match_identifier(ts[j + 1], "override") ||
+                          match_identifier(ts[j + 1], "final") ||
+                          match_identifier(ts[j + 1], "noexcept")))
+        j++;
+    bool result = j + 1 < ct && ts[j + 1].type == LR_TOKEN_L_BRACE;
+
+    if (result)
+        *name = ts[i];
+
+    return result;
+}
+
+bool match_test_case(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id)
+{
+    const int32_t test_case_len = 4;
+
+    if (i + test_case_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "TEST_CASE") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_test_id__") &&
+                  ts[i + 3].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_benchmark(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id)
+{
+    const int32_t test_case_len = 4;
+
+    if (i + test_case_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "BENCHMARK") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_benchmark_latency(c_token_t *ts, int32_t ct, int32_t i,
+                            c_token_t *id)
+{
+    const int32_t latency_len = 6;
+
+    if (i + latency_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "BENCHMARK_LATENCY") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_benchmark_range(c_token_t *ts, int32_t ct, int32_t i,
+                          c_token_t *id)
+{
+    const int32_t range_len = 8;
+
+    if (i + range_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "BENCHMARK_RANGE") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_COMMA &&
+                  ts[i + 6].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 7].type == LR_TOKEN_COMMA;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_benchmark_threaded(c_token_t *ts, int32_t ct, int32_t i,
+                             c_token_t *id)
+{
+    const int32_t threaded_len = 10;
+
+    if (i + threaded_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "BENCHMARK_THREADED") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_COMMA &&
+                  ts[i + 6].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 7].type == LR_TOKEN_COMMA &&
+                  ts[i + 8].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 9].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_fixture_function(c_token_t *ts, int32_t ct, int32_t i,
+                            char *macro, c_token_t *name)
+{
+    const int32_t fixture_len = 4;
+
+    if (i + fixture_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], macro) &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_fixture_name__") &&
+                  ts[i + 3].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *name = ts[i + 2];
+
+    return result;
+}
+
+bool match_test_case_f(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id,
+                       c_token_t *fixture)
+{
+    const int32_t test_case_len = 6;
+
+    if (i + test_case_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "TEST_CASE_F") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_test_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_R_PAREN;
+
+    if (result) {
+        *id = ts[i + 2];
+        *fixture = ts[i + 4];
+    }
+
+    return result;
+}
+
+bool match_benchmark_f(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id,
+                       c_token_t *fixture)
+{
+    const int32_t benchmark_len = 8;
+
+    if (i + benchmark_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "BENCHMARK_F") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_COMMA &&
+                  ts[i + 6].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 7].type == LR_TOKEN_R_PAREN;
+
+    if (result) {
+        *id = ts[i + 2];
+        *fixture = ts[i + 4];
+    }
+
+    return result;
+}
+
+bool match_test_case_vectors(c_token_t *ts, int32_t ct, int32_t i,
+                             c_token_t *id)
+{
+    const int32_t test_case_len = 4;
+
+    if (i + test_case_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "TEST_CASE_VECTORS") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_test_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+bool match_fuzz_test(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id)
+{
+    const int32_t fuzz_test_len = 8;
+
+    if (i + fuzz_test_len > ct)
+        return false;
+    bool result = match_identifier(ts[i], "FUZZ_TEST") &&
+                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
+                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
+                  !match_identifier(ts[i + 2], "__lr_fuzz_id__") &&
+                  ts[i + 3].type == LR_TOKEN_COMMA &&
+                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 5].type == LR_TOKEN_COMMA &&
+                  ts[i + 6].type == LR_TOKEN_IDENTIFIER &&
+                  ts[i + 7].type == LR_TOKEN_R_PAREN;
+
+    if (result)
+        *id = ts[i + 2];
+
+    return result;
+}
+
+// Every X-macro which may appear in labrat_data.c. Each one defaults to
+// nothing so that consumers only need to define the ones they care about.
+char *lr_definition_kinds[] = {
+    "TEST_DEFINITION",
+    "BENCH_DEFINITION",
+    "BENCH_RANGE_DEFINITION",
+    "BENCH_THREADED_DEFINITION",
+    "BENCH_LATENCY_DEFINITION",
+    "FIXTURE_DEFINITION",
+    "FIXTURE_TEARDOWN_DEFINITION",
+    "TEST_F_DEFINITION",
+    "BENCH_F_DEFINITION",
+    "FUZZ_DEFINITION",
+    "TEST_VECTORS_DEFINITION",
+    "SOURCE_FILE_DEFINITION",
+    "INCLUDE_DEFINITION",
+    "TEST_FILE_DEFINITION",
+    "FUNCTION_DEFINITION",
+};
+
+typedef struct {
+    char *kind;
+    lr_slice_t id;
+    lr_slice_t fixture; // empty unless this is a TEST_CASE_F or BENCHMARK_F
+    int32_t file; // where it's defined, as an index into the source files
+} lr_definition_t;
+
+typedef struct {
+    char *path;
+    lr_slice_t *includes; // quoted #includes, as written
+    int32_t *edges; // the includes which are also source files
+    lr_slice_t *functions; // defined at file scope
+    uint64_t hash; // of its path and tokens, so not whitespace or comments
+    int32_t index; // in the data file, 0 if it isn't there
+    bool missing; // deleted while --watch was running
+} lr_source_file_t;
+
+bool lr_is_test_definition(lr_definition_t *definition)
+{
+    return strcmp(definition->kind, "TEST_DEFINITION") == 0 ||
+           strcmp(definition->kind, "TEST_F_DEFINITION") == 0 ||
+           strcmp(definition->kind, "TEST_VECTORS_DEFINITION") == 0;
+}
+
+// Takes "." and ".." out of a relative path, and makes every separator '/'.
+void lr_normalize_path(char *path, int64_t size)
+{
+    char copy[2048];
+    char *parts[256];
+    int32_t count = 0;
+
+    snprintf(copy, _LR_ARRAY_COUNT(copy), "%s", path);
+    for (char *part = strtok(copy, "/\\"); part; part = strtok(0, "/\\")) {
+        if (strcmp(part, ".") == 0)
+            continue;
+        if (strcmp(part, "..") == 0 && count &&
+            strcmp(parts[count - 1], "..") != 0) {
+            count--;
+            continue;
+        }
+        if (count < _LR_ARRAY_COUNT(parts))
+            parts[count++] = part;
+    }
+
+    int64_t len = 0;
+    path[0] = 0;
+    for (int32_t i = 0; i < count && len < size; i++)
+        len += snprintf(path + len, size - len, "%s%s", i ? "/" : "",
+                        parts[i]);
+}
+
+// Looks next to the including file first, as the preprocessor does, and
+// then for any file the name could reach through an include path.
+int32_t lr_resolve_include(lr_source_file_t *files, int32_t from,
+                           lr_slice_t name)
+{
+    char path[2048];
+    char const *dir_end = strrchr(files[from].path, '/');
+    int32_t dir_len = dir_end ? (int32_t)(dir_end - files[from].path) + 1 : 0;
+    snprintf(path, _LR_ARRAY_COUNT(path), "%.*s%.*s", dir_len,
+             files[from].path, (int32_t)name.len, name.data);
+    lr_normalize_path(path, _LR_ARRAY_COUNT(path));
+
+    for (int32_t i = 0; i < lr_sb_count(files); i++)
+        if (!files[i].missing && strcmp(files[i].path, path) == 0)
+            return i;
+
+    snprintf(path, _LR_ARRAY_COUNT(path), "%.*s", (int32_t)name.len,
+             name.data);
+    lr_normalize_path(path, _LR_ARRAY_COUNT(path));
+    int64_t len = strlen(path);
+    for (int32_t i = 0; i < lr_sb_count(files); i++) {
+        int64_t file_len = strlen(files[i].path);
+        if (!files[i].missing && file_len > len &&
+            files[i].path[file_len - len - 1] == '/' &&
+            strcmp(files[i].path + file_len - len, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Numbers the files which hold tests or define functions, and everything
+// they include, from 1. The rest are left at 0 and out of the data file.
+int32_t lr_index_source_files(lr_source_file_t *files,
+                              lr_definition_t *definitions)
+{
+    int32_t *queue = 0;
+    int32_t count = 0;
+
+    for (int64_t i = 0; i < lr_sb_count(files); i++)
+        files[i].index = 0;
+    for (int64_t i = 0; i < lr_sb_count(definitions); i++) {
+        int32_t file = definitions[i].file;
+        if (lr_is_test_definition(&definitions[i]) && !files[file].index) {
+            files[file].index = ++count;
+            lr_sb_push(queue, file);
+        }
+    }
+    for (int32_t i = 0; i < lr_sb_count(files); i++) {
+        if (lr_sb_count(files[i].functions) && !files[i].index) {
+            files[i].index = ++count;
+            lr_sb_push(queue, i);
+        }
+    }
+
+    for (int64_t i = 0; i < lr_sb_count(queue); i++) {
+        lr_source_file_t *file = &files[queue[i]];
+        for (int64_t j = 0; j < lr_sb_count(file->edges); j++) {
+            int32_t to = file->edges[j];
+            if (!files[to].index) {
+                files[to].index = ++count;
+                lr_sb_push(queue, to);
+            }
+        }
+    }
 
-    // ensure string result is null-terminated
-    data[len] = 0;
+    lr_sb_free(queue);
+    return count;
+}
 
-    fclose(fp);
+// A file's hash and those of everything it includes, however indirectly,
+// summed so that the order they're found in doesn't matter.
+uint64_t lr_transitive_hash(lr_source_file_t *files, int32_t file)
+{
+    bool *seen = (bool *)calloc(lr_sb_count(files), sizeof(bool));
+    int32_t *queue = 0;
+    uint64_t hash = 0;
+
+    seen[file] = true;
+    lr_sb_push(queue, file);
+    for (int64_t i = 0; i < lr_sb_count(queue); i++) {
+        lr_source_file_t *from = &files[queue[i]];
+        hash += from->hash;
+        for (int64_t j = 0; j < lr_sb_count(from->edges); j++) {
+            if (!seen[from->edges[j]]) {
+                seen[from->edges[j]] = true;
+                lr_sb_push(queue, from->edges[j]);
+            }
+        }
+    }
 
-    return lr_as_slice(data, len);
+    lr_sb_free(queue);
+    free(seen);
+    return hash;
 }
 
-void lr_free_file(lr_slice_t slice)
+// Appends to a stretchy buffer of chars, which stays null-terminated.
+void lr_sb_printf(char **buffer, char const *format, ...)
 {
-    free(slice.data);
+    va_list args;
+    va_start(args, format);
+    int32_t len = vsnprintf(0, 0, format, args);
+    va_end(args);
+
+    char *end = lr_sb_add(*buffer, len + 1);
+    va_start(args, format);
+    vsnprintf(end, len + 1, format, args);
+    va_end(args);
+    lr__sbn(*buffer)--;
 }
 
-bool match_identifier(c_token_t token, char *identifier)
+void lr_sb_print_path(char **buffer, char const *path)
 {
-    if (token.type != LR_TOKEN_IDENTIFIER)
-        return false;
-
-    for (int32_t i = 0; i < token.slice.len; i++)
-        if (!identifier[i] || token.slice.data[i] != identifier[i])
-            return false;
-
-    return !identifier[token.slice.len];
+    lr_sb_printf(buffer, "\"");
+    for (char const *c = path; *c; c++)
+        lr_sb_printf(buffer, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    lr_sb_printf(buffer, "\"");
 }
 
-bool match_string(c_token_t token, char *s)
+// Leaves a file which already says the same thing alone, so that builds
+// which go by modification times don't recompile what includes it. Returns
+// whether it wrote anything.
+bool lr_write_if_changed(char const *path, char *buffer)
 {
-    if (token.type != LR_TOKEN_STRING)
+    char dir[2048];
+    int64_t len = lr_sb_count(buffer);
+    snprintf(dir, _LR_ARRAY_COUNT(dir), "%s", path);
+    lr_slice_t old = lr_read_file(dir);
+    bool same = old.data && old.len == len &&
+                memcmp(old.data, buffer, len) == 0;
+    lr_free_file(old);
+    if (same)
         return false;
 
-    for (int32_t i = 1; i < token.slice.len - 1; i++)
-        if (!s[i - 1] || token.slice.data[i] != s[i - 1])
-            return false;
+    // make the directories on the way
+    for (char *c = dir; *c; c++) {
+        if (*c == '/') {
+            *c = 0;
+            _lr_make_directory(dir);
+            *c = '/';
+        }
+    }
 
-    return !s[token.slice.len - 2];
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        printf("LABRAT: Failed to write %s\n", path);
+        return false;
+    }
+    fwrite(buffer, 1, len, fp);
+    fclose(fp);
+    return true;
 }
 
-bool match_labrat_include(c_token_t *ts, int32_t ct, int32_t i)
+// The length of the directory part of a path, without the last '/'.
+int32_t lr_dir_len(char const *path)
 {
-#ifdef LR_SELF_TEST
-    return true;
-#else
-    const int32_t include_len = 3;
-    if (i + include_len > ct)
-        return false;
-    return ts[i].type == LR_TOKEN_POUND &&
-           match_identifier(ts[i + 1], "include") &&
-           match_string(ts[i + 2], "labrat.h");
-#endif
+    char const *slash = strrchr(path, '/');
+    return slash ? (int32_t)(slash - path) : 0;
 }
 
-bool match_test_case(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id)
+bool lr_in_dir(char const *path, char const *dir, int32_t dir_len)
 {
-    const int32_t test_case_len = 4;
-
-    if (i + test_case_len > ct)
-        return false;
-    bool result = match_identifier(ts[i], "TEST_CASE") &&
-                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
-                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
-                  !match_identifier(ts[i + 2], "__lr_test_id__") &&
-                  ts[i + 3].type == LR_TOKEN_R_PAREN;
-
-    if (result)
-        *id = ts[i + 2];
+    return lr_dir_len(path) == dir_len && strncmp(path, dir, dir_len) == 0;
+}
 
-    return result;
+int lr_compare_strings(void const *a, void const *b)
+{
+    return strcmp(*(char const **)a, *(char const **)b);
 }
 
-bool match_benchmark(c_token_t *ts, int32_t ct, int32_t i, c_token_t *id)
+// Everything labrat found in the files of one directory, written to a shard
+// under labrat_data/ which mirrors the tree. Files are referred to by path, so
+// a shard only changes when something in its directory does.
+bool lr_write_shard(lr_definition_t *definitions, lr_source_file_t *files,
+                    char const *dir, int32_t dir_len, char const *shard_path)
 {
-    const int32_t test_case_len = 4;
+    char *buffer = 0;
 
-    if (i + test_case_len > ct)
-        return false;
-    bool result = match_identifier(ts[i], "BENCHMARK") &&
-                  ts[i + 1].type == LR_TOKEN_L_PAREN &&
-                  ts[i + 2].type == LR_TOKEN_IDENTIFIER &&
-                  !match_identifier(ts[i + 2], "__lr_bench_id__") &&
-                  ts[i + 3].type == LR_TOKEN_COMMA &&
-                  ts[i + 4].type == LR_TOKEN_IDENTIFIER &&
-                  ts[i + 5].type == LR_TOKEN_R_PAREN;
+    for (int64_t i = 0; i < lr_sb_count(definitions); i++) {
+        lr_definition_t *definition = &definitions[i];
+        if (!lr_in_dir(files[definition->file].path, dir, dir_len))
+            continue;
+        lr_sb_printf(&buffer, "%s(%.*s", definition->kind,
+                     (int32_t)definition->id.len, definition->id.data);
+        if (definition->fixture.len)
+            lr_sb_printf(&buffer, ", %.*s", (int32_t)definition->fixture.len,
+                         definition->fixture.data);
+        lr_sb_printf(&buffer, ")\n");
+    }
 
-    if (result)
-        *id = ts[i + 2];
+    // the include graph of the tests' files and where every function is,
+    // for --lr-changed-since, and what a test's result depends on, for the
+    // result cache
+    for (int32_t i = 0; i < lr_sb_count(files); i++) {
+        lr_source_file_t *file = &files[i];
+        if (!file->index || !lr_in_dir(file->path, dir, dir_len))
+            continue;
 
-    return result;
+        lr_sb_printf(&buffer, "SOURCE_FILE_DEFINITION(");
+        lr_sb_print_path(&buffer, file->path);
+        lr_sb_printf(&buffer, ", 0x%016" PRIx64 "ull)\n",
+                     lr_transitive_hash(files, i));
+        for (int64_t j = 0; j < lr_sb_count(file->edges); j++) {
+            lr_sb_printf(&buffer, "INCLUDE_DEFINITION(");
+            lr_sb_print_path(&buffer, file->path);
+            lr_sb_printf(&buffer, ", ");
+            lr_sb_print_path(&buffer, files[file->edges[j]].path);
+            lr_sb_printf(&buffer, ")\n");
+        }
+        for (int64_t j = 0; j < lr_sb_count(file->functions); j++) {
+            lr_sb_printf(&buffer, "FUNCTION_DEFINITION(%.*s, ",
+                         (int32_t)file->functions[j].len,
+                         file->functions[j].data);
+            lr_sb_print_path(&buffer, file->path);
+            lr_sb_printf(&buffer, ")\n");
+        }
+    }
+    for (int64_t i = 0; i < lr_sb_count(definitions); i++) {
+        lr_definition_t *definition = &definitions[i];
+        if (!lr_is_test_definition(definition) ||
+            !lr_in_dir(files[definition->file].path, dir, dir_len))
+            continue;
+        lr_sb_printf(&buffer, "TEST_FILE_DEFINITION(%.*s, ",
+                     (int32_t)definition->id.len, definition->id.data);
+        lr_sb_print_path(&buffer, files[definition->file].path);
+        lr_sb_printf(&buffer, ")\n");
+    }
+
+    bool written = lr_write_if_changed(shard_path, buffer);
+    lr_sb_free(buffer);
+    return written;
 }
 
-void lr_write_data_header(lr_slice_t *tests, lr_slice_t *benchmarks)
+// labrat_data.c itself only includes the shards, and is only included by the
+// translation unit which defines LR_IMPLEMENTATION. Returns whether any of it
+// changed.
+bool lr_write_data_header(lr_definition_t *definitions,
+                          lr_source_file_t *files)
 {
-    FILE *fp = fopen("./labrat_data.c", "wb");
+    bool written = false;
+    lr_index_source_files(files, definitions);
 
-    fprintf(fp,
-            "#ifndef TEST_DEFINITION\n"
-            "#define TEST_DEFINITION(id)\n"
-            "#endif\n"
-            "#ifndef BENCH_DEFINITION\n"
-            "#define BENCH_DEFINITION(id)\n"
-            "#endif\n");
+    // every directory with something to say, in order
+    bool *listed = (bool *)calloc(lr_sb_count(files) + 1, sizeof(bool));
+    for (int64_t i = 0; i < lr_sb_count(definitions); i++)
+        listed[definitions[i].file] = true;
+
+    char **dirs = 0;
+    for (int64_t i = 0; i < lr_sb_count(files); i++) {
+        if (!listed[i] && !files[i].index)
+            continue;
 
-    for (int64_t i = 0; i < lr_sb_count(tests); i++) {
-        fprintf(fp, "TEST_DEFINITION(%.*s)\n",
-                (int32_t)tests[i].len,
-                tests[i].data);
+        int32_t dir_len = lr_dir_len(files[i].path);
+        bool seen = false;
+        for (int64_t j = 0; !seen && j < lr_sb_count(dirs); j++)
+            seen = lr_in_dir(files[i].path, dirs[j], (int32_t)strlen(dirs[j]));
+        if (!seen) {
+            char *dir = (char *)malloc(dir_len + 1);
+            memcpy(dir, files[i].path, dir_len);
+            dir[dir_len] = 0;
+            lr_sb_push(dirs, dir);
+        }
+    }
+    qsort(dirs, lr_sb_count(dirs), sizeof(char *), lr_compare_strings);
+
+    char *buffer = 0;
+    for (int64_t i = 0; i < _LR_ARRAY_COUNT(lr_definition_kinds); i++) {
+        lr_sb_printf(&buffer,
+                     "#ifndef %s\n"
+                     "#define %s(...)\n"
+                     "#endif\n",
+                     lr_definition_kinds[i],
+                     lr_definition_kinds[i]);
     }
 
-    for (int64_t i = 0; i < lr_sb_count(benchmarks); i++) {
-        fprintf(fp, "BENCH_DEFINITION(%.*s)\n",
-                (int32_t)benchmarks[i].len,
-                benchmarks[i].data);
+    for (int64_t i = 0; i < lr_sb_count(dirs); i++) {
+        char shard_path[2048];
+        snprintf(shard_path, _LR_ARRAY_COUNT(shard_path),
+                 "labrat_data/%s%sshard.c", dirs[i], dirs[i][0] ? "/" : "");
+        written |= lr_write_shard(definitions, files, dirs[i],
+                                  (int32_t)strlen(dirs[i]), shard_path);
+        lr_sb_printf(&buffer, "#include ");
+        lr_sb_print_path(&buffer, shard_path);
+        lr_sb_printf(&buffer, "\n");
+        free(dirs[i]);
     }
 
-    fprintf(fp,
-            "#undef TEST_DEFINITION\n"
-            "#undef BENCH_DEFINITION\n");
+    for (int64_t i = 0; i < _LR_ARRAY_COUNT(lr_definition_kinds); i++)
+        lr_sb_printf(&buffer, "#undef %s\n", lr_definition_kinds[i]);
 
-    fclose(fp);
+    written |= lr_write_if_changed("labrat_data.c", buffer);
+    lr_sb_free(buffer);
+    lr_sb_free(dirs);
+    free(listed);
+    return written;
 }
 
 bool should_exclude_file(char *filename)
 {
+    // what labrat wrote last time
+    if (strncmp(filename, "./labrat_data/", 14) == 0 ||
+        strcmp(filename, "./labrat_data.c") == 0)
+        return true;
+
 #ifdef LR_SELF_TEST
     if (strcmp(_LR_DIR(filename), _LR_FILENAME) != 0)
         return true;
@@ -1188,50 +7333,449 @@ bool should_exclude_file(char *filename)
     return false;
 }
 
+// Lexes the file at source->path, filling in source, and appends what it
+// defines to definitions as being in the file numbered file.
+bool lr_scan_file(lr_source_file_t *source, int32_t file,
+                  lr_definition_t **definitions)
+{
+    lr_slice_t filedata = lr_read_file(source->path);
+    if (!filedata.data)
+        return false;
+
+    int32_t token_count;
+    c_token_t *tokens = lr_lex_file(filedata, &token_count);
+
+    source->hash = _lr_hash(source->path, strlen(source->path),
+                            _LR_HASH_SEED);
+    for (int32_t j = 0; j < token_count; j++) {
+        source->hash = _lr_hash(&tokens[j].type, sizeof(tokens[j].type),
+                                source->hash);
+        source->hash = _lr_hash(tokens[j].slice.data, tokens[j].slice.len,
+                                source->hash);
+    }
+
+    // braces opened by extern "C" and namespaces leave us at file scope
+    bool scope_braces[256];
+    int32_t brace_count = 0;
+    int32_t depth = 0;
+
+    bool lr_included = false;
+    for (int32_t j = 0; j < token_count; j++) {
+        c_token_t token = tokens[j];
+        c_token_t include;
+        c_token_t function;
+
+        if (!depth && match_function_definition(tokens, token_count, j,
+                                                &function))
+            lr_sb_push(source->functions, lr_copy_slice(function.slice));
+        if (token.type == LR_TOKEN_L_BRACE) {
+            bool scope = (j >= 2 && tokens[j - 1].type == LR_TOKEN_STRING &&
+                          match_identifier(tokens[j - 2], "extern")) ||
+                         (j >= 1 && match_identifier(tokens[j - 1],
+                                                     "namespace")) ||
+                         (j >= 2 && match_identifier(tokens[j - 2],
+                                                     "namespace"));
+            if (brace_count < _LR_ARRAY_COUNT(scope_braces))
+                scope_braces[brace_count++] = scope;
+            if (!scope)
+                depth++;
+        } else if (token.type == LR_TOKEN_R_BRACE && brace_count) {
+            if (!scope_braces[--brace_count])
+                depth--;
+        }
+
+        lr_included = lr_included || match_labrat_include(tokens,
+                                                          token_count, j);
+        if (match_include(tokens, token_count, j, &include)) {
+            lr_slice_t name = { include.slice.len - 2,
+                                include.slice.data + 1 };
+            lr_sb_push(source->includes, lr_copy_slice(name));
+        }
+
+        if (lr_included) {
+            c_token_t identifier;
+            c_token_t fixture;
+            lr_definition_t definition = { 0 };
+            if (match_test_case(tokens, token_count, j, &identifier))
+                definition.kind = "TEST_DEFINITION";
+            else if (match_benchmark(tokens, token_count, j, &identifier))
+                definition.kind = "BENCH_DEFINITION";
+            else if (match_benchmark_range(tokens, token_count, j,
+                                           &identifier))
+                definition.kind = "BENCH_RANGE_DEFINITION";
+            else if (match_benchmark_threaded(tokens, token_count, j,
+                                              &identifier))
+                definition.kind = "BENCH_THREADED_DEFINITION";
+            else if (match_benchmark_latency(tokens, token_count, j,
+                                             &identifier))
+                definition.kind = "BENCH_LATENCY_DEFINITION";
+            else if (match_fixture_function(tokens, token_count, j,
+                                            "FIXTURE_SETUP", &identifier))
+                definition.kind = "FIXTURE_DEFINITION";
+            else if (match_fixture_function(tokens, token_count, j,
+                                            "FIXTURE_TEARDOWN",
+                                            &identifier))
+                definition.kind = "FIXTURE_TEARDOWN_DEFINITION";
+            else if (match_test_case_f(tokens, token_count, j,
+                                       &identifier, &fixture))
+                definition.kind = "TEST_F_DEFINITION";
+            else if (match_benchmark_f(tokens, token_count, j,
+                                       &identifier, &fixture))
+                definition.kind = "BENCH_F_DEFINITION";
+            else if (match_fuzz_test(tokens, token_count, j, &identifier))
+                definition.kind = "FUZZ_DEFINITION";
+            else if (match_test_case_vectors(tokens, token_count, j,
+                                             &identifier))
+                definition.kind = "TEST_VECTORS_DEFINITION";
+
+            if (definition.kind) {
+                definition.file = file;
+                definition.id = lr_copy_slice(identifier.slice);
+                if (strcmp(definition.kind, "TEST_F_DEFINITION") == 0 ||
+                    strcmp(definition.kind, "BENCH_F_DEFINITION") == 0)
+                    definition.fixture = lr_copy_slice(fixture.slice);
+                lr_sb_push(*definitions, definition);
+            }
+        }
+    }
+
+    free(tokens);
+    lr_free_file(filedata);
+    return true;
+}
+
+char *lr_source_path(char const *filename)
+{
+    int64_t path_size = strlen(filename) + 1;
+    char *path = (char *)malloc(path_size);
+    memcpy(path, filename, path_size);
+    lr_normalize_path(path, path_size);
+    return path;
+}
+
+void lr_resolve_includes(lr_source_file_t *sources, int32_t i)
+{
+    lr_sb_free(sources[i].edges);
+    sources[i].edges = 0;
+    for (int64_t j = 0; j < lr_sb_count(sources[i].includes); j++) {
+        int32_t to = lr_resolve_include(sources, i, sources[i].includes[j]);
+        if (to >= 0 && to != i)
+            lr_sb_push(sources[i].edges, to);
+    }
+}
+
+// Scans a file again, or forgets what it said if it's gone, keeping the
+// definitions in the order of their files so that the shards come out the
+// same as a fresh run would write them.
+void lr_rescan_file(lr_source_file_t *sources, int32_t file,
+                    lr_definition_t **definitions)
+{
+    lr_source_file_t *source = &sources[file];
+    for (int64_t i = 0; i < lr_sb_count(source->includes); i++)
+        free(source->includes[i].data);
+    for (int64_t i = 0; i < lr_sb_count(source->functions); i++)
+        free(source->functions[i].data);
+    lr_sb_free(source->includes);
+    lr_sb_free(source->functions);
+    source->includes = 0;
+    source->functions = 0;
+
+    lr_definition_t *fresh = 0;
+    source->missing = !lr_scan_file(source, file, &fresh);
+
+    lr_definition_t *merged = 0;
+    bool placed = false;
+    for (int64_t i = 0; i < lr_sb_count(*definitions); i++) {
+        lr_definition_t *definition = &(*definitions)[i];
+        if (definition->file == file) {
+            free(definition->id.data);
+            free(definition->fixture.data);
+            continue;
+        }
+        if (!placed && definition->file > file) {
+            for (int64_t j = 0; j < lr_sb_count(fresh); j++)
+                lr_sb_push(merged, fresh[j]);
+            placed = true;
+        }
+        lr_sb_push(merged, *definition);
+    }
+    for (int64_t j = 0; !placed && j < lr_sb_count(fresh); j++)
+        lr_sb_push(merged, fresh[j]);
+
+    lr_sb_free(fresh);
+    lr_sb_free(*definitions);
+    *definitions = merged;
+}
+
+/******************************************************************************/
+////////////////////////////////// Watch mode //////////////////////////////////
+/******************************************************************************/
+// labrat --watch keeps what it found in memory and has inotify say which
+// files change. It scans only those again, and rewrites the shards they're
+// in. With --watch-run, a command runs whenever the data changes, and
+// labrat_watch.stamp is left at the time the command last started, so the
+// command can pass it to --lr-changed-since to run only what was affected.
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define LR_WATCH_STAMP "labrat_watch.stamp"
+#define LR_WATCH_NEXT_STAMP "labrat_watch.next"
+
+typedef struct {
+    int wd;
+    char *dir; // as lr_get_directory would name it, starting with "."
+} lr_watch_t;
+
+// Watches dir and every directory under it, except what labrat writes and
+// hidden ones like .git, which change all the time for other reasons.
+void lr_watch_tree(int fd, lr_watch_t **watches, char const *dir)
+{
+    int wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                        IN_MOVED_FROM | IN_CREATE |
+                                        IN_DELETE);
+    if (wd < 0) {
+        printf("LABRAT: Failed to watch %s\n", dir);
+        return;
+    }
+
+    int64_t size = strlen(dir) + 1;
+    lr_watch_t watch = { wd, (char *)malloc(size) };
+    memcpy(watch.dir, dir, size);
+    lr_sb_push(*watches, watch);
+
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d))) {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.' ||
+            (strcmp(dir, ".") == 0 &&
+             strcmp(entry->d_name, "labrat_data") == 0))
+            continue;
+        char path[2048];
+        snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir, entry->d_name);
+        lr_watch_tree(fd, watches, path);
+    }
+    if (d)
+        closedir(d);
+}
+
+bool lr_is_watched_file(char const *path)
+{
+    char const *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    return !should_exclude_file((char *)path) &&
+           strncmp(name, "labrat_watch.", 13) != 0;
+}
+
+void lr_push_unique(char ***paths, char const *path)
+{
+    for (int64_t i = 0; i < lr_sb_count(*paths); i++)
+        if (strcmp((*paths)[i], path) == 0)
+            return;
+
+    int64_t size = strlen(path) + 1;
+    char *copy = (char *)malloc(size);
+    memcpy(copy, path, size);
+    lr_sb_push(*paths, copy);
+}
+
+// Blocks until something changes, then collects everything else which
+// changes in quick succession, since an editor's save is several events.
+char **lr_wait_for_changes(int fd, lr_watch_t **watches)
+{
+    char **changed = 0;
+    char buffer[64 * 1024]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    for (;;) {
+        int ready = poll(&pfd, 1, lr_sb_count(changed) ? 20 : -1);
+        if (ready == 0 && lr_sb_count(changed))
+            break;
+        if (ready <= 0)
+            continue;
+
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        for (char *c = buffer; len > 0 && c < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)c;
+            c += sizeof(struct inotify_event) + event->len;
+
+            char const *dir = 0;
+            for (int64_t i = 0; i < lr_sb_count(*watches); i++)
+                if ((*watches)[i].wd == event->wd)
+                    dir = (*watches)[i].dir;
+            if (!dir || !event->len || event->name[0] == '.')
+                continue;
+
+            char path[2048];
+            snprintf(path, _LR_ARRAY_COUNT(path), "%s/%s", dir, event->name);
+            if ((event->mask & IN_ISDIR) &&
+                (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                // files can land in it before the watch does
+                lr_watch_tree(fd, watches, path);
+                int64_t count;
+                char **files = lr_get_directory(path, &count);
+                for (int64_t i = 0; i < count; i++) {
+                    if (lr_is_watched_file(files[i]))
+                        lr_push_unique(&changed, files[i]);
+                    free(files[i]);
+                }
+                lr_sb_free(files);
+            } else if (!(event->mask & IN_ISDIR) && lr_is_watched_file(path)) {
+                lr_push_unique(&changed, path);
+            }
+        }
+    }
+    return changed;
+}
+
+void lr_touch(char const *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp)
+        fclose(fp);
+}
+
+int32_t lr_watch(lr_source_file_t **sources, lr_definition_t **definitions,
+                 char const *run)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        printf("LABRAT: Failed to start inotify\n");
+        return 1;
+    }
+
+    lr_watch_t *watches = 0;
+    lr_watch_tree(fd, &watches, ".");
+    if (run)
+        lr_touch(LR_WATCH_STAMP);
+    printf("\nWatching %d directories for changes\n",
+           (int32_t)lr_sb_count(watches));
+
+    for (;;) {
+        char **changed = lr_wait_for_changes(fd, &watches);
+        double start = _lr_wall_time();
+
+        // a file appearing or going can change what the others include
+        bool appeared_or_went = false;
+        int32_t *scanned = 0;
+        for (int64_t i = 0; i < lr_sb_count(changed); i++) {
+            char *path = lr_source_path(changed[i]);
+            int32_t file = -1;
+            for (int32_t j = 0; file < 0 && j < lr_sb_count(*sources); j++)
+                if (strcmp((*sources)[j].path, path) == 0)
+                    file = j;
+
+            if (file < 0) {
+                lr_source_file_t source = { 0 };
+                source.path = path;
+                source.missing = true;
+                lr_sb_push(*sources, source);
+                file = (int32_t)lr_sb_count(*sources) - 1;
+            } else {
+                free(path);
+            }
+
+            bool was_missing = (*sources)[file].missing;
+            lr_rescan_file(*sources, file, definitions);
+            appeared_or_went |= was_missing != (*sources)[file].missing;
+            lr_sb_push(scanned, file);
+            free(changed[i]);
+        }
+        lr_sb_free(changed);
+
+        if (appeared_or_went) {
+            for (int32_t i = 0; i < lr_sb_count(*sources); i++)
+                lr_resolve_includes(*sources, i);
+        } else {
+            for (int64_t i = 0; i < lr_sb_count(scanned); i++)
+                lr_resolve_includes(*sources, scanned[i]);
+        }
+        bool written = lr_write_data_header(*definitions, *sources);
+        if (written)
+            printf("Scanned %d changed files and rewrote the test data in "
+                   "%.1f ms\n", (int32_t)lr_sb_count(scanned),
+                   (_lr_wall_time() - start) * 1000.0);
+        lr_sb_free(scanned);
+
+        // the stamp moves up to when the command started, so that anything
+        // saved while it runs counts as changed next time
+        if (written && run) {
+            lr_touch(LR_WATCH_NEXT_STAMP);
+            fflush(stdout);
+            int status = system(run);
+            rename(LR_WATCH_NEXT_STAMP, LR_WATCH_STAMP);
+            printf("\n%s exited with %d\n", run, status);
+        }
+        fflush(stdout);
+    }
+}
+#else
+int32_t lr_watch(lr_source_file_t **sources, lr_definition_t **definitions,
+                 char const *run)
+{
+    printf("LABRAT: --watch needs inotify, which only Linux has\n");
+    return 1;
+}
+#endif
+/******************************************************************************/
+////////////////////////////////////////////////////////////////////////////////
+/******************************************************************************/
 int32_t main(int argc, char const *argv[])
 {
+#ifdef LR_SELF_TEST
+    // the self-test is rerun as often as labrat.h changes, so it never skips
+    // the tests which passed last time
+    __lr_test_options.no_cache = true;
+    if (!_lr_parse_test_options(argc - 1, argv + 1))
+        return 1;
+#else
+    bool watch = false;
+    char const *watch_run = 0;
+    for (int32_t i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        } else if (strcmp(argv[i], "--watch-run") == 0 && i + 1 < argc) {
+            watch = true;
+            watch_run = argv[++i];
+        } else {
+            printf("LABRAT: Unrecognized option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+#endif
+
     int64_t file_count;
     char **files = lr_get_directory(".", &file_count);
-    lr_slice_t *tests = 0;
-    lr_slice_t *benchmarks = 0;
+    lr_definition_t *definitions = 0;
+    lr_source_file_t *sources = 0;
 
     for (int32_t i = 0; i < file_count; i++) {
         if (should_exclude_file(files[i]))
             continue;
         puts(files[i]);
 
-        lr_slice_t filedata = lr_read_file(files[i]);
-        if (!filedata.data) {
+        lr_source_file_t source = { 0 };
+        source.path = lr_source_path(files[i]);
+        if (!lr_scan_file(&source, (int32_t)lr_sb_count(sources),
+                          &definitions)) {
             printf("LABRAT: Failed to read file: %s\n", files[i]);
+            free(source.path);
             continue;
         }
-
-        int32_t token_count;
-        c_token_t *tokens = lr_lex_file(filedata, &token_count);
-
-        bool lr_included = false;
-        for (int32_t j = 0; j < token_count; j++) {
-            c_token_t token = tokens[j];
-
-            lr_included = lr_included || match_labrat_include(tokens,
-                                                              token_count, j);
-
-            if (lr_included) {
-                c_token_t identifier;
-                if (match_test_case(tokens, token_count, j, &identifier))
-                    lr_sb_push(tests, lr_copy_slice(identifier.slice));
-                else if (match_benchmark(tokens, token_count, j, &identifier))
-                    lr_sb_push(benchmarks, lr_copy_slice(identifier.slice));
-            }
-        }
-
-        lr_free_file(filedata);
+        lr_sb_push(sources, source);
     }
 
-    lr_write_data_header(tests, benchmarks);
+    for (int32_t i = 0; i < lr_sb_count(sources); i++)
+        lr_resolve_includes(sources, i);
+
+    lr_write_data_header(definitions, sources);
 
 #ifdef LR_SELF_TEST
     lr_run_tests();
+#else
+    if (watch)
+        return lr_watch(&sources, &definitions, watch_run);
 #endif
 
     return 0;
@@ -1301,6 +7845,364 @@ TEST_CASE(this_should_fail_lt) {
     ASSERT_LT(actual, compare_to, "%d");
 }
 
+// Build with optimizations on to check that this doesn't get deleted
+TEST_CASE(this_should_pass_do_not_optimize) {
+    const int32_t iterations = 1000000;
+    uint32_t value = 1;
+
+    // value isn't used after the loop, so without the barrier an optimized
+    // build drops the whole loop. Kept, the chain of dependent multiplies
+    // takes a few cycles an iteration, and even with turbo the TSC doesn't
+    // tick anywhere near 8 times slower than the core.
+    uint64_t start = _LR_GETCYCLES();
+    for (int32_t i = 0; i < iterations; i++) {
+        value = value * 3 + 1;
+        LR_DO_NOT_OPTIMIZE(value);
+    }
+    uint64_t end = _LR_GETCYCLES();
+
+    ASSERT_TRUE(end - start >= (uint64_t)iterations / 8);
+}
+
+FIXTURE(lr_self_test_fixture) {
+    int32_t value;
+};
+
+FIXTURE_SETUP(lr_self_test_fixture) {
+    fixture->value = 42;
+}
+
+TEST_CASE_F(this_should_pass_fixture, lr_self_test_fixture) {
+    ASSERT_EQ(fixture->value, 42, "%d");
+}
+
+// the runner is only compiled into the self-test build
+#ifdef LR_SELF_TEST
+TEST_CASE(this_should_pass_histogram_buckets) {
+    uint64_t values[] = { 0, 1, 63, 64, 1000, 123456789, 1ull << 62,
+                          1ull << 63, UINT64_MAX };
+
+    for (int32_t i = 0; i < _LR_ARRAY_COUNT(values); i++) {
+        int32_t bucket = _lr_histogram_bucket(values[i]);
+        uint64_t value = _lr_histogram_bucket_value(bucket);
+
+        ASSERT_TRUE(bucket < _LR_HISTOGRAM_BUCKETS);
+        ASSERT_TRUE(_lr_abs((double)value - (double)values[i]) <=
+                    values[i] / 32.0 + 1);
+    }
+}
+
+TEST_CASE(this_should_pass_range_sizes) {
+    int64_t range[3] = { 8, 100, 8 };
+    ASSERT_TRUE(_lr_check_range("range", range));
+    ASSERT_EQ(_lr_next_range_size(range, 8), 64, "%" PRId64);
+    ASSERT_EQ(_lr_next_range_size(range, 64), 100, "%" PRId64);
+    ASSERT_EQ(_lr_next_range_size(range, 100), -1, "%" PRId64);
+
+    // 0 * mult never gets anywhere
+    int64_t from_zero[3] = { 0, 100, 8 };
+    ASSERT_FALSE(_lr_check_range("from_zero", from_zero));
+    int64_t negative[3] = { -1, 100, 8 };
+    ASSERT_FALSE(_lr_check_range("negative", negative));
+}
+
+TEST_CASE(this_should_pass_complexity_regression) {
+    double ns[6] = { 8, 16, 32, 64, 128, 256 };
+    double linear[6];
+    double squared[6];
+    for (int32_t i = 0; i < 6; i++) {
+        // a little noise that leans towards n log n
+        linear[i] = 100 * ns[i] * (i == 0 ? 0.93 : i == 5 ? 1.04 : 1);
+        squared[i] = ns[i] * ns[i];
+    }
+
+    double before_rms;
+    double after_rms;
+    ASSERT_FALSE(_lr_complexity_regressed(ns, linear, 6, LR_COMPLEXITY_N,
+                                          LR_COMPLEXITY_N_LOG_N, &before_rms,
+                                          &after_rms));
+    ASSERT_TRUE(before_rms < _LR_COMPLEXITY_MAX_RMS);
+    ASSERT_TRUE(_lr_complexity_regressed(ns, squared, 6, LR_COMPLEXITY_N,
+                                         LR_COMPLEXITY_N_SQUARED, &before_rms,
+                                         &after_rms));
+    ASSERT_TRUE(after_rms < 0.01);
+}
+#endif
+
+#ifdef LR_SELF_TEST
+TEST_CASE(this_should_pass_bench_filters) {
+    ASSERT_TRUE(_lr_pattern_match("bench_*", "bench_add"));
+    ASSERT_TRUE(_lr_pattern_match("bench_a?d", "bench_add"));
+    ASSERT_TRUE(!_lr_pattern_match("add", "bench_add"));
+    ASSERT_TRUE(_lr_pattern_match("add$", "bench_add"));
+    ASSERT_TRUE(_lr_pattern_match("^bench.*d$", "bench_add"));
+    ASSERT_TRUE(!_lr_pattern_match("^add", "bench_add"));
+
+    __lr_bench_options.filters[0] = "bench_*,-*_slow";
+    __lr_bench_options.filter_count = 1;
+    ASSERT_TRUE(_lr_bench_selected("bench_add"));
+    ASSERT_TRUE(!_lr_bench_selected("bench_add_slow"));
+    ASSERT_TRUE(!_lr_bench_selected("other"));
+
+    __lr_bench_options.filters[0] = "-*_slow";
+    ASSERT_TRUE(_lr_bench_selected("other"));
+    __lr_bench_options.filter_count = 0;
+}
+#endif
+
+#if defined(LR_SELF_TEST) && !defined(_WIN32)
+TEST_CASE(this_should_pass_fuzz_mutate) {
+    uint8_t seed[] = "12 34 +";
+    uint8_t data[16];
+    lr_fuzz_input_t input = { seed, 7 };
+    lr_fuzz_input_t *corpus = 0;
+    lr_sb_push(corpus, input);
+    uint64_t rng = 1;
+    int64_t size = 0;
+
+    for (int32_t i = 0; i < 10000; i++) {
+        size = _lr_fuzz_mutate(data, size, 16, corpus, &rng);
+        ASSERT_TRUE(size >= 0 && size <= 16);
+    }
+    lr_sb_free(corpus);
+    ASSERT_EQ(_lr_fuzz_bucket(3), 3, "%d");
+    ASSERT_EQ(_lr_fuzz_bucket(200), 8, "%d");
+}
+#endif
+
+TEST_CASE(this_should_pass_normalize_path) {
+    char path[64] = "./src/../inc//x.h";
+    lr_normalize_path(path, _LR_ARRAY_COUNT(path));
+    ASSERT_EQ(strcmp(path, "inc/x.h"), 0, "%d");
+    snprintf(path, _LR_ARRAY_COUNT(path), "..\\a\\.\\b.h");
+    lr_normalize_path(path, _LR_ARRAY_COUNT(path));
+    ASSERT_EQ(strcmp(path, "../a/b.h"), 0, "%d");
+}
+
+TEST_CASE(this_should_pass_match_function_definition) {
+    char source[] = "int f(int x) const { return g(x); }\n"
+                    "#define h(x) { x }\n"
+                    "TEST_CASE(t) { }\n";
+    lr_slice_t slice = { (int64_t)strlen(source), source };
+    int32_t count;
+    c_token_t *tokens = lr_lex_file(slice, &count);
+
+    int32_t matches = 0;
+    c_token_t name;
+    for (int32_t i = 0; i < count; i++)
+        if (match_function_definition(tokens, count, i, &name) &&
+            match_identifier(name, "f"))
+            matches++;
+    ASSERT_EQ(matches, 1, "%d");
+    ASSERT_TRUE(match_function_definition(tokens, count, 1, &name));
+    free(tokens);
+}
+
+TEST_CASE(this_should_pass_transitive_hash) {
+    // 0 includes 1, which includes 0 back, and 2 includes 1
+    lr_source_file_t *files = 0;
+    for (int32_t i = 0; i < 3; i++) {
+        lr_source_file_t file = { 0 };
+        file.hash = 1ull << (i * 8);
+        lr_sb_push(files, file);
+    }
+    lr_sb_push(files[0].edges, 1);
+    lr_sb_push(files[1].edges, 0);
+    lr_sb_push(files[2].edges, 1);
+
+    ASSERT_EQ(lr_transitive_hash(files, 0), 0x101ull, "%" PRIx64);
+    ASSERT_EQ(lr_transitive_hash(files, 1), 0x101ull, "%" PRIx64);
+    ASSERT_EQ(lr_transitive_hash(files, 2), 0x10101ull, "%" PRIx64);
+    for (int32_t i = 0; i < 3; i++)
+        lr_sb_free(files[i].edges);
+    lr_sb_free(files);
+}
+
+#ifdef LR_SELF_TEST
+TEST_CASE(this_should_pass_propagate_changes) {
+    // 1 includes 2, which includes 3; 4 includes nothing
+    int32_t includes[][2] = { { 1, 2 }, { 2, 3 } };
+    bool affected[5] = { false, false, false, true, false };
+    _lr_propagate_changes(affected, includes, 2);
+    ASSERT_TRUE(affected[1] && affected[2] && affected[3]);
+    ASSERT_FALSE(affected[4]);
+}
+
+TEST_CASE(this_should_pass_coverage_narrows_changes) {
+    int32_t number = _lr_test_number(1, "this_should_pass_true");
+    ASSERT_TRUE(number > 0);
+    int32_t file = __lr_test_files[number].file;
+    int64_t file_count = _LR_ARRAY_COUNT(__lr_source_files);
+    int64_t test_count = _LR_ARRAY_COUNT(__lr_test_files);
+
+    // the test's file is affected through something it includes
+    bool *changed = (bool *)calloc(file_count, sizeof(bool));
+    bool *affected = (bool *)calloc(file_count, sizeof(bool));
+    bool *mapped = (bool *)calloc(test_count, sizeof(bool));
+    bool *covering = (bool *)calloc(test_count, sizeof(bool));
+    affected[file] = true;
+    __lr_affected_files = affected;
+    __lr_changed_files = changed;
+    __lr_affected_tests = covering;
+    ASSERT_TRUE(_lr_test_affected(number, "this_should_pass_true"));
+
+    // but none of the functions it ran changed
+    __lr_mapped_tests = mapped;
+    mapped[number] = true;
+    bool skipped = !_lr_test_affected(number, "this_should_pass_true");
+    covering[number] = true;
+    bool covered = _lr_test_affected(number, "this_should_pass_true");
+    covering[number] = false;
+    changed[file] = true;
+    bool edited = _lr_test_affected(number, "this_should_pass_true");
+
+    __lr_affected_files = 0;
+    __lr_changed_files = 0;
+    __lr_mapped_tests = 0;
+    __lr_affected_tests = 0;
+    free(changed);
+    free(affected);
+    free(mapped);
+    free(covering);
+    ASSERT_TRUE(skipped);
+    ASSERT_TRUE(covered);
+    ASSERT_TRUE(edited);
+}
+#endif
+
+#if defined(LR_SELF_TEST) && _LR_CAN_RECORD_COVERAGE
+TEST_CASE(this_should_pass_unmangle) {
+    char name[64];
+    _lr_unmangle("_ZN4math4Calc3runEi", name, _LR_ARRAY_COUNT(name));
+    ASSERT_EQ(strcmp(name, "run"), 0, "%d");
+    _lr_unmangle("_ZNK4Calc3runEi", name, _LR_ARRAY_COUNT(name));
+    ASSERT_EQ(strcmp(name, "run"), 0, "%d");
+    _lr_unmangle("_Z4calci", name, _LR_ARRAY_COUNT(name));
+    ASSERT_EQ(strcmp(name, "calc"), 0, "%d");
+    _lr_unmangle("calc", name, _LR_ARRAY_COUNT(name));
+    ASSERT_EQ(strcmp(name, "calc"), 0, "%d");
+}
+#endif
+
+TEST_CASE(this_should_pass_first_difference) {
+    unsigned char a[200];
+    unsigned char b[200];
+    for (int32_t i = 0; i < 200; i++)
+        a[i] = b[i] = (unsigned char)i;
+
+    ASSERT_EQ(_lr_first_difference(a, b, 200), -1, "%" PRId64);
+    for (int32_t i = 0; i < 200; i += 7) {
+        b[i] ^= 1;
+        ASSERT_EQ(_lr_first_difference(a, b, 200), i, "%" PRId64);
+        ASSERT_EQ(_lr_first_difference_scalar(a, b, 0, 200), i, "%" PRId64);
+#if _LR_HAS_SSE2_KERNELS
+        ASSERT_EQ(_lr_first_difference_sse2(a, b, 200), i, "%" PRId64);
+#endif
+        ASSERT_EQ(_lr_first_difference(a, b, i), -1, "%" PRId64);
+        b[i] ^= 1;
+    }
+    ASSERT_MEM_EQ(a, b, 200);
+}
+
+TEST_CASE(this_should_pass_tolerance) {
+    double special[] = { 0.0, -0.0, 1.0, -1.0, 1e-310, -1e-310, 1e300,
+                         -1e300, 1e300 * 1e300, -1e300 * 1e300 };
+    double a[101];
+    double b[101];
+    float af[101];
+    float bf[101];
+    for (int32_t i = 0; i < 101; i++) {
+        a[i] = special[i % 10] * (1.0 + (i % 3) * 1e-9);
+        b[i] = special[(i * 7) % 10];
+        af[i] = (float)a[i];
+        bf[i] = (float)b[i];
+    }
+    a[50] = b[50] = af[50] = bf[50] = 0.0 / special[0];
+
+    int64_t near = _lr_count_not_near_f64_scalar(a, b, 0, 101, 1e-6, 1e-6);
+    int64_t ulp = _lr_count_not_ulp_eq_f64_scalar(a, b, 0, 101, 1 << 20);
+    int64_t near_f = _lr_count_not_near_f32_scalar(af, bf, 0, 101, 1e-6f,
+                                                   1e-6f);
+    int64_t ulp_f = _lr_count_not_ulp_eq_f32_scalar(af, bf, 0, 101, 4);
+    ASSERT_EQ(_lr_count_not_near(a, b, 101, 8, 1e-6, 1e-6), near, "%" PRId64);
+    ASSERT_EQ(_lr_count_not_ulp_eq(a, b, 101, 8, 1 << 20), ulp, "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near(af, bf, 101, 4, 1e-6, 1e-6), near_f,
+              "%" PRId64);
+    ASSERT_EQ(_lr_count_not_ulp_eq(af, bf, 101, 4, 4), ulp_f, "%" PRId64);
+#if _LR_HAS_SSE2_KERNELS
+    ASSERT_EQ(_lr_count_not_near_f64_sse2(a, b, 101, 1e-6, 1e-6), near,
+              "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near_f32_sse2(af, bf, 101, 1e-6f, 1e-6f),
+              near_f, "%" PRId64);
+    ASSERT_EQ(_lr_count_not_ulp_eq_f32_sse2(af, bf, 101, 4), ulp_f,
+              "%" PRId64);
+#endif
+
+    // rel_tol times infinity is infinity, which mustn't make infinity near
+    // everything
+    double inf = 1e300 * 1e300;
+    double pairs[][2] = { { inf, inf }, { inf, -inf }, { inf, 5 },
+                          { -inf, inf }, { inf, 1e30 }, { 1e30, inf },
+                          { 5, inf }, { -1e30, 1e30 } };
+    for (int32_t i = 0; i < 101; i++) {
+        a[i] = b[i] = af[i] = bf[i] = 1;
+        if (i % 10 < _LR_ARRAY_COUNT(pairs)) {
+            a[i] = pairs[i % 10][0];
+            b[i] = pairs[i % 10][1];
+            af[i] = (float)a[i];
+            bf[i] = (float)b[i];
+        }
+    }
+    int64_t not_near = 7 * 10; // 100 is { inf, inf } again
+    ASSERT_EQ(_lr_count_not_near_f64_scalar(a, b, 0, 101, 1e-6, 1e-6),
+              not_near, "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near(a, b, 101, 8, 1e-6, 1e-6), not_near,
+              "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near_f32_scalar(af, bf, 0, 101, 1e-6f, 1e-6f),
+              not_near, "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near(af, bf, 101, 4, 1e-6, 1e-6), not_near,
+              "%" PRId64);
+#if _LR_HAS_SSE2_KERNELS
+    ASSERT_EQ(_lr_count_not_near_f64_sse2(a, b, 101, 1e-6, 1e-6), not_near,
+              "%" PRId64);
+    ASSERT_EQ(_lr_count_not_near_f32_sse2(af, bf, 101, 1e-6f, 1e-6f),
+              not_near, "%" PRId64);
+#endif
+#if _LR_HAS_AVX2_KERNELS
+    if (_lr_cpu_has_avx2()) {
+        ASSERT_EQ(_lr_count_not_near_f64_avx2(a, b, 101, 1e-6, 1e-6),
+                  not_near, "%" PRId64);
+        ASSERT_EQ(_lr_count_not_near_f32_avx2(af, bf, 101, 1e-6f, 1e-6f),
+                  not_near, "%" PRId64);
+    }
+#endif
+
+    ASSERT_EQ(_lr_ulp_distance_f64(0.0, -0.0), 0, "%" PRIu64);
+    ASSERT_EQ(_lr_ulp_distance_f32(1e-45f, -1e-45f), 2, "%" PRIu64);
+    ASSERT_NEAR(0.1 + 0.2, 0.3, 1e-12);
+    ASSERT_NEAR(1.0f, 1.0, 0);
+    ASSERT_ULP_EQ(0.1 + 0.2, 0.3, 1);
+    ASSERT_ULP_EQ(0.1f + 0.2f, 0.3f, 1);
+    a[50] = af[50] = 1;
+    for (int32_t i = 0; i < 101; i++)
+        b[i] = a[i] * (1 + 1e-12);
+    ASSERT_ARRAY_NEAR(a, b, 101, 0, 1e-11);
+    ASSERT_ARRAY_ULP(af, af, 101, 0);
+}
+
+TEST_CASE_VECTORS(this_should_pass_vectors, "labrat.h") {
+    ASSERT_TRUE(record_index >= 0);
+    ASSERT_TRUE(!memchr(record, '\n', record_size));
+}
+
+TEST_CASE(this_should_pass_mann_whitney) {
+    double slow[] = { 20, 21, 22, 20, 21, 22, 20, 21 };
+    double fast[] = { 10, 11, 12, 10, 11, 12, 10, 11 };
+
+    ASSERT_TRUE(_lr_mann_whitney_p(fast, 8, slow, 8) < 0.01);
+    ASSERT_TRUE(_lr_mann_whitney_p(fast, 8, fast, 8) > 0.5);
+}
+
 #undef LR_GEN_EXECUTABLE
 #endif // #ifdef LR_GEN_EXECUTABLE
 